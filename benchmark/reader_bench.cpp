@@ -0,0 +1,105 @@
+// Measures how `database::read_consistent` scales with the number of reader threads, while one
+// thread keeps writing the database. Usage: chainbase_reader_bench [seconds per run] [max threads]
+
+#include <chainbase/chainbase.hpp>
+#include <filesystem>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+namespace fs  = std::filesystem;
+namespace bmi = boost::multi_index;
+
+struct account : public chainbase::object<0, account> {
+   template<typename Constructor>
+   account(Constructor&& c, chainbase::constructor_tag) { c(*this); }
+
+   id_type  id;
+   uint64_t balance = 0;
+};
+
+using account_index = bmi::multi_index_container<
+   account,
+   bmi::indexed_by<
+      bmi::ordered_unique<bmi::member<account, account::id_type, &account::id>>
+   >,
+   chainbase::node_allocator<account>
+>;
+
+CHAINBASE_SET_INDEX_TYPE(account, account_index)
+
+int main(int argc, char** argv)
+{
+   const double   seconds     = argc > 1 ? std::atof(argv[1]) : 1.0;
+   const unsigned max_threads = argc > 2 ? std::atoi(argv[2]) : 64;
+   constexpr int64_t num_accounts = 1024 * 1024;
+
+   fs::path temp = fs::temp_directory_path() / "chainbase_reader_bench";
+   try {
+      chainbase::database db(temp, chainbase::database::read_write, 256ull * 1024 * 1024, false,
+                             chainbase::pinnable_mapped_file::map_mode::heap);
+      db.add_index<account_index>();
+      for (int64_t i = 0; i < num_accounts; ++i)
+         db.create<account>([](account& a) { a.balance = 1000; });
+      db.enable_concurrent_reads();
+
+      printf("%8s %16s %16s %16s\n", "threads", "reads/s", "reads/s/thread", "revisions/s");
+      for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+         std::atomic<bool>     stop = false;
+         std::atomic<uint64_t> num_reads = 0;
+
+         std::vector<std::thread> readers;
+         for (unsigned t = 0; t < num_threads; ++t) {
+            readers.emplace_back([&, t]() {
+               boost::random::mt19937 gen(t);
+               boost::random::uniform_int_distribution<int64_t> dist(0, num_accounts - 1);
+               uint64_t reads = 0, total = 0;
+               while (!stop.load(std::memory_order_relaxed)) {
+                  total += db.read_consistent([&]() {
+                     const account* a = db.find<account>(account::id_type(dist(gen)));
+                     return a ? a->balance : 0;
+                  });
+                  ++reads;
+               }
+               num_reads += reads + (total == 0);       // keeps the reads from being optimized out
+            });
+         }
+
+         // the writer moves balances between accounts, one revision per transfer
+         boost::random::mt19937 gen(42);
+         boost::random::uniform_int_distribution<int64_t> dist(0, num_accounts - 1);
+         uint64_t num_revisions = 0;
+         const auto start = std::chrono::steady_clock::now();
+         const auto end   = start + std::chrono::duration<double>(seconds);
+         while (std::chrono::steady_clock::now() < end) {
+            auto session = db.start_undo_session(true);
+            db.modify(db.get<account>(account::id_type(dist(gen))), [](account& a) { --a.balance; });
+            db.modify(db.get<account>(account::id_type(dist(gen))), [](account& a) { ++a.balance; });
+            session.push();
+            if (++num_revisions % 16 == 0)
+               db.commit(db.revision());
+         }
+         stop = true;
+         for (auto& t : readers)
+            t.join();
+
+         const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+         printf("%8u %16.0f %16.0f %16.0f\n", num_threads, num_reads / elapsed, num_reads / elapsed / num_threads,
+                num_revisions / elapsed);
+      }
+   } catch (...) {
+      fs::remove_all(temp);
+      throw;
+   }
+   fs::remove_all(temp);
+   return 0;
+}
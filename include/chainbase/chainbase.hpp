@@ -8,8 +8,6 @@
 #include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
-#include <boost/interprocess/sync/sharable_lock.hpp>
 #include <boost/core/demangle.hpp>
 
 #include <boost/multi_index_container.hpp>
@@ -21,9 +19,14 @@
 
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <typeindex>
 #include <typeinfo>
 #include <set>
@@ -33,10 +36,8 @@
 #include <chainbase/shared_cow_vector.hpp>
 #include <chainbase/chainbase_node_allocator.hpp>
 #include <chainbase/undo_index.hpp>
-
-#ifndef CHAINBASE_NUM_RW_LOCKS
-   #define CHAINBASE_NUM_RW_LOCKS 10
-#endif
+#include <chainbase/snapshot.hpp>
+#include <chainbase/change_log.hpp>
 
 namespace chainbase {
 
@@ -52,9 +53,6 @@ namespace chainbase {
    template<typename T>
    using shared_vector = shared_cow_vector<T>;
    
-   typedef boost::interprocess::interprocess_sharable_mutex read_write_mutex;
-   typedef boost::interprocess::sharable_lock< read_write_mutex > read_lock;
-
    /**
     *  Object ID type that includes the type of the object it references
     */
@@ -169,14 +167,28 @@ namespace chainbase {
 
          virtual void remove_object( int64_t id ) = 0;
 
+         virtual bool    has_undo_session()const = 0;
+         virtual void    set_next_id( int64_t id ) = 0;
+         virtual void    write_snapshot( snapshot_section_writer& out, bool committed )const = 0;
+         virtual void    read_snapshot_row( int64_t id, snapshot_row_reader& in, std::mutex& construct_mutex ) = 0;
+         virtual void    write_changes( int64_t revision, change_record_writer& out )const = 0;
+
+         // the same index in `to`, a copy of the segment `from` (see `database::fork`)
+         virtual unique_ptr<abstract_index> fork( const segment_manager* from, segment_manager* to )const = 0;
+
          void* get()const { return _idx_ptr; }
       private:
          void* _idx_ptr;
    };
 
+   template<typename IndexType>
+   class index;
+
    template<typename BaseIndex>
    class index_impl : public abstract_index {
       public:
+         using value_type = typename BaseIndex::value_type;
+
          index_impl( BaseIndex& base ):abstract_index( &base ),_base(base){}
 
          virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) override {
@@ -196,47 +208,79 @@ namespace chainbase {
          virtual std::pair<uint64_t, uint64_t> undo_stack_revision_range()const override { return _base.undo_stack_revision_range(); }
 
          virtual void     remove_object( int64_t id ) override { return _base.remove_object( id ); }
-      private:
-         BaseIndex& _base;
-         std::string BaseIndex_name = boost::core::demangle( typeid( typename BaseIndex::value_type ).name() );
-   };
-
-   template<typename IndexType>
-   class index : public index_impl<IndexType> {
-      public:
-         index( IndexType& i ):index_impl<IndexType>( i ){}
-   };
 
+         virtual bool     has_undo_session()const override { return _base.has_undo_session(); }
+         virtual void     set_next_id( int64_t id ) override { _base.set_next_id( typename value_type::id_type( id ) ); }
 
-   class read_write_mutex_manager
-   {
-      public:
-         read_write_mutex_manager()
-         {
-            _current_lock = 0;
+         virtual void     write_snapshot( snapshot_section_writer& out, bool committed )const override {
+            if constexpr( snapshot_serializable<value_type> ) {
+               auto write_rows = [&]( const auto& objects ) {
+                  for( const value_type& obj : objects ) {
+                     auto row = out.begin_row( obj.id._id );
+                     snapshot_serializer<value_type>::write( row, obj );
+                     out.end_row();
+                  }
+               };
+               if( committed ) {
+                  auto view = _base.get_committed_view();
+                  write_rows( view );
+                  out.set_next_id( view.next_id()._id );
+               } else {
+                  write_rows( _base.indices() );
+                  out.set_next_id( _base.next_id()._id );
+               }
+            } else {
+               BOOST_THROW_EXCEPTION( std::logic_error( "no snapshot_serializer for " + BaseIndex_name ) );
+            }
          }
 
-         ~read_write_mutex_manager(){}
-
-         void next_lock()
-         {
-            _current_lock++;
-            new( &_locks[ _current_lock % CHAINBASE_NUM_RW_LOCKS ] ) read_write_mutex();
+         // the shared pools of the segment are not thread-safe, so objects are constructed one at a time
+         virtual void     read_snapshot_row( int64_t id, snapshot_row_reader& in, std::mutex& construct_mutex ) override {
+            if constexpr( snapshot_serializable<value_type> ) {
+               _base.emplace_with_id( typename value_type::id_type( id ), [&]( value_type& v ) {
+                  std::lock_guard g( construct_mutex );
+                  snapshot_serializer<value_type>::read( in, v );
+               } );
+            } else {
+               BOOST_THROW_EXCEPTION( std::logic_error( "no snapshot_serializer for " + BaseIndex_name ) );
+            }
          }
 
-         read_write_mutex& current_lock()
-         {
-            return _locks[ _current_lock % CHAINBASE_NUM_RW_LOCKS ];
+         // the changes from `revision` to the next one
+         virtual void     write_changes( int64_t revision, change_record_writer& out )const override {
+            if constexpr( snapshot_serializable<value_type> ) {
+               auto changes = _base.diff( revision, revision + 1 );
+               auto write = [&]( change_kind kind, const value_type& obj ) {
+                  auto row = out.begin_change( value_type::type_id, kind, obj.id._id );
+                  snapshot_serializer<value_type>::write( row, obj );
+                  out.end_change();
+               };
+               for( const value_type* obj : changes.created )
+                  write( change_kind::created, *obj );
+               for( const auto& [old_value, new_value] : changes.modified )
+                  write( change_kind::modified, *new_value );
+               for( const value_type* obj : changes.removed )
+                  out.add_removed( value_type::type_id, obj->id._id );
+            } else {
+               BOOST_THROW_EXCEPTION( std::logic_error( "no snapshot_serializer for " + BaseIndex_name ) );
+            }
          }
 
-         uint32_t current_lock_num()
-         {
-            return _current_lock;
+         virtual unique_ptr<abstract_index> fork( const segment_manager* from, segment_manager* to )const override {
+            auto* base = reinterpret_cast<BaseIndex*>( (char*)to + ( (const char*)&_base - (const char*)from ) );
+            base->validate();
+            return unique_ptr<abstract_index>( new index<BaseIndex>( *base ) );
          }
-
       private:
-         std::array< read_write_mutex, CHAINBASE_NUM_RW_LOCKS >     _locks;
-         std::atomic< uint32_t >                                    _current_lock;
+
+         BaseIndex& _base;
+         std::string BaseIndex_name = boost::core::demangle( typeid( typename BaseIndex::value_type ).name() );
+   };
+
+   template<typename IndexType>
+   class index : public index_impl<IndexType> {
+      public:
+         index( IndexType& i ):index_impl<IndexType>( i ){}
    };
 
 
@@ -264,46 +308,78 @@ namespace chainbase {
          database& operator=(const database&) = delete;
 
          bool is_read_only() const { return _read_only; }
-         void flush();
+
+         /**
+          * Writes back the modified pages of the next `max_bytes` of the database file, in the background, without
+          * waiting for more than the previous call's writeback. Calling it regularly bounds the amount of
+          * data `checkpoint()` (or closing the database) must then write synchronously in `mapped` mode.
+          * Does nothing for a read-only database. See `pinnable_mapped_file::flush`.
+          */
+         void flush( size_t max_bytes = default_flush_size );
+         static constexpr size_t default_flush_size = 64*1024*1024;
 
          struct session {
             public:
-               session( session&& s ):_index_sessions( std::move(s._index_sessions) ){}
+               session( session&& s ):_index_sessions( std::move(s._index_sessions) ),_db( s._db ),_publish( s._publish ){}
                session( vector<std::unique_ptr<abstract_session>>&& s ):_index_sessions( std::move(s) )
                {
                }
 
                ~session() {
+                  // a destructor must not throw: evict the reads of this thread, if any, rather than fail
+                  if( _db && !_index_sessions.empty() ) _db->_db_file.begin_write( false );
                   undo();
                }
 
                void push()
                {
                   for( auto& i : _index_sessions ) i->push();
-                  _index_sessions.clear();
+                  if( _db && !_index_sessions.empty() ) _db->_pushed_revision = _db->revision();
+                  end();
                }
 
                void squash()
                {
+                  if( _db && !_index_sessions.empty() ) _db->_db_file.begin_write();
                   for( auto& i : _index_sessions ) i->squash();
-                  _index_sessions.clear();
+                  if( _db && !_index_sessions.empty() ) _db->discard_changes();
+                  end();
                }
 
                void undo()
                {
+                  if( _db && !_index_sessions.empty() ) _db->_db_file.begin_write();
                   for( auto& i : _index_sessions ) i->undo();
-                  _index_sessions.clear();
+                  if( _db && !_index_sessions.empty() ) _db->discard_changes();
+                  end();
                }
 
             private:
                friend class database;
                session(){}
+               session( vector<std::unique_ptr<abstract_session>>&& s, database& db, bool publish )
+                  :_index_sessions( std::move(s) ),_db( &db ),_publish( publish ){}
+
+               void end()
+               {
+                  if( _db && _publish && !_index_sessions.empty() ) _db->publish();
+                  _index_sessions.clear();
+               }
 
                vector< std::unique_ptr<abstract_session> > _index_sessions;
+               database*                                   _db = nullptr;
+               bool                                        _publish = true;  // the database at the end of the session
          };
 
          session start_undo_session( bool enabled );
 
+         /**
+          * Starts an undo session which is not a revision boundary: the database is neither published, journaled
+          * nor checkpointed when it starts or ends, so it remains unpublished until the enclosing session ends.
+          * For the many short sessions squashed or undone within another one, such as those of transactions.
+          */
+         session start_nested_undo_session();
+
          int64_t revision()const {
              if( _index_list.size() == 0 ) return -1;
              return _index_list[0]->revision();
@@ -314,13 +390,158 @@ namespace chainbase {
          void commit( int64_t revision );
          void undo_all();
 
+         /**
+          * Writes the database to its file, so that it can be reopened in its current state after a crash. Only
+          * the pages modified since the previous checkpoint are written if the kernel tracks them, otherwise the
+          * whole database is. Must not be called while an object is being modified. See
+          * `pinnable_mapped_file::checkpoint`.
+          */
+         void checkpoint();
+
+         /**
+          * When `interval` is not zero, `checkpoint()` is called at the first revision boundary (start of an
+          * undo session or `commit`) after `interval` has elapsed since the previous checkpoint.
+          */
+         void set_checkpoint_interval( std::chrono::milliseconds interval );
+
+         /**
+          * Journals the pages modified between revision boundaries (start of an undo session or `commit`), so that
+          * after a crash the database reopens in its state at the last boundary instead of at the last checkpoint.
+          * Each boundary writes the modified pages to the journal, but only `commit` waits until the journal is
+          * durable, so after a crash of the system the database reopens in its state at the last `commit`. Only
+          * checkpoints empty the journal, so the checkpoint interval bounds its size. Not supported in `mapped` mode.
+          * See `pinnable_mapped_file::enable_journal`.
+          */
+         void enable_journal();
+         uint64_t journal_size() const { return _db_file.journal_size(); }
+
+         /**
+          * Writes the objects of all the indices to `out`, in a stream which does not depend on the environment of
+          * the database (see `snapshot_row_writer`). Every index needs a `snapshot_serializer`. Up to `num_threads`
+          * indices are serialized concurrently, each in id order, into checksummed chunks which are written as
+          * they fill up. Must not be called while the database is being modified.
+          */
+         void write_snapshot( std::ostream& out, unsigned num_threads = std::thread::hardware_concurrency() )const;
+
+         /**
+          * Same as `write_snapshot`, but of the database as of the oldest revision of the undo stack (the last
+          * committed one), read through the `undo_index::revision_view` of each index (see `get_committed_view`).
+          * Nothing is undone, so the undo sessions since that revision remain and the database can keep going from
+          * its head state once this returns.
+          */
+         void write_committed_snapshot( std::ostream& out, unsigned num_threads = std::thread::hardware_concurrency() )const;
+
+         /**
+          * Loads a stream written by `write_snapshot` into the indices of its objects, which must have been added,
+          * be empty and have no undo session, and sets the revision of the database to that of the snapshot.
+          * Up to `num_threads` indices are loaded concurrently. Throws if the stream is corrupted, in which case
+          * the indices are left partially loaded.
+          */
+         void read_snapshot( std::istream& in, unsigned num_threads = std::thread::hardware_concurrency() );
+
+         /**
+          * Appends to `log` one record of the changes of all the indices (see `change_record_writer`) for every revision
+          * which becomes irreversible through `commit`, before the undo history of that revision is discarded. Revisions
+          * which are undone are never recorded, and only the objects which changed are read. Every index needs a
+          * `snapshot_serializer`. Changes made while there is no undo session are not recorded. Pass nullptr to stop.
+          *
+          * The record of a revision whose session was pushed is made when the next session starts, from the undo
+          * state of that session alone, and kept until the revision is committed, undone or squashed.
+          */
+         void set_change_log( std::shared_ptr<change_log> log ) { _change_log = std::move( log ); _pending_changes.clear(); }
+
+         /**
+          * Consistent reads of a database in `mapped` mode by other processes while it is being written (typically
+          * opened `read_only`). The writer publishes a state at every revision boundary: when an undo session is
+          * pushed, squashed or undone, when a session starts, and on `commit`. Between a publication and its next
+          * modification, the database does not change.
+          *
+          * A `read_guard` waits for a published state, and registers its reader in a slot of the `reader_registry`
+          * (in the `shared_memory.readers` file next to the database, which readers must be able to write). Before its
+          * first modification after a publication, the writer waits until no guard is registered, so the state read
+          * while a guard exists does not change and `valid()` stays true. Guards should therefore be short lived, and
+          * the thread which writes the database must not hold one (its writes throw). Registering is a
+          * compare-and-swap on a cache line of its own, so readers never contend with each other, and they never wait
+          * while the writer publishes.
+          *
+          * The writer never waits for longer than `set_reader_timeout` (one second by default): it then evicts the
+          * readers still registered, as well as at once those whose process died. What an evicted reader read is
+          * inconsistent, and `valid()` returns false. Its reads may have seen torn data, including objects and links
+          * being rewritten, so readers must not loop on what they read nor keep pointers into the database. In the
+          * other modes, other processes do not see the writes and a guard is always valid.
+          *
+          * After `enable_concurrent_reads()`, other threads of the writing process read the same way in any mode,
+          * registered in a `reader_registry` of the writing process.
+          */
+         class read_guard {
+            public:
+               explicit read_guard( const database& db ) : _db( db ) {
+                  std::tie( _sequence, _revision ) = _db._db_file.begin_read( _slot );
+               }
+               ~read_guard() { _db._db_file.end_read( _slot ); }
+               read_guard( const read_guard& ) = delete;
+               read_guard& operator=( const read_guard& ) = delete;
+
+               int64_t revision()const { return _revision; }          // published by the writer
+               bool    valid()const {                                 // the writer waits for registered readers
+                  return _db._db_file.still_pinned( _slot ) || _db._db_file.still_published( _sequence );
+               }
+
+            private:
+               const database&               _db;
+               reader_registry::pinned_slot  _slot;
+               uint64_t                      _sequence;
+               int64_t                       _revision;
+         };
+
+         // How long the writer waits for registered readers before its first modification after a publication.
+         void set_reader_timeout( std::chrono::microseconds timeout ) { _db_file.set_reader_timeout( timeout ); }
+
+         /**
+          * Lets other threads read this database with a `read_guard` while this thread writes it (see above). Must be
+          * called by the writing thread before the readers start.
+          */
+         void enable_concurrent_reads();
+
+         /**
+          * Returns a copy of this database which is written independently, e.g. to evaluate a speculative block on
+          * another thread, and discarded by destroying it. The fork has the same indices, revision and undo stack,
+          * including the sessions still open here, which it can push or undo on its own. It lives in a private
+          * mapping of its own, which copies only the pages modified since the last save, or holding data if the
+          * file is written directly (see `pinnable_mapped_file::fork`). It is never saved: it cannot be
+          * checkpointed nor journaled, and does not log its changes. Must be called
+          * while this database is not being written, e.g. by its writing thread. Forks can be forked as well.
+          */
+         database fork()const;
+
+         // Calls `f()` until it ran over a published state without the writer modifying the database, and returns its result.
+         template<typename F>
+         auto read_consistent( F&& f )const {
+            for( ;; ) {
+               read_guard guard( *this );
+               try {
+                  if constexpr( std::is_void_v<decltype( f() )> ) {
+                     f();
+                     if( guard.valid() ) return;
+                  } else {
+                     auto result = f();
+                     if( guard.valid() ) return result;
+                  }
+               } catch( ... ) {
+                  if( guard.valid() ) throw;                            // not caused by a torn read
+               }
+            }
+         }
+
 
          void set_revision( uint64_t revision )
          {
              if ( _read_only_mode ) {
                 BOOST_THROW_EXCEPTION( std::logic_error( "attempting to set revision in read-only mode" ) );
              }
+             _db_file.begin_write();
              for( auto i : _index_list ) i->set_revision( revision );
+             publish();
          }
 
 
@@ -400,13 +621,43 @@ namespace chainbase {
             return _db_file.get_segment_manager();
          }
 
+         const small_size_allocator_t& get_small_size_allocator() const {
+            return *_db_file.get_small_size_allocator();
+         }
+
+         /**
+          * Identical `shared_string` and `shared_vector` payloads of at least `min_size` bytes, written
+          * from now on, share a single buffer. The setting is persisted in the database.
+          */
+         void enable_interning(size_t min_size = 0) {
+            _db_file.enable_interning(min_size);
+         }
+
+         // nullptr if interning was never enabled for this database
+         const intern_table_t* get_intern_table() const {
+            return _db_file.get_intern_table();
+         }
+
+         /**
+          * `shared_string` and `shared_vector` payloads of at least `min_size` bytes, written from now on,
+          * are stored compressed when it saves space. 0 disables compression. The setting is persisted in
+          * the database. Decompressed copies are kept in the `decompression_cache` until their payload is freed.
+          */
+         void set_compression_threshold(size_t min_size) {
+            _db_file.set_compression_threshold(min_size);
+         }
+
+         size_t get_compression_threshold() const {
+            return _db_file.get_compression_threshold();
+         }
+
          size_t get_free_memory()const
          {
             return _db_file.get_segment_manager()->get_free_memory();
          }
 
          size_t get_reclaimable_memory() const {
-            size_t ret = 0;
+            size_t ret = _db_file.get_small_size_allocator()->freelist_memory_usage();
             for(const unique_ptr<abstract_index>& ai_ptr : _index_map) {
                if(!ai_ptr)
                   continue;
@@ -441,6 +692,7 @@ namespace chainbase {
             if ( _read_only_mode ) {
                BOOST_THROW_EXCEPTION( std::logic_error( "attempting to get mutable index in read-only mode" ) );
             }
+            _db_file.begin_write();
             typedef generic_index<MultiIndexType> index_type;
             typedef index_type*                   index_type_ptr;
             assert( _index_map.size() > index_type::value_type::type_id );
@@ -465,6 +717,14 @@ namespace chainbase {
              return get_index< index_type >().find( key );
          }
 
+         // the objects of type ObjectType changed from `rev_a` to `rev_b`, both on the undo stack (see `undo_index::diff`)
+         template< typename ObjectType >
+         auto diff( int64_t rev_a, int64_t rev_b ) const
+         {
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().diff( rev_a, rev_b );
+         }
+
          template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
          const ObjectType& get( CompatibleKey&& key )const
          {
@@ -544,6 +804,16 @@ namespace chainbase {
          }
 
       private:
+         explicit database( pinnable_mapped_file&& file );
+
+         void on_revision_boundary( bool durable );
+         void publish() { _db_file.publish( revision() ); }
+         void log_changes( int64_t revision );
+         void record_changes();
+         void discard_changes();
+         std::vector<char> changes_of( int64_t revision )const;
+         void write_snapshot( std::ostream& out, unsigned num_threads, bool committed )const;
+
          pinnable_mapped_file                                        _db_file;
          bool                                                        _read_only = false;
 
@@ -557,6 +827,12 @@ namespace chainbase {
           */
          bool                                                        _read_only_mode = false;
 
+         std::chrono::milliseconds                                   _checkpoint_interval{0};
+         std::chrono::steady_clock::time_point                       _next_checkpoint;
+         std::shared_ptr<change_log>                                 _change_log;
+         std::deque<std::pair<int64_t, std::vector<char>>>           _pending_changes;     // records not committed yet, by revision
+         int64_t                                                     _pushed_revision = -1;  // of the last session pushed
+
          /**
           * This is a sparse list of known indices kept to accelerate creation of undo sessions
           */
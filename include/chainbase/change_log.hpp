@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chainbase/snapshot.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace chainbase {
+
+   // ---------------------------------------------------------------------------------------
+   // Change data capture (see `database::set_change_log`).
+   //
+   // Every revision which becomes irreversible is described by one record (integers
+   // little-endian): the revision, the number of changes, and for each change the type id of
+   // the object, the kind of change, the object id and, unless the object was removed, its
+   // new value as written by its `snapshot_serializer` prefixed with its size. The changes
+   // of an index are sorted by kind, then by id. Objects which did not change are not read.
+   // ---------------------------------------------------------------------------------------
+   enum class change_kind : uint8_t { created = 0, modified = 1, removed = 2 };
+
+   class change_record_writer {
+    public:
+      explicit change_record_writer(int64_t revision);
+
+      // the new value of the object must be written to the returned writer before `end_change`
+      snapshot_row_writer begin_change(uint16_t type_id, change_kind kind, int64_t id);
+      void                end_change();
+      void                add_removed(uint16_t type_id, int64_t id);
+
+      uint32_t            num_changes() const { return _num_changes; }
+      std::vector<char>   finish();
+
+    private:
+      void write_header(uint16_t type_id, change_kind kind, int64_t id);
+
+      std::vector<char>   _record;
+      size_t              _row_start = 0;
+      uint32_t            _num_changes = 0;
+   };
+
+   class change_record_reader {
+    public:
+      struct change {
+         uint16_t             type_id;
+         change_kind          kind;
+         int64_t              id;
+         snapshot_row_reader  row;                // empty when removed
+      };
+
+      change_record_reader(const char* data, size_t size);
+
+      int64_t  revision() const { return _revision; }
+      uint32_t num_changes() const { return _num_changes; }
+
+      // returns nothing at the end of the record
+      std::optional<change> next();
+
+    private:
+      snapshot_row_reader _in;
+      int64_t             _revision;
+      uint32_t            _num_changes;
+      uint32_t            _num_read = 0;
+   };
+
+   // Receives the records of the revisions which become irreversible, in order, on the thread committing them.
+   class change_log {
+    public:
+      virtual ~change_log() = default;
+      virtual void append(int64_t revision, std::vector<char>&& record) = 0;
+   };
+
+   // Keeps the most recent records in memory, up to `capacity` bytes of records (and at least the last one).
+   class change_ring : public change_log {
+    public:
+      explicit change_ring(size_t capacity) : _capacity(capacity) {}
+
+      void append(int64_t revision, std::vector<char>&& record) override;
+
+      // calls `f(revision, record)` for the records kept of the revisions after `revision`, in order
+      void read_after(int64_t revision, const std::function<void(int64_t, std::string_view)>& f) const;
+
+      // of the oldest record kept, or -1 when empty
+      int64_t first_revision() const;
+      size_t  size() const;                       // bytes of records kept
+
+    private:
+      struct entry {
+         int64_t           revision;
+         std::vector<char> record;
+      };
+
+      mutable std::mutex  _mutex;
+      size_t              _capacity;
+      size_t              _size = 0;
+      std::deque<entry>   _records;
+   };
+
+   // Appends the records, each prefixed with its 32 bit size, to a file. The records are not synced, a crash may
+   // lose or truncate the last ones.
+   class change_file : public change_log {
+    public:
+      explicit change_file(const std::filesystem::path& path);
+      ~change_file();
+
+      change_file(const change_file&) = delete;
+      change_file& operator=(const change_file&) = delete;
+
+      void append(int64_t revision, std::vector<char>&& record) override;
+
+      // calls `f(record)` for every complete record of the file at `path`
+      static void read(const std::filesystem::path& path, const std::function<void(std::string_view)>& f);
+
+    private:
+      std::filesystem::path _path;
+      int                   _fd = -1;
+   };
+
+}  // namespace chainbase
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace chainbase {
+
+   // ---------------------------------------------------------------------------------------
+   // Dependency-free LZ77 codec used for large `shared_cow_string` and `shared_cow_vector`
+   // payloads (see `pinnable_mapped_file::set_compression_threshold`).
+   //
+   // The format is a sequence of (literals, match) pairs in the spirit of LZ4 blocks. The
+   // output of `compress` depends only on its input, which allows compressed payloads to be
+   // interned. The uncompressed size is not part of the stream and must be known to
+   // `decompress`, which ignores any trailing padding.
+   // ---------------------------------------------------------------------------------------
+   namespace lz {
+      // returns the size of the compressed data written to `dst`, or 0 if it doesn't fit in `dst_capacity` bytes
+      size_t compress(const char* src, size_t src_size, char* dst, size_t dst_capacity);
+
+      // returns false if `src` is not a valid stream decompressing to at least `dst_size` bytes
+      bool decompress(const char* src, size_t src_size, char* dst, size_t dst_size);
+   }
+
+   // ---------------------------------------------------------------------------------------
+   // Compressed `shared_cow_string` and `shared_cow_vector` payloads: a checksum of the `lz`
+   // stream, followed by the stream. The checksum tells a `decompression_cache` whether what it
+   // cached for a payload address still matches the payload there, which may have been freed
+   // and replaced since, possibly by another process writing the segment.
+   // ---------------------------------------------------------------------------------------
+   namespace compressed_payload {
+      constexpr size_t header_size = sizeof(uint64_t);
+
+      // returns the size of the payload written to `dst`, or 0 if it doesn't fit in `dst_capacity` bytes
+      size_t compress(const char* src, size_t src_size, char* dst, size_t dst_capacity);
+   }
+
+   // ---------------------------------------------------------------------------------------
+   // Cache of decompressed payloads, shared by the threads of the process, keyed by the address
+   // of the compressed payload and validated by its checksum, so that a stale entry is never
+   // returned.
+   //
+   // Entries are never evicted to make room for others: a pointer returned by `get` remains
+   // valid until the compressed payload is freed (`erase`, which the last `shared_cow_string` or
+   // `shared_cow_vector` referencing it calls), or replaced by another one at the same address,
+   // or until its database is closed (`erase_range`). Like the object it was read from, it may
+   // therefore be kept, for example as the `std::string_view` key of an index. The cache holds
+   // the decompressed copies of all the compressed payloads read and not freed since.
+   // ---------------------------------------------------------------------------------------
+   struct decompression_cache {
+      // returns `size` decompressed bytes of the compressed payload `src` at `payload`, followed by a null char
+      static const char* get(const void* payload, const char* src, size_t src_size, size_t size);
+      static void        erase(const void* payload);
+      static void        erase_range(const void* begin, const void* end);
+      static void        clear();
+
+      static size_t      memory_usage();
+   };
+
+}  // namespace chainbase
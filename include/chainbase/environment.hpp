@@ -7,7 +7,11 @@ namespace chainbase {
 constexpr size_t header_size = 1024;
 // `CHAINB01` reflects changes since `EOSIODB3`.
 // Spring 1.0 is compatible with `CHAINB01`.
-constexpr uint64_t header_id = 0x3130424e49414843ULL; //"CHAINB01" little endian
+// `CHAINB02` adds a capacity and flags (for interning and compression) to the payloads of `shared_cow_string`
+// and `shared_cow_vector`, and stores short `shared_cow_string`s inline. It still reads the payloads written by
+// `CHAINB01`, and a `CHAINB01` database opened for writing becomes a `CHAINB02` one.
+constexpr uint64_t header_id = 0x3230424e49414843ULL; //"CHAINB02" little endian
+constexpr uint64_t chainb01_header_id = 0x3130424e49414843ULL; //"CHAINB01" little endian
 
 struct environment  {
    environment() {
@@ -70,9 +74,13 @@ struct db_header  {
    uint64_t id = header_id;
    bool dirty = false;
    environment dbenviron;
+   uint64_t sequence = 0;              // odd while the writer of a `mapped` database modifies it (see `pinnable_mapped_file::publish`)
+   int64_t published_revision = -1;    // by the writer, when `sequence` became even
 } __attribute__ ((packed));
 
 constexpr size_t header_dirty_bit_offset = offsetof(db_header, dirty);
+static_assert(offsetof(db_header, sequence) % sizeof(uint64_t) == 0, "sequence must be accessed atomically");
+static_assert(offsetof(db_header, published_revision) % sizeof(int64_t) == 0, "published_revision must be accessed atomically");
 
 static_assert(sizeof(db_header) <= header_size, "DB header struct too large");
 
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <boost/container/map.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   // ---------------------------------------------------------------------------------------
+   // Registry of the immutable `shared_cow_string` and `shared_cow_vector` payloads of a
+   // segment, keyed by a hash of their contents, so that identical payloads can share a
+   // single refcounted buffer.
+   //
+   // Interning is opt-in (see `pinnable_mapped_file::enable_interning`). Once enabled, the
+   // table lives in the segment and is found again when the database is reopened. The table
+   // only stores pointers: the payloads themselves know whether they are interned, are never
+   // modified in place once interned, and unregister themselves when their last reference
+   // goes away.
+   // ---------------------------------------------------------------------------------------
+   template<typename SegmentManager>
+   class intern_table {
+    public:
+      struct table_stats {
+         std::size_t num_entries = 0;  // number of interned payloads
+         uint64_t    num_lookups = 0;  // number of payloads checked against the table
+         uint64_t    num_hits    = 0;  // number of payloads replaced by an identical interned one
+      };
+
+      intern_table(SegmentManager* manager, std::size_t min_size)
+         : _map(allocator_type(manager))
+         , _min_size(min_size) {}
+
+      intern_table(const intern_table&) = delete;
+      intern_table& operator=(const intern_table&) = delete;
+
+      // payloads smaller than this (in bytes) are not interned
+      std::size_t min_size() const { return _min_size; }
+
+      // The hash is persisted in the segment, so it must not depend on the process or build.
+      // `seed` distinguishes payload kinds which must never share a buffer.
+      static uint64_t hash(const void* data, std::size_t sz, uint64_t seed) {
+         constexpr uint64_t m = 0x9e3779b97f4a7c15ULL;
+         auto mix = [](uint64_t h, uint64_t k) {
+            h = (h ^ k) * m;
+            return h ^ (h >> 29);
+         };
+         const char* p = static_cast<const char*>(data);
+         uint64_t h = seed ^ (sz * m);
+         for (; sz >= 8; sz -= 8, p += 8) {
+            uint64_t k;
+            std::memcpy(&k, p, 8);
+            h = mix(h, k);
+         }
+         if (sz) {
+            uint64_t k = 0;
+            std::memcpy(&k, p, sz);
+            h = mix(h, k);
+         }
+         return mix(h, h >> 32);
+      }
+
+      // returns an interned payload with hash `key` for which `equal(payload)` is true, or nullptr
+      template<class Equal>
+      char* find(uint64_t key, Equal&& equal) {
+         ++_stats.num_lookups;
+         auto [it, end] = _map.equal_range(key);
+         for (; it != end; ++it) {
+            if (std::invoke(equal, it->second.get())) {
+               ++_stats.num_hits;
+               return it->second.get();
+            }
+         }
+         return nullptr;
+      }
+
+      void insert(uint64_t key, char* payload) {
+         _map.emplace(key, payload);
+      }
+
+      void erase(uint64_t key, char* payload) {
+         auto [it, end] = _map.equal_range(key);
+         for (; it != end; ++it) {
+            if (it->second.get() == payload) {
+               _map.erase(it);
+               return;
+            }
+         }
+         assert(0); // interned payloads should always be in the table
+      }
+
+      table_stats stats() const {
+         table_stats res = _stats;
+         res.num_entries = _map.size();
+         return res;
+      }
+
+    private:
+      using value_type     = std::pair<const uint64_t, bip::offset_ptr<char>>;
+      using allocator_type = bip::allocator<value_type, SegmentManager>;
+      using map_t          = boost::container::multimap<uint64_t, bip::offset_ptr<char>, std::less<uint64_t>, allocator_type>;
+
+      map_t        _map;
+      std::size_t  _min_size;
+      table_stats  _stats;
+   };
+
+}  // namespace chainbase
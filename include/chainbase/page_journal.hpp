@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace chainbase {
+
+   // ---------------------------------------------------------------------------------------
+   // Redo journal of the pages of a database file, used to roll the last checkpoint of the
+   // file forward after a crash (see `pinnable_mapped_file::enable_journal`).
+   //
+   // The journal is a header followed by transactions. A transaction is a sequence of page
+   // records (file offset and page image) terminated by a commit record, which holds the
+   // number of pages, the revision of the database and a checksum of the transaction.
+   // Records are buffered and appended in large writes. `commit` writes the transaction, so that
+   // it survives a crash of the process, and `sync` makes all the transactions committed so far
+   // durable with a single fdatasync, so that several transactions share it. Recovery applies the
+   // complete transactions in order, so that every page ends up with its most recent image. An
+   // incomplete last transaction is ignored.
+   // ---------------------------------------------------------------------------------------
+   class page_journal {
+    public:
+      struct replay_result {
+         size_t  num_transactions = 0;
+         size_t  num_pages        = 0;
+         int64_t revision         = -1;     // of the last transaction applied
+      };
+
+      // creates an empty journal at `path` (replacing any existing file), and makes it durable
+      page_journal(std::filesystem::path path, size_t page_size);
+      ~page_journal();
+
+      page_journal(const page_journal&) = delete;
+      page_journal& operator=(const page_journal&) = delete;
+
+      // adds the `page_size` bytes at `page` to the current transaction, as the image of the page at `offset`
+      void append(uint64_t offset, const void* page);
+
+      // terminates the current transaction, and writes it to the file
+      void commit(int64_t revision);
+
+      // returns once the committed transactions are durable
+      void sync();
+
+      // drops what was appended since the last `commit`, e.g. after it failed, so that the journal can be
+      // appended to again
+      void rollback();
+
+      // durably drops all the transactions, once the file they apply to has been checkpointed
+      void reset();
+
+      // closes and deletes the journal
+      void remove();
+
+      uint64_t size() const { return _size + _buffer.size(); }
+
+      // Applies the complete transactions of the journal at `path` to the file open as `fd`, and makes
+      // the file durable. Returns nothing if `path` is not a valid journal.
+      static std::optional<replay_result> replay(const std::filesystem::path& path, int fd);
+
+    private:
+      void write_buffer();
+
+      std::filesystem::path   _path;
+      size_t                  _page_size;
+      int                     _fd = -1;
+      uint64_t                _size = 0;               // bytes written to the file
+      uint64_t                _committed_size = 0;     // up to the end of the last committed transaction
+      uint64_t                _synced_size = 0;        // durable
+      std::vector<char>       _buffer;                 // records not written yet
+      uint64_t                _num_pages = 0;          // in the current transaction
+      uint64_t                _checksum  = 0;          // of the current transaction
+   };
+
+}  // namespace chainbase
@@ -3,12 +3,15 @@
 #include <fcntl.h>    // open 
 #include <unistd.h>   // pread, sysconf
 #include <cstdlib> 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <vector>
+#include <functional>
 #include <span>
+#include <memory>
 #include <boost/interprocess/managed_mapped_file.hpp>
 
 namespace chainbase {
@@ -120,6 +123,33 @@ public:
       return false;
    }
 
+   // Calls `f(begin, end)` for each range of `rgn` whose pages are marked Soft-Dirty, without clearing anything.
+   // --------------------------------------------------------------------------------------
+   template<class F>
+   bool scan_dirty(std::span<std::byte> rgn, F&& f) const {
+      if (!_pagemap_supported)
+         return false;
+
+      assert(rgn.size() % pagesz == 0);
+      const size_t num_pages = rgn.size() / pagesz;
+      std::vector<uint64_t> pm(std::min<size_t>(num_pages, 4096));
+      for (size_t first = 0; first < num_pages; first += pm.size()) {
+         const size_t n = std::min(pm.size(), num_pages - first);
+         if (!read((uintptr_t)(rgn.data() + first * pagesz), { pm.data(), n }))
+            return false;
+         for (size_t i = 0; i < n; ++i) {
+            if (is_marked_dirty(pm[i])) {
+               size_t j = i + 1;
+               while (j < n && is_marked_dirty(pm[j]))
+                  ++j;
+               f(rgn.data() + (first + i) * pagesz, rgn.data() + (first + j) * pagesz);
+               i = j;
+            }
+         }
+      }
+      return true;
+   }
+
 private:
    bool _clear_refs() const {
       int fd = ::open("/proc/self/clear_refs", O_WRONLY);
@@ -186,4 +216,59 @@ private:
    mutable int _pagemap_fd = -1;
 };
 
-} // namespace chainbase
\ No newline at end of file
+// Tracks the pages written to a single mapping, using asynchronous userfaultfd write protection
+// (Linux 6.7+): the whole mapping is write-protected, the kernel lifts the protection of a page
+// (without notifying anyone) when it is first written to, and the `PAGEMAP_SCAN` ioctl reports the
+// written pages and protects them again.
+//
+// Unlike the Soft-Dirty bits, which can only be cleared for the whole process with `clear_refs`,
+// this doesn't interfere with the other mappings of the process.
+// ----------------------------------------------------------------------------------------------------
+class write_protect_tracker {
+public:
+   // Starts tracking the writes to `mapping`, which must be page aligned, or returns nullptr if this is
+   // not supported for it. Nothing is reported as written until the mapping is written to.
+   static std::unique_ptr<write_protect_tracker> create(std::span<std::byte> mapping);
+
+   ~write_protect_tracker();
+
+   write_protect_tracker(const write_protect_tracker&) = delete;
+   write_protect_tracker& operator=(const write_protect_tracker&) = delete;
+
+   // Calls `f(begin, end)` for each range of `rgn` written to since the previous scan of its pages, which are
+   // protected again unless `protect` is false. If it fails, pages may remain reported as written, which only
+   // costs an extra write later.
+   // --------------------------------------------------------------------------------------
+   bool scan_written(std::span<std::byte> rgn, const std::function<void(std::byte*, std::byte*)>& f, bool protect = true) const;
+
+   // Same as `pagemap_accessor::update_file_from_region`, the pages copied are protected again.
+   // --------------------------------------------------------------------------------------
+   bool update_file_from_region(std::span<std::byte> rgn, bip::file_mapping& mapping, size_t offset, bool flush, size_t& written_pages) const {
+      bip::mapped_region map_rgn(mapping, bip::read_write, offset, rgn.size());
+      std::byte* dest = (std::byte*)map_rgn.get_address();
+      if (!dest)
+         return false;
+
+      bool res = scan_written(rgn, [&](std::byte* b, std::byte* e) {
+         memcpy(dest + (b - rgn.data()), b, e - b);
+         written_pages += (e - b) / pagemap_accessor::page_size();
+      });
+      if (res && flush && !map_rgn.flush(0, rgn.size(), /* async = */ false))
+         std::cerr << "CHAINBASE: ERROR: flushing buffers failed" << '\n';
+      return res;
+   }
+
+private:
+   write_protect_tracker() = default;
+
+   bool _init(std::span<std::byte> mapping);
+
+   int _uffd = -1;
+   int _pagemap_fd = -1;
+};
+
+// Opens a non-blocking userfaultfd, restricted to faults from user space where the kernel supports it, as
+// unprivileged processes may only open those on many systems. Returns -1 if userfaultfd is not available.
+int open_userfaultfd();
+
+} // namespace chainbase
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <chainbase/chainbase.hpp>
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace chainbase {
+
+   // An object, or with `any_id` all the objects of a type
+   struct object_key {
+      static constexpr int64_t any_id = -1;
+
+      uint16_t type_id;
+      int64_t  id;
+
+      friend bool operator==( const object_key&, const object_key& ) = default;
+   };
+
+   struct object_key_hash {
+      size_t operator()( const object_key& k )const { return std::hash<int64_t>()( k.id ) ^ ( size_t( k.type_id ) << 48 ); }
+   };
+
+   /**
+    * The database as seen by one transaction of `apply_parallel`, which records what the transaction reads and
+    * writes, keyed by `object_key`.
+    *
+    * While the transactions run in parallel, reads see the database as it was before the batch, and writes are
+    * only recorded, to be applied when the batch is merged. Lookups by id read that object, while lookups by other
+    * keys, and lookups which find nothing, read the whole type (their result depends on which objects exist).
+    * Created objects get their id when they are applied, so `create` returns nothing. Modifiers and constructors
+    * are called after the transaction returned, so they must not capture anything: the values they use are
+    * passed after them, copied when the write is recorded, and given to them after the object.
+    *
+    * When a transaction is re-executed during the merge, the same calls read and write the database directly.
+    */
+   class transaction_context {
+      public:
+         transaction_context( database& db, bool speculative ) : _db( db ), _speculative( speculative ) {}
+
+         template< typename ObjectType >
+         const ObjectType* find( oid< ObjectType > id ) {
+            const ObjectType* obj = _db.find< ObjectType >( id );
+            add_read( ObjectType::type_id, obj ? id._id : object_key::any_id );
+            return obj;
+         }
+
+         template< typename ObjectType >
+         const ObjectType& get( oid< ObjectType > id ) {
+            if( const ObjectType* obj = find( id ) )
+               return *obj;
+            return _db.get< ObjectType >( id );                   // throws
+         }
+
+         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
+         const ObjectType* find( CompatibleKey&& key ) {
+            add_read( ObjectType::type_id, object_key::any_id );
+            return _db.find< ObjectType, IndexedByType >( std::forward< CompatibleKey >( key ) );
+         }
+
+         template< typename MultiIndexType >
+         const generic_index< MultiIndexType >& get_index() {
+            add_read( generic_index< MultiIndexType >::value_type::type_id, object_key::any_id );
+            return std::as_const( _db ).get_index< MultiIndexType >();
+         }
+
+         // calls `m( obj, args... )`
+         template< typename ObjectType, typename Modifier, typename... Args >
+         void modify( const ObjectType& obj, Modifier m, Args&&... args ) {
+            static_assert( std::is_empty_v< Modifier >, "modifiers must not capture, pass the values they use as arguments" );
+            add_write( ObjectType::type_id, obj.id._id );
+            if( _speculative )
+               _writes.push_back( std::make_unique< modify_write< ObjectType, Modifier, std::decay_t< Args >... > >( obj.id, std::forward< Args >( args )... ) );
+            else
+               _db.modify( obj, [&]( ObjectType& o ) { m( o, std::as_const( args )... ); } );
+         }
+
+         template< typename ObjectType >
+         void remove( const ObjectType& obj ) {
+            add_write( ObjectType::type_id, obj.id._id );
+            if( _speculative )
+               _writes.push_back( std::make_unique< remove_write< ObjectType > >( obj.id ) );
+            else
+               _db.remove( obj );
+         }
+
+         // constructs the object with `c( obj, args... )`
+         template< typename ObjectType, typename Constructor, typename... Args >
+         void create( Constructor c, Args&&... args ) {
+            static_assert( std::is_empty_v< Constructor >, "constructors must not capture, pass the values they use as arguments" );
+            if( _speculative ) {
+               add_write( ObjectType::type_id, object_key::any_id );
+               _writes.push_back( std::make_unique< create_write< ObjectType, Constructor, std::decay_t< Args >... > >( std::forward< Args >( args )... ) );
+            } else {
+               add_write( ObjectType::type_id, _db.create< ObjectType >( [&]( ObjectType& o ) { c( o, std::as_const( args )... ); } ).id._id );
+            }
+         }
+
+         const std::vector< object_key >& read_set()const  { return _read_set; }
+         const std::vector< object_key >& write_set()const { return _write_set; }
+
+         // whether it read (or wrote again) an object it wrote, which it does not see before the merge
+         bool read_own_write()const { return _read_own_write; }
+
+         // applies the recorded writes to the database
+         void apply()const {
+            for( const auto& w : _writes )
+               w->apply( _db );
+         }
+
+      private:
+         struct abstract_write {
+            virtual ~abstract_write() {}
+            virtual void apply( database& db )const = 0;
+         };
+
+         template< typename ObjectType, typename Modifier, typename... Args >
+         struct modify_write : abstract_write {
+            template< typename... A >
+            explicit modify_write( oid< ObjectType > id, A&&... args ) : _id( id ), _args( std::forward< A >( args )... ) {}
+            virtual void apply( database& db )const override {
+               db.modify( db.get< ObjectType >( _id ), [this]( ObjectType& o ) {
+                  std::apply( [&]( const Args&... args ) { Modifier{}( o, args... ); }, _args );
+               } );
+            }
+            oid< ObjectType >      _id;
+            std::tuple< Args... >  _args;
+         };
+
+         template< typename ObjectType >
+         struct remove_write : abstract_write {
+            explicit remove_write( oid< ObjectType > id ) : _id( id ) {}
+            virtual void apply( database& db )const override { db.remove( db.get< ObjectType >( _id ) ); }
+            oid< ObjectType > _id;
+         };
+
+         template< typename ObjectType, typename Constructor, typename... Args >
+         struct create_write : abstract_write {
+            template< typename... A >
+            explicit create_write( A&&... args ) : _args( std::forward< A >( args )... ) {}
+            virtual void apply( database& db )const override {
+               db.create< ObjectType >( [this]( ObjectType& o ) {
+                  std::apply( [&]( const Args&... args ) { Constructor{}( o, args... ); }, _args );
+               } );
+            }
+            std::tuple< Args... >  _args;
+         };
+
+         void add_read( uint16_t type_id, int64_t id );
+         void add_write( uint16_t type_id, int64_t id );
+
+         database&                                    _db;
+         bool                                         _speculative;
+         bool                                         _read_own_write = false;
+         std::vector< object_key >                    _read_set;
+         std::vector< object_key >                    _write_set;
+         std::vector< std::unique_ptr< abstract_write > > _writes;       // recorded while speculative
+   };
+
+   struct transaction_result {
+      bool               reexecuted = false;              // during the merge, after a conflict
+      std::exception_ptr error;                           // thrown by the transaction, whose writes were undone
+   };
+
+   /**
+    * Applies `num_transactions` transactions to `db`, with the same result as calling `f( i, ctx )` for each of
+    * them in order, where `f` reads and writes the database only through `ctx` (see `transaction_context`).
+    *
+    * The transactions first run in parallel on up to `num_threads` threads, against the state of the database
+    * before the batch, recording their reads and writes. They are then merged in order, each in a nested undo
+    * session (see `database::start_nested_undo_session`) squashed into the current one: a transaction which read or wrote an object (or a type) written by a
+    * transaction merged before it, read its own writes, or threw, is run again by `f` on the calling thread,
+    * otherwise its recorded writes are applied. A transaction which throws while merged is undone, and its error
+    * is returned. `f` must therefore be deterministic, and safe to call concurrently for different transactions.
+    *
+    * Must be called by the thread writing `db`, which must not be written otherwise until this returns.
+    */
+   std::vector< transaction_result > apply_parallel( database& db, size_t num_transactions,
+                                                     const std::function< void( size_t, transaction_context& ) >& f,
+                                                     unsigned num_threads = std::thread::hardware_concurrency() );
+
+}  // namespace chainbase
@@ -4,11 +4,17 @@
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/container/flat_map.hpp>
+#include <chainbase/small_size_allocator.hpp>
+#include <chainbase/intern_table.hpp>
+#include <chainbase/reader_registry.hpp>
 #include <filesystem>
+#include <functional>
 #include <vector>
+#include <array>
+#include <atomic>
 #include <optional>
 #include <memory>
+#include <span>
 
 namespace chainbase {
 
@@ -47,13 +53,21 @@ using segment_manager = bip::managed_mapped_file::segment_manager;
 template<typename T>
 using allocator = bip::allocator<T, segment_manager>;
 
+class write_protect_tracker;
+class page_journal;
+
+using small_size_allocator_t = small_size_allocator<segment_manager>;
+using intern_table_t         = intern_table<segment_manager>;
+
 class pinnable_mapped_file {
    public:
       enum map_mode {
          mapped,        // file is mmaped in MAP_SHARED mode. Only mode where changes can be seen by another chainbase instance
          mapped_private,// file is mmaped in MAP_PRIVATE mode, and only updated at exit
          heap,          // file is copied at startup to an anonymous mapping using huge pages (if available)
-         locked         // file is copied at startup to an anonymous mapping using huge pages (if available) and locked in memory
+         locked,        // file is copied at startup to an anonymous mapping using huge pages (if available) and locked in memory
+         heap_lazy      // like `heap`, but pages are copied from the file on first access and in the background (requires
+                        // userfaultfd, otherwise the file is copied at startup as in `heap` mode)
       };
 
       pinnable_mapped_file(const std::filesystem::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode);
@@ -63,34 +77,240 @@ class pinnable_mapped_file {
       pinnable_mapped_file& operator=(const pinnable_mapped_file&) = delete;
       ~pinnable_mapped_file();
 
-      segment_manager* get_segment_manager() const { return _segment_manager;}
-      size_t           check_memory_and_flush_if_needed();
+      segment_manager*        get_segment_manager() const { return _segment_manager;}
+      small_size_allocator_t* get_small_size_allocator() const { return _ss_alloc; }
+      intern_table_t*         get_intern_table() const { return _intern_table; }
+      size_t                  check_memory_and_flush_if_needed();
+
+      // Writes the database to its file, so that after a crash it can be reopened in the current state.
+      // In `heap`, `locked` and `mapped_private` modes the file is marked clean until the next checkpoint
+      // or until `this` is destroyed, and only the pages modified since the previous checkpoint are written
+      // if the kernel tracks them for our mapping (with userfaultfd write protection, or soft-dirty bits).
+      // Otherwise every checkpoint writes the whole database, which is logged once. In `mapped` mode
+      // the file is the database, so it is only flushed and remains marked dirty.
+      void                    checkpoint();
+
+      // Starts writing back the modified pages of the next `max_bytes` of the database file (resuming where the
+      // previous call stopped, and wrapping around at the end), after waiting for the writeback started by the
+      // previous call. So at most `max_bytes` are in flight, and in `mapped` mode a later `checkpoint()` only
+      // has to write the pages modified since. Does not make the file consistent by itself.
+      void                    flush(size_t max_bytes);
+
+      // Starts journaling the pages modified in `heap`, `locked`, `heap_lazy` and `mapped_private` modes, after
+      // a checkpoint. Each `journal_commit()` then appends the pages modified since the previous one to the
+      // `shared_memory.journal` file next to the database file, and with `sync` returns once all the transactions
+      // appended so far are durable. When a dirty database with a journal is opened, the journal is applied to the
+      // file, which is rolled forward to the last `journal_commit()` after a crash of the process, or to the last one
+      // with `sync` after a crash of the system. Checkpoints empty the journal. Requires userfaultfd write protection
+      // (Linux 6.7+).
+      void                    enable_journal();
+      void                    journal_commit(int64_t revision, bool sync);
+      bool                    is_journal_enabled() const { return _journal != nullptr; }
+      uint64_t                journal_size() const;
+
+      // -----------------------------------------------------------------------------------------
+      // Publication of the states of a `mapped` database to the processes reading its file while
+      // it is written (see `database::read_guard`). The header holds a sequence number, which is
+      // odd from the first `begin_write()` after a publication until the next `publish()`, and the
+      // revision last published. Before its first modification after a publication, the writer
+      // waits for the readers registered in the `reader_registry` to finish. In the other modes
+      // no other process sees the writes, and these do nothing unless `enable_concurrent_reads()`
+      // was called. `begin_write()` throws if the calling thread holds a read, unless `may_throw`
+      // is false: it then evicts that read instead.
+      // -----------------------------------------------------------------------------------------
+      void                    begin_write(bool may_throw = true) { if (_writable && _publishing && !_writing) start_write(may_throw); }
+      void                    publish(int64_t revision);
+
+      // Waits until the database is in a published state, and returns its sequence number and revision. Unless
+      // `slot` is left empty, the reader is registered in that slot, and the database is not modified until
+      // `end_read(slot)`, or until the writer evicts the reader after `set_reader_timeout`.
+      std::pair<uint64_t, int64_t> begin_read(reader_registry::pinned_slot& slot) const;
+      void                    end_read(const reader_registry::pinned_slot& slot) const;
+
+      // Whether the reader registered in `slot` was not evicted, or the database was not modified since `begin_read()`
+      // returned `sequence`. The data read in between is only consistent if either returns true.
+      bool                    still_pinned(const reader_registry::pinned_slot& slot) const;
+      bool                    still_published(uint64_t sequence) const;
+
+      // How long the writer waits for the registered readers before modifying the database. Readers still
+      // registered afterwards are evicted (see `reader_registry`), and their reads turn out inconsistent.
+      void                    set_reader_timeout(std::chrono::microseconds timeout) { _reader_timeout = timeout; }
+
+      // Lets other threads of this process read the database while it is written, in any mode: the states are
+      // published as above, with a process-local sequence number and `reader_registry` outside of `mapped`
+      // mode. Must be called before the reading threads start. Calling it again has no effect.
+      void                    enable_concurrent_reads();
+
+      // Returns a private, writable copy of the database (see `database::fork`). Unless the database file is
+      // written directly (in `mapped` mode, or if it is read-only), the fork is a private mapping of the file
+      // into which only the pages modified since the last save are copied, and it takes memory only for the
+      // pages it modifies: before the file is written, the forks get their own copy of the pages written. Forks
+      // which outlive the database get their own copy of all the pages. Otherwise, or if the modified pages are
+      // not tracked, or without MADV_POPULATE_WRITE (Linux 5.14), the pages of the segment which are not all
+      // zeros are copied to an anonymous mapping. A fork is never saved: it cannot be checkpointed, and
+      // destroying it only releases its memory.
+      pinnable_mapped_file    fork() const;
+      bool                    is_fork() const { return _fork; }
+
+      // From now on, identical `shared_cow_string` and `shared_cow_vector` payloads of at least
+      // `min_size` bytes stored in this segment share a single buffer. This setting is persisted
+      // in the database. Calling it again has no effect.
+      void                    enable_interning(size_t min_size = 0);
+
+      // `shared_cow_string` and `shared_cow_vector` payloads of at least `min_size` bytes written from now
+      // on are stored compressed when it saves space (0 disables compression). This setting is persisted.
+      void                    set_compression_threshold(size_t min_size);
+      size_t                  get_compression_threshold() const { return _compression_threshold ? *_compression_threshold : 0; }
 
       template<typename T>
       static std::optional<allocator<T>> get_allocator(void *object) {
-         if (!_segment_manager_map.empty()) {
-            auto it = _segment_manager_map.upper_bound(object);
-            if(it == _segment_manager_map.begin())
-               return {};
-            auto [seg_start, seg_end] = *(--it);
-            // important: we need to check whether the pointer is really within the segment, as shared objects'
-            // can also be created on the stack (in which case the data is actually allocated on the heap using
-            // std::allocator). This happens for example when `shared_cow_string`s are inserted into a bip::multimap,
-            // and temporary pairs are created on the stack by the bip::multimap code.
-            if (object < seg_end)
-               return allocator<T>(reinterpret_cast<segment_manager *>(seg_start));
-         }
+         if (const segment_info* info = find_segment(object))
+            return allocator<T>(reinterpret_cast<segment_manager *>(info->start));
          return {};
       }
 
+      // returns the pools used for small `shared_cow_string` and `shared_cow_vector` payloads
+      // of the segment containing `object`, or nullptr if `object` is not within a segment.
+      static small_size_allocator_t* get_small_size_allocator(void *object) {
+         if (const segment_info* info = find_segment(object))
+            return info->ss_alloc;
+         return nullptr;
+      }
+
+      // returns the intern table of the segment containing `object`, or nullptr if `object` is not
+      // within a segment or if interning is not enabled for this segment.
+      static intern_table_t* get_intern_table(void *object) {
+         if (const segment_info* info = find_segment(object))
+            return info->intern_table;
+         return nullptr;
+      }
+
+      // returns the minimum size of the payloads to compress in the segment containing `object`, or 0 if
+      // `object` is not within a segment or if compression is not enabled for this segment.
+      static size_t get_compression_threshold(void *object) {
+         if (const segment_info* info = find_segment(object))
+            return info->compression_threshold;
+         return 0;
+      }
+
    private:
+      pinnable_mapped_file() = default;             // only for `fork()`
+
+      // -----------------------------------------------------------------------------------------
+      // Registry of the segments mapped by this process, used by `shared_cow_string` and
+      // `shared_cow_vector` to find the segment containing them on every copy, assignment and
+      // destruction.
+      //
+      // Each open segment owns one slot of `_segments`, a `segment_record` which is reused by the
+      // segments opened later. Records are published like a seqlock: their version is odd while
+      // they are modified (under `segments_mutex`), and lookups copy them into a `segment_info`
+      // until they read the same even version before and after. Lookups are lock-free: each
+      // thread first checks its copy of the segment it found last (valid as long as
+      // `_segments_generation`, bumped by every change, did not change), and otherwise scans the
+      // slots in use, of which there are only a few. The `pinnable_mapped_file` owning a slot is
+      // kept apart in `_segment_files`, as it changes whenever the file is moved.
+      // -----------------------------------------------------------------------------------------
+      struct segment_info {
+         void*                   start;
+         void*                   end;
+         small_size_allocator_t* ss_alloc;
+         intern_table_t*         intern_table;
+         size_t                  compression_threshold;
+         size_t                  slot;
+      };
+
+      struct segment_record {                       // `start` is null if the slot is empty
+         std::atomic<uint64_t>                version;
+         std::atomic<void*>                   start;
+         std::atomic<void*>                   end;
+         std::atomic<small_size_allocator_t*> ss_alloc;
+         std::atomic<intern_table_t*>         intern_table;
+         std::atomic<size_t>                  compression_threshold;
+      };
+
+      struct concurrent_reads {                     // replace the header and registry file outside of `mapped` mode
+         reader_registry         readers;
+         uint64_t                sequence = 0;
+         int64_t                 published_revision = -1;
+      };
+
+      static constexpr size_t max_segments = 256;
+
+      struct segment_cache {                        // zero-initialized, as a thread_local
+         segment_info        info;
+         uint64_t            generation;
+      };
+
+      // copies the record of `slot` into `info`, and returns whether the slot is in use
+      static bool read_segment(size_t slot, segment_info& info) {
+         const segment_record& r = _segments[slot];
+         for (;;) {
+            const uint64_t version = r.version.load(std::memory_order_acquire);
+            if (version & 1)
+               continue;
+            info = segment_info{ r.start.load(std::memory_order_relaxed), r.end.load(std::memory_order_relaxed),
+                                 r.ss_alloc.load(std::memory_order_relaxed), r.intern_table.load(std::memory_order_relaxed),
+                                 r.compression_threshold.load(std::memory_order_relaxed), slot };
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (r.version.load(std::memory_order_relaxed) == version)
+               return info.start != nullptr;
+         }
+      }
+
+      // returns the calling thread's copy of the info of the segment containing `object`, valid until its next lookup
+      static const segment_info* find_segment(void* object) {
+         // important: we need to check whether the pointer is really within the segment, as shared objects'
+         // can also be created on the stack (in which case the data is actually allocated on the heap using
+         // std::allocator). This happens for example when `shared_cow_string`s are inserted into a bip::multimap,
+         // and temporary pairs are created on the stack by the bip::multimap code.
+         auto contains = [object](const segment_info& info) { return object >= info.start && object < info.end; };
+
+         const uint64_t generation = _segments_generation.load(std::memory_order_acquire);
+         if (_last_segment.generation == generation && contains(_last_segment.info))
+            return &_last_segment.info;
+
+         const size_t num_slots = _segments_in_use.load(std::memory_order_acquire);
+         segment_info info;
+         for (size_t i = 0; i < num_slots; ++i) {
+            if (read_segment(i, info) && contains(info)) {
+               _last_segment = segment_cache{info, generation};
+               return &_last_segment.info;
+            }
+         }
+         return nullptr;
+      }
+
+      // set as `undo_index_write_hook`: begins a write of the segment containing the index `object`
+      static void                                   begin_write_of(const void* object, bool may_throw);
+
+      void                                          register_segment();
+      void                                          unregister_segment();
+      static void                                   publish_segment_info(const segment_info& info);
+
+      void                                          start_write(bool may_throw);
+      void                                          map_reader_registry();
+      std::atomic_ref<uint64_t>                     sequence_word() const;
+      std::atomic_ref<int64_t>                      published_revision_word() const;
+      void                                          setup_small_size_allocator();
       void                                          set_mapped_file_db_dirty(bool);
       void                                          load_database_file(boost::asio::io_context& sig_ios);
-      void                                          save_database_file(bool flush = true);
+      void                                          save_database_file(bool flush = true, bool verbose = true);
+      void                                          keep_dirty_pages_before_clear_refs();
+      void                                          start_dirty_page_tracking();
+      bool                                          is_tracking_dirty_pages() const;
       static bool                                   all_zeros(const std::byte* data, size_t sz);
-      void                                          setup_non_file_mapping();
+      void                                          write_region_to_file(const std::byte* src, size_t sz, size_t offset, bool flush);
+      void                                          setup_non_file_mapping(bool huge_pages);
+      void                                          finish_lazy_load(bool wait);
+      void                                          replay_journal();
+      bool                                          write_journal_transaction(int64_t revision, bool sync);
+      void                                          disable_journal();
+      void                                          write_journaled_pages(const std::byte* src, size_t sz, size_t offset, bool flush);
+      bool                                          scan_unsaved(const std::function<void(size_t, size_t)>& f) const;
+      void                                          detach_forks(size_t offset, size_t size) const;
       void                                          setup_copy_on_write_mapping();
       std::pair<std::byte*, size_t>                 get_region_to_save() const;
+      std::span<std::byte>                          get_mapping() const;
 
       bip::file_lock                                _mapped_file_lock;
       std::filesystem::path                         _data_file_path;
@@ -98,12 +318,34 @@ class pinnable_mapped_file {
       size_t                                        _database_size = 0;
       bool                                          _writable = false;
       bool                                          _sharable = false;
+      bool                                          _file_marked_clean = false;    // by `checkpoint()`
+      bool                                          _untracked_save_logged = false;
+      bool                                          _fork = false;                 // of another database, see `fork()`
+      size_t                                        _flush_offset = 0;             // where the next `flush()` starts
+      size_t                                        _flush_pending_size = 0;       // written back by the previous `flush()`
 
       bip::file_mapping                             _file_mapping;
       bip::mapped_region                            _file_mapped_region;
       void*                                         _non_file_mapped_mapping = nullptr;
       size_t                                        _non_file_mapped_mapping_size = 0;
 
+      class lazy_loader;
+      std::unique_ptr<lazy_loader>                  _lazy_loader;                  // while `heap_lazy` mapping is being loaded
+      std::unique_ptr<write_protect_tracker>        _write_tracker;                // if our writes are tracked for this mapping only
+      std::unique_ptr<page_journal>                 _journal;
+      std::vector<bool>                             _journaled_pages;              // or written while lazily loaded, or Soft-Dirty when another
+                                                                                   // database cleared the bits, and not tracked until saved
+      std::vector<std::pair<size_t, size_t>>        _unjournaled_pages;            // not tracked anymore, but not journaled yet
+      int64_t                                       _journal_revision = -1;        // of the last transaction
+      bool                                          _writing = false;              // since the last `publish()`
+      bool                                          _publishing = false;           // in `mapped` mode or with concurrent reads
+      std::unique_ptr<concurrent_reads>             _concurrent_reads;
+      reader_registry*                              _reader_registry = nullptr;    // where readers register, if anywhere
+      std::unique_ptr<reader_owner>                 _reader_owner;                 // in `mapped` mode
+      std::chrono::microseconds                     _reader_timeout = std::chrono::seconds(1);
+      bip::file_mapping                             _readers_file_mapping;
+      bip::mapped_region                            _readers_region;
+
 #ifdef _WIN32
       bip::permissions                              _db_permissions;
 #else
@@ -111,14 +353,23 @@ class pinnable_mapped_file {
 #endif
 
       segment_manager*                              _segment_manager = nullptr;
+      small_size_allocator_t*                       _ss_alloc = nullptr;
+      std::unique_ptr<small_size_allocator_t>       _local_ss_alloc;  // only for read-only databases created without pools
+      intern_table_t*                               _intern_table = nullptr;
+      size_t*                                       _compression_threshold = nullptr;
 
       static std::vector<pinnable_mapped_file*>     _instance_tracker;
+      size_t                                        _segment_slot = max_segments;
 
-      using segment_manager_map_t = boost::container::flat_map<void*, void *>;
-      static segment_manager_map_t                  _segment_manager_map;
+      static std::array<segment_record, max_segments> _segments;
+      static std::array<std::atomic<pinnable_mapped_file*>, max_segments> _segment_files;
+      static std::atomic<size_t>                    _segments_in_use;       // slots past this one are all empty
+      static std::atomic<uint64_t>                  _segments_generation;
+      static inline thread_local segment_cache      _last_segment;
 
       constexpr static unsigned                     _db_size_multiple_requirement = 1024*1024; //1MB
       constexpr static size_t                       _db_size_copy_increment       = 1024*1024*1024; //1GB
+      constexpr static size_t                       _db_min_hole_size             = 64*1024;        //smaller zero runs are cleared in place
 };
 
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime);
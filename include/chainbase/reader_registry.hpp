@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace chainbase {
+
+   class reader_owner;
+
+   // ---------------------------------------------------------------------------------------
+   // Readers of a database which is being written (see `database::read_guard`). In `mapped`
+   // mode the registry is a file mapped by the writer and all its readers, so that readers in
+   // other processes register too, otherwise it lives in the memory of the writing process.
+   //
+   // A reader pins a slot of its own for the duration of its read, claimed by a compare-and-swap
+   // on a cache line no other reader uses: a thread keeps using the slot it claimed last, so
+   // readers neither contend on a shared counter nor share cache lines. Together with the
+   // sequence number published by the writer, this is the usual handshake: a reader pins its
+   // slot and then checks that the sequence is even, while the writer makes the sequence odd
+   // and then waits until no slot is pinned before modifying anything. A registered reader
+   // therefore never reads a state being modified, and the writer only waits for reads which
+   // started before its first modification after a publication.
+   //
+   // The writer waits for a bounded time only: it releases the slots of readers whose process
+   // died at once, and evicts those still pinned when its timeout expires. The ticket of a slot
+   // changes whenever it is released, so an evicted reader tells from `still_pinned` that its
+   // reads may have raced with the writer.
+   // ---------------------------------------------------------------------------------------
+   struct reader_registry {
+      static constexpr size_t max_readers = 256;
+      static constexpr size_t no_slot     = SIZE_MAX;
+
+      struct slot {
+         std::atomic<uint64_t> ticket{0};         // odd while pinned, incremented when pinned and when released
+         std::atomic<uint64_t> owner{0};          // process of the reader (see `reader_owner`), 0 if unknown
+         std::atomic<uint64_t> pid{0};            // with `thread`, tells the slots pinned by the calling thread
+         std::atomic<uint64_t> thread{0};
+         char                  padding[32];       // one cache line per reader
+      };
+      static_assert(std::atomic<uint64_t>::is_always_lock_free, "reader slots are shared between processes");
+
+      struct pinned_slot {
+         size_t   index  = no_slot;
+         uint64_t ticket = 0;
+      };
+
+      // Pins a slot on behalf of the process `owner` until `unpin`, and returns it. Waits if `max_readers` are
+      // already pinned.
+      pinned_slot pin(uint64_t owner) noexcept;
+      void        unpin(const pinned_slot& p) noexcept;
+
+      // Whether `p` was not evicted by the writer. The reads done before are consistent if this returns true.
+      bool        still_pinned(const pinned_slot& p) const noexcept {
+         std::atomic_thread_fence(std::memory_order_acquire);
+         return slots[p.index].ticket.load(std::memory_order_relaxed) == p.ticket;
+      }
+
+      // Whether the calling thread pinned a slot, which `wait_for_readers` would wait for until its timeout.
+      bool        pinned_by_this_thread() const noexcept;
+
+      // Evicts the slots pinned by the calling thread, for a write which can neither fail nor wait for them. Returns
+      // the number of slots evicted.
+      size_t      evict_this_thread() noexcept;
+
+      // Waits until no slot is pinned, for at most `timeout`. Slots of readers whose process died (as told by
+      // `owners`, if not null) are released at once, and those still pinned at the timeout are evicted. Returns
+      // the number of slots evicted.
+      size_t      wait_for_readers(std::chrono::microseconds timeout, const reader_owner* owners) noexcept;
+
+      std::array<slot, max_readers>   slots;
+   };
+
+   // ---------------------------------------------------------------------------------------
+   // The process registering readers in a registry file, which tells the writer whether the
+   // process of a reader still lives. Pids cannot: they are reused, and differ between pid
+   // namespaces. Instead, each process holds an open file description lock on one byte of the
+   // registry file past the registry, whose offset identifies it. The kernel releases the lock
+   // when the process dies, or closes the file. A process which later claims the same byte makes
+   // a dead reader look alive, and the writer then evicts it at its timeout.
+   //
+   // Where open file description locks are not supported (outside of Linux), no process is known
+   // to have died, and readers are only evicted at the timeout.
+   // ---------------------------------------------------------------------------------------
+   class reader_owner {
+    public:
+      static constexpr uint64_t max_owners = 4096;
+
+      // Opens (creating it if needed) the registry file at `path`, sized for a `reader_registry`, and claims an id.
+      explicit reader_owner(const std::filesystem::path& path);
+      ~reader_owner();
+
+      reader_owner(const reader_owner&) = delete;
+      reader_owner& operator=(const reader_owner&) = delete;
+
+      uint64_t id() const { return _id; }
+      bool     died(uint64_t owner) const noexcept;
+
+    private:
+      int      _fd = -1;
+      uint64_t _id = 0;
+   };
+
+}  // namespace chainbase
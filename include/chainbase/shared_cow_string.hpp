@@ -7,12 +7,19 @@
 #include <cstddef>
 #include <cstring>
 #include <algorithm>
+#include <limits>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <vector>
 #include <optional>
 #include <compare>
+#include <bit>
+#include <iterator>
+#include <memory>
 
 #include <chainbase/pinnable_mapped_file.hpp>
+#include <chainbase/compression.hpp>
 
 namespace chainbase {
 
@@ -22,20 +29,50 @@ namespace chainbase {
       struct impl {
          uint32_t reference_count;
          uint32_t size;
+         uint32_t capacity;
+         uint32_t flags;
          char data[0];
       };
 
+      // Payload written by a `CHAINB01` database, which has neither capacity nor flags. It is read as it is, and
+      // replaced by an `impl` when modified. An `impl` has `layout_bit` set in its `reference_count`, which
+      // never grows that large.
+      struct legacy_impl {
+         uint32_t reference_count;
+         uint32_t size;
+         char data[0];
+      };
+
+      static constexpr uint32_t layout_bit       = 0x80000000;
+      static constexpr uint32_t single_reference = layout_bit | 1;
+
+      static constexpr uint32_t interned_flag   = 1;   // payload is registered in the segment's intern table
+      static constexpr uint32_t compressed_flag = 2;   // `data` holds `capacity` bytes which decompress to `size` chars
+
+      // -----------------------------------------------------------------------------------------
+      // Short strings are stored inline, in the 8 bytes which otherwise hold the offset from `this`
+      // to the (shared, copy-on-write) `impl`. `_raw` is interpreted as follows:
+      //   - `1`                 : empty string (same representation as a null `bip::offset_ptr`)
+      //   - `(_raw & 3) == 0`   : offset from `this` to the `impl`, which is at least 4-byte aligned
+      //   - `(_raw & 3) == 2`   : inline string. The first byte holds `(size << 2) | 2`, and is
+      //                           followed by the chars and a null terminator.
+      // -----------------------------------------------------------------------------------------
+      static_assert(std::endian::native == std::endian::little, "inline shared_cow_string requires a little-endian platform");
+      static constexpr int64_t     empty_raw  = 1;
+      static constexpr int64_t     inline_tag = 2;
+
     public:
       using allocator_type = bip::allocator<char, segment_manager>;
       using iterator       = const char*;
       using const_iterator = const char*;
 
+      static constexpr std::size_t max_inline_size = sizeof(int64_t) - 2;
+
       shared_cow_string() = default;
 
       template<typename Iter>
       explicit shared_cow_string(Iter begin, Iter end) {
-         std::size_t size = std::distance(begin, end);
-         _alloc(&*begin, size);
+         assign(begin, end);
       }
 
       explicit shared_cow_string(const char* ptr, std::size_t size) {
@@ -57,38 +94,42 @@ namespace chainbase {
       }
 
       shared_cow_string(const shared_cow_string& o) {
-         if (get_allocator(this) == o.get_allocator()) {
-            _data = o._data;
-            if (_data != nullptr)
-               ++_data->reference_count;
+         if (!o.is_shared_impl()) {
+            _raw = o._raw;                                   // empty or inline, nothing to share
+         } else if (get_allocator(this) == o.get_allocator()) {
+            set_impl(o.get_impl());
+            ++get_impl()->reference_count;
          } else {
-            if (o._data)
-               new (this) shared_cow_string(o.data(), o.size());
+            new (this) shared_cow_string(o.data(), o.size());
          }
       }
 
       shared_cow_string(shared_cow_string&& o) noexcept {
-         if (get_allocator() == o.get_allocator()) {
-            _data = o._data;
-            o._data = nullptr;
+         if (!o.is_shared_impl()) {
+            _raw = o._raw;
+            o._raw = empty_raw;
+         } else if (get_allocator() == o.get_allocator()) {
+            set_impl(o.get_impl());
+            o._raw = empty_raw;
          } else {
-            if (o._data)
-               new (this) shared_cow_string(o.data(), o.size());
+            new (this) shared_cow_string(o.data(), o.size());
          }
       }
 
       ~shared_cow_string() {
-         dec_refcount();
-         _data = nullptr;
+         release();
       }
 
       shared_cow_string& operator=(const shared_cow_string& o) {
          if (this != &o) {
-            if (get_allocator() == o.get_allocator()) {
-               dec_refcount();
-               _data = o._data;
-               if (_data != nullptr) 
-                  ++_data->reference_count;
+            if (!o.is_shared_impl()) {
+               release();
+               _raw = o._raw;
+            } else if (get_allocator() == o.get_allocator()) {
+               impl* o_impl = o.get_impl();
+               ++o_impl->reference_count;                    // before release(), in case we share `o_impl`
+               release();
+               set_impl(o_impl);
             } else {
                assign(o.data(), o.size());
             }
@@ -98,10 +139,14 @@ namespace chainbase {
 
       shared_cow_string& operator=(shared_cow_string&& o)  noexcept {
          if (this != &o) {
-            if (get_allocator() == o.get_allocator()) {
-               dec_refcount();
-               _data = o._data;
-               o._data = nullptr;
+            if (!o.is_shared_impl()) {
+               release();
+               _raw = o._raw;
+               o._raw = empty_raw;
+            } else if (get_allocator() == o.get_allocator()) {
+               release();
+               set_impl(o.get_impl());
+               o._raw = empty_raw;
             } else {
                assign(o.data(), o.size());
             }
@@ -121,7 +166,8 @@ namespace chainbase {
          if (!copy_in_place(nullptr, new_size)) {
             _alloc(nullptr, new_size);
          }
-         static_cast<F&&>(f)(_data->data, new_size);
+         static_cast<F&&>(f)(mutable_data(), new_size);
+         _seal();
       }
 
       void assign(const char* ptr, std::size_t size) {
@@ -134,22 +180,116 @@ namespace chainbase {
          assign((const char*)ptr, size);
       }
 
+      // Copies the chars of any forward range straight into the final buffer. When `*this` lives in a
+      // segment (for example in the constructor passed to `database::create` or `database::modify`), this
+      // avoids building a temporary `std::string` or `shared_cow_string` on the heap first.
+      template<typename Iter>
+      void assign(Iter first, Iter last) {
+         const std::size_t size = std::distance(first, last);
+         if constexpr (std::contiguous_iterator<Iter>) {
+            assign(size ? std::to_address(first) : nullptr, size);
+         } else {
+            resize_and_fill(size, [&](char* dest, std::size_t) { std::copy(first, last, dest); });
+         }
+      }
+
+      // Appending reallocates geometrically, so building a string piece by piece is amortized O(1).
+      // If the buffer is shared with other strings, the appended-to string gets its own copy first.
+      void append(const char* ptr, std::size_t count) {
+         if (count == 0)
+            return;
+         const std::size_t old_size = size();
+         const std::size_t new_size = old_size + count;
+         if (new_size <= max_inline_size) {
+            int64_t raw = make_inline(data(), old_size, ptr, count);
+            release();                                  // only `CHAINB01` payloads are that short
+            _raw = raw;
+            return;
+         }
+         impl* p = get_impl();
+         if (!p || !is_writable(p) || new_size > p->capacity) {
+            // `ptr` may point into our buffer, which can be released by the reallocation
+            const char* cur = data();
+            bool self_append = cur && ptr >= cur && ptr < cur + old_size;
+            std::size_t offset = self_append ? ptr - cur : 0;
+            _reallocate(grown_capacity(new_size));
+            p = get_impl();
+            if (self_append)
+               ptr = p->data + offset;
+         }
+         std::memcpy(p->data + old_size, ptr, count);
+         p->size = new_size;
+         p->data[new_size] = '\0';
+      }
+
+      void append(std::string_view sv) {
+         append(sv.data(), sv.size());
+      }
+
+      void push_back(char c) {
+         append(&c, 1);
+      }
+
+      void reserve(std::size_t new_capacity) {
+         if (new_capacity > capacity())
+            _reallocate(new_capacity);
+      }
+
+      void shrink_to_fit() {
+         if (size() < capacity())
+            _reallocate(size());
+      }
+
+      std::size_t capacity() const {
+         if (impl* p = get_impl())
+            return (is_legacy(p) || (p->flags & compressed_flag)) ? p->size : p->capacity;
+         return max_inline_size;
+      }
+
+      // true if the string is stored within the `shared_cow_string` object itself
+      bool is_inline() const {
+         return (_raw & 3) == inline_tag;
+      }
+
+      // true if the string shares its payload with identical strings through the segment's intern table
+      bool is_interned() const {
+         impl* p = get_impl();
+         return p && !is_legacy(p) && (p->flags & interned_flag);
+      }
+
+      // true if the string is stored compressed in the segment. `data()` then returns a decompressed copy,
+      // which remains valid until the payload is modified or freed (see `decompression_cache`).
+      bool is_compressed() const {
+         impl* p = get_impl();
+         return p && !is_legacy(p) && (p->flags & compressed_flag);
+      }
+
       const char* data() const {
-         return _data ? _data->data : nullptr;
+         if (impl* p = get_impl()) {
+            if (is_legacy(p)) [[unlikely]]
+               return reinterpret_cast<const legacy_impl*>(p)->data;
+            if (p->flags & compressed_flag) [[unlikely]]
+               return decompression_cache::get(p, p->data, p->capacity, p->size);
+            return p->data;
+         }
+         return is_inline() ? inline_data() : nullptr;
       }
 
       char* mutable_data() {
-         assert (!_data || _data->reference_count == 1);
-         return _data ? _data->data : nullptr;
+         assert(!is_shared_impl() || is_writable(get_impl()));
+         return const_cast<char*>(data());
       }
 
       std::size_t size() const {
-         return _data ? _data->size : 0;
+         if (impl* p = get_impl())
+            return p->size;
+         return is_inline() ? inline_size() : 0;
       }
 
       const_iterator begin() const { return data(); }
       const_iterator end() const {
-         return _data ? _data->data + _data->size : nullptr;
+         const char* d = data();
+         return d ? d + size() : nullptr;
       }
 
       int compare(std::size_t start, std::size_t count, const char* other, std::size_t other_size) const {
@@ -199,56 +339,247 @@ namespace chainbase {
       }
 
     private:
+      // an interned payload is immutable even when we hold its only reference, as it is indexed by its contents
+      static bool is_writable(const impl* p) {
+         return p->reference_count == single_reference && !(p->flags & (interned_flag | compressed_flag));
+      }
+
+      static bool is_legacy(const impl* p) {
+         return !(p->reference_count & layout_bit);
+      }
+
+      // number of bytes used in `data`
+      static std::size_t stored_size(const impl* p) {
+         return (p->flags & compressed_flag) ? p->capacity : p->size;
+      }
+
+      bool is_shared_impl() const {
+         return (_raw & 3) == 0;
+      }
+
+      // the offset is applied to the address as an integer: `impl` is not within the object `this` points to
+      impl* get_impl() const {
+         return is_shared_impl() ? reinterpret_cast<impl*>(reinterpret_cast<uintptr_t>(this) + _raw) : nullptr;
+      }
+
+      void set_impl(impl* p) {
+         _raw = p ? static_cast<int64_t>(reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(this)) : empty_raw;
+      }
+
+      const char* inline_data() const {
+         return reinterpret_cast<const char*>(&_raw) + 1;
+      }
+
+      std::size_t inline_size() const {
+         return static_cast<uint8_t>(_raw) >> 2;
+      }
+
+      // returns the representation of the inline string formed by `[p1, p1+sz1)` followed by `[p2, p2+sz2)`.
+      // The chars are copied out before `_raw` is updated, so they may point into `this`.
+      static int64_t make_inline(const char* p1, std::size_t sz1, const char* p2 = nullptr, std::size_t sz2 = 0) {
+         assert(sz1 + sz2 <= max_inline_size);
+         if (sz1 + sz2 == 0)
+            return empty_raw;
+         int64_t raw = 0;
+         char* bytes = reinterpret_cast<char*>(&raw);
+         bytes[0] = static_cast<char>(((sz1 + sz2) << 2) | inline_tag);
+         if (p1)
+            std::memcpy(bytes + 1, p1, sz1);
+         if (p2)
+            std::memcpy(bytes + 1 + sz1, p2, sz2);
+         return raw;                                    // remaining bytes are 0, including the null terminator
+      }
+
       template<class Alloc>
       void dec_refcount(Alloc&& alloc) {
-         if (_data && --_data->reference_count == 0) {
-            assert(_data->size);                                    // if size == 0, _data should be nullptr
-            std::forward<Alloc>(alloc).deallocate((char*)&*_data, sizeof(impl) + _data->size + 1);
+         impl* p = get_impl();
+         if (p && (--p->reference_count & ~layout_bit) == 0) {
+            if (is_legacy(p)) {
+               // allocated from the segment manager: there were no pools then, nor payloads outside of segments
+               if constexpr (std::is_same_v<std::decay_t<Alloc>, small_size_allocator_t>)
+                  alloc.get_segment_manager()->deallocate(p);
+               return;
+            }
+            assert(p->capacity > max_inline_size || (p->flags & compressed_flag)); // short strings should be inline
+            if (p->flags & interned_flag) {
+               intern_table_t* table = pinnable_mapped_file::get_intern_table(this);
+               assert(table);
+               table->erase(intern_table_t::hash(p->data, stored_size(p), intern_seed), (char*)p);
+            }
+            if (p->flags & compressed_flag)
+               decompression_cache::erase(p);
+            std::forward<Alloc>(alloc).deallocate((char*)p, sizeof(impl) + p->capacity + 1);
          }
       }
       
       void dec_refcount() {
-         auto alloc = get_allocator(this);
-         if (alloc)
-            dec_refcount(*alloc);
+         if (!is_shared_impl())
+            return;
+         if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this))
+            dec_refcount(*ss_alloc);
          else
             dec_refcount(std::allocator<char>());
       }
 
+      void release() {
+         dec_refcount();
+         _raw = empty_raw;
+      }
+
       bool copy_in_place(const char* ptr, std::size_t size) {
-         if (_data && _data->reference_count == 1 && _data->size == size) {
-            // we hold the only reference and size matches, not need to dealloc/realloc
-            if (ptr)
-               std::memcpy(_data->data, ptr, size);
+         if (impl* p = get_impl()) {
+            if (is_writable(p) && p->size == size) {
+               // we hold the only reference and size matches, not need to dealloc/realloc
+               if (ptr) {
+                  std::memmove(p->data, ptr, size);
+                  _seal();
+               }
+               return true;
+            }
+         } else if (size <= max_inline_size) {
+            _raw = make_inline(ptr, size);
             return true;
          }
          return false;
       }
 
+      // capacity to use when we need room for `new_size` chars. Keep the current capacity if it is large
+      // enough (we are reallocating only because the buffer is shared), otherwise grow geometrically.
+      std::size_t grown_capacity(std::size_t new_size) const {
+         std::size_t cap = capacity();
+         if (new_size <= cap)
+            return cap;
+         return std::max(new_size, std::min<std::size_t>(2 * cap, std::numeric_limits<uint32_t>::max() - 1));
+      }
+
+      // copies the current contents into a new buffer of `new_capacity` chars (or inline if it fits)
       template<class Alloc>
-      void _alloc(Alloc&& alloc, const char* ptr, std::size_t size) {
-         impl* new_data = nullptr;
-         if (size > 0) {
-            new_data = (impl*)&*std::forward<Alloc>(alloc).allocate(sizeof(impl) + size + 1);
-            new_data->reference_count = 1;
-            new_data->size = size;
-            if (ptr)
-               std::memcpy(new_data->data, ptr, size);
-            new_data->data[size] = '\0';
+      void _reallocate(Alloc&& alloc, std::size_t new_capacity) {
+         const std::size_t sz = size();
+         assert(new_capacity >= sz && new_capacity < std::numeric_limits<uint32_t>::max());
+         if (new_capacity <= max_inline_size) {
+            int64_t raw = make_inline(data(), sz);
+            dec_refcount(std::forward<Alloc>(alloc));
+            _raw = raw;
+            return;
          }
+         impl* new_data = (impl*)&*std::forward<Alloc>(alloc).allocate(sizeof(impl) + new_capacity + 1);
+         new_data->reference_count = single_reference;
+         new_data->size = sz;
+         new_data->capacity = new_capacity;
+         new_data->flags = 0;
+         if (sz)
+            std::memcpy(new_data->data, data(), sz);
+         new_data->data[sz] = '\0';
          dec_refcount(std::forward<Alloc>(alloc));
-         _data = new_data;
+         set_impl(new_data);
       }
 
-      void _alloc(const char* ptr, std::size_t size) {
-         auto alloc = get_allocator(this);
-         if (alloc)
-            _alloc(*alloc, ptr, size);
+      void _reallocate(std::size_t new_capacity) {
+         if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this))
+            _reallocate(*ss_alloc, new_capacity);
          else
+            _reallocate(std::allocator<char>(), new_capacity);
+      }
+
+      template<class Alloc>
+      void _alloc(Alloc&& alloc, const char* ptr, std::size_t size) {
+         assert(size > max_inline_size);
+         impl* new_data = (impl*)&*std::forward<Alloc>(alloc).allocate(sizeof(impl) + size + 1);
+         new_data->reference_count = single_reference;
+         new_data->size = size;
+         new_data->capacity = size;
+         new_data->flags = 0;
+         if (ptr)
+            std::memcpy(new_data->data, ptr, size);
+         new_data->data[size] = '\0';
+         dec_refcount(std::forward<Alloc>(alloc));
+         set_impl(new_data);
+      }
+
+      void _alloc(const char* ptr, std::size_t size) {
+         if (size <= max_inline_size) {
+            int64_t raw = make_inline(ptr, size);
+            release();
+            _raw = raw;
+         } else if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this)) {
+            _alloc(*ss_alloc, ptr, size);
+            if (ptr)
+               _seal();
+         } else {
             _alloc(std::allocator<char>(), ptr, size);
+         }
+      }
+
+      // called when the contents of a payload we own have been written
+      void _seal() {
+         _compress();
+         _intern();
+      }
+
+      // If compression is enabled for our segment, replaces our payload with a compressed copy when it is
+      // large enough and compresses well.
+      void _compress() {
+         impl* p = get_impl();
+         if (!p || !is_writable(p))
+            return;
+         const std::size_t threshold = pinnable_mapped_file::get_compression_threshold(this);
+         if (threshold == 0 || p->size < threshold)
+            return;
+         thread_local std::vector<char> buffer;          // reused, so compression doesn't allocate every time
+         if (buffer.size() < p->size)
+            buffer.resize(p->size);
+         const std::size_t compressed_size = compressed_payload::compress(p->data, p->size, buffer.data(), p->size - p->size / 8);
+         if (compressed_size == 0)
+            return;                                     // saves less than 1/8th of the space, not worth it
+
+         auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this);
+         impl* new_data = (impl*)&*ss_alloc->allocate(sizeof(impl) + compressed_size + 1);
+         new_data->reference_count = single_reference;
+         new_data->size = p->size;
+         new_data->capacity = compressed_size;
+         new_data->flags = compressed_flag;
+         std::memcpy(new_data->data, buffer.data(), compressed_size);
+         new_data->data[compressed_size] = '\0';
+         dec_refcount(*ss_alloc);
+         set_impl(new_data);
       }
 
-      bip::offset_ptr<impl> _data { nullptr };
+      // If interning is enabled for our segment, replaces our (just written) payload with an identical
+      // interned one, or registers it in the intern table if there is none.
+      void _intern() {
+         impl* p = get_impl();
+         if (!p || p->reference_count != single_reference || (p->flags & interned_flag))
+            return;
+         intern_table_t* table = pinnable_mapped_file::get_intern_table(this);
+         if (!table || p->size < table->min_size() || p->size <= max_inline_size)
+            return;
+         // compressed payloads are compared and hashed in their compressed form
+         const std::size_t num_bytes = stored_size(p);
+         const uint64_t key = intern_table_t::hash(p->data, num_bytes, intern_seed);
+         char* found = table->find(key, [&](char* c) {
+            const impl* o = (const impl*)c;
+            return o->size == p->size && (o->flags & compressed_flag) == (p->flags & compressed_flag) &&
+                   stored_size(o) == num_bytes &&
+                   std::memcmp(o->data, p->data, num_bytes) == 0;
+         });
+         if (found) {
+            impl* o = (impl*)found;
+            ++o->reference_count;
+            release();
+            set_impl(o);
+         } else {
+            if (!(p->flags & compressed_flag) && p->capacity > p->size)
+               _reallocate(p->size);                      // interned payloads never grow, don't keep unused capacity
+            p = get_impl();
+            p->flags |= interned_flag;
+            table->insert(key, (char*)p);
+         }
+      }
+
+      static constexpr uint64_t intern_seed = 0;
+
+      int64_t _raw = empty_raw;
    };
 
 }  // namespace chainbase
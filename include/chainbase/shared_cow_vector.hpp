@@ -4,12 +4,19 @@
 
 #include <cstddef>
 #include <cstring>
+#include <functional>
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <optional>
+#include <iterator>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include <chainbase/pinnable_mapped_file.hpp>
+#include <chainbase/compression.hpp>
+#include <chainbase/scope_exit.hpp>
 
 namespace chainbase {
    namespace bip = boost::interprocess;
@@ -19,9 +26,30 @@ namespace chainbase {
       struct impl {
          uint32_t reference_count;
          uint32_t size;
+         uint32_t capacity;
+         uint32_t flags;
          T data[0];
       };
 
+      // Payload written by a `CHAINB01` database, which has neither capacity nor flags. It is read as it is, and
+      // replaced by an `impl` when modified. An `impl` has `layout_bit` set in its `reference_count`, which
+      // never grows that large.
+      struct legacy_impl {
+         uint32_t reference_count;
+         uint32_t size;
+         T data[0];
+      };
+
+      static constexpr uint32_t layout_bit       = 0x80000000;
+      static constexpr uint32_t single_reference = layout_bit | 1;
+
+      static constexpr uint32_t interned_flag   = 1;   // payload is registered in the segment's intern table
+      static constexpr uint32_t compressed_flag = 2;   // `data` holds `capacity * sizeof(T)` bytes (zero padded)
+                                                       // which decompress to `size` elements
+
+      // only payloads which can be compared, hashed and compressed bytewise are interned or compressed
+      static constexpr bool bytewise = std::is_trivially_copyable_v<T>;
+
    public:
       using allocator_type = bip::allocator<char, segment_manager>;
       using iterator       = const T*;      // const because of copy-on-write
@@ -32,13 +60,13 @@ namespace chainbase {
 
       template<typename Iter>
       explicit shared_cow_vector(Iter begin, Iter end) {
-         std::size_t size = std::distance(begin, end);
-         _alloc<false>(&*begin, size, size);
+         assign(begin, end);
       }
 
       template<class I, std::enable_if_t<std::is_constructible_v<T, I>, int> = 0>
       explicit shared_cow_vector(const I* ptr, std::size_t size) {
          _alloc<false>(ptr, size, size);
+         _seal();
       }
 
       shared_cow_vector(const shared_cow_vector& o) {
@@ -141,39 +169,112 @@ namespace chainbase {
          return *this;
       }
 
+      // Constructs the elements of any forward range straight into the final buffer. When `*this` lives in
+      // a segment (for example in the constructor passed to `database::create` or `database::modify`), this
+      // avoids building a temporary `std::vector` or `shared_cow_vector` on the heap first. Our own elements
+      // are released before the new ones are constructed, so a range of them is copied out first.
+      template<typename Iter>
+      void assign(Iter first, Iter last) {
+         if constexpr (std::is_convertible_v<Iter, const T*>) {
+            const T* d = data();
+            if (first != last && std::less_equal<const T*>()(d, first) && std::less<const T*>()(first, d + size())) {
+               *this = std::vector<T>(first, last);
+               return;
+            }
+         }
+         const std::size_t size = std::distance(first, last);
+         clear_and_construct(size, 0, [&](T* dest, std::size_t) {
+            new (dest) T(*first++);                     // called in order, once per element
+         });
+      }
+
       void clear() {
          dec_refcount();
          _data = nullptr;
       }
 
+      // keeps the first `copy_size` elements, and calls `f` to construct the others. The elements past
+      // `copy_size` are destroyed (or the payload released) first, so `f` must not read them.
       template<typename F>
       void clear_and_construct(std::size_t new_size, std::size_t copy_size, F&& f) {
          assert(copy_size <= new_size);
          assert(copy_size == 0 || (_data && copy_size <= _data->size));
          
-         if (_data && _data->reference_count == 1 && _data->size == new_size)
-            std::destroy(_data->data + copy_size, _data->data + new_size);
-         else {
+         if (_data && is_writable() && new_size <= _data->capacity && new_size != 0) {
+            std::destroy(_data->data + copy_size, _data->data + _data->size);
+            _data->size = copy_size;
+         } else {
             _alloc<false>(data(), new_size, copy_size); // construct == false => uninitialized memory
          }
-         for (std::size_t i=copy_size; i<new_size; ++i)
+         for (std::size_t i=copy_size; i<new_size; ++i) {
             static_cast<F&&>(f)(_data->data + i, i); // `f` should construct objects in place 
+            _data->size = i + 1;
+         }
+         _seal();
       }
 
+      // Appending reallocates geometrically, so building a vector element by element is amortized O(1).
+      // If the buffer is shared with other vectors, the appended-to vector gets its own copy first.
       template<class... Args>
       void emplace_back(Args&&... args) {
-         clear_and_construct(size() + 1, size(), [&](T* dest, std::size_t idx) {
-            new (dest) T(std::forward<Args>(args)...);
-         });
+         if (_data && is_writable() && _data->size < _data->capacity) {
+            new (_data->data + _data->size) T(std::forward<Args>(args)...);
+            ++_data->size;
+         } else {
+            // construct the new element before moving the current ones, as `args` may refer to them
+            _reallocate(grown_capacity(size() + 1), [&](T* dest) { new (dest) T(std::forward<Args>(args)...); });
+         }
+      }
+
+      void push_back(const T& v) {
+         emplace_back(v);
+      }
+
+      void push_back(T&& v) {
+         emplace_back(std::move(v));
+      }
+
+      void reserve(std::size_t new_capacity) {
+         if (new_capacity > capacity())
+            _reallocate(new_capacity, nullptr);
+      }
+
+      void shrink_to_fit() {
+         if (size() < capacity())
+            _reallocate(size(), nullptr);
+      }
+
+      std::size_t capacity() const {
+         return _data ? ((is_legacy() || is_compressed()) ? _data->size : _data->capacity) : 0;
+      }
+
+      // true if the vector shares its payload with identical vectors through the segment's intern table
+      bool is_interned() const {
+         return _data && !is_legacy() && (_data->flags & interned_flag);
+      }
+
+      // true if the vector is stored compressed in the segment. `data()` then returns a decompressed copy,
+      // which remains valid until the payload is modified or freed (see `decompression_cache`).
+      bool is_compressed() const {
+         return _data && !is_legacy() && (_data->flags & compressed_flag);
       }
 
       // const data access. Do *not* define the non-const version as it breaks copy-on-write
       const T* data() const {
-         return _data ? _data->data : nullptr;
+         if (!_data)
+            return nullptr;
+         if (is_legacy()) [[unlikely]]
+            return legacy_data();
+         if constexpr (bytewise) {
+            if (_data->flags & compressed_flag) [[unlikely]]
+               return (const T*)decompression_cache::get(&*_data, (const char*)_data->data, _data->capacity * sizeof(T),
+                                                         _data->size * sizeof(T));
+         }
+         return _data->data;
       }
 
       // const data access. Do *not* define the non-const version as it breaks copy-on-write
-      const T& operator[](std::size_t idx) const { assert(_data); return _data->data[idx]; }
+      const T& operator[](std::size_t idx) const { assert(_data); return data()[idx]; }
 
       std::size_t size() const {
          return _data ? _data->size : 0;
@@ -186,7 +287,7 @@ namespace chainbase {
       // Because of copy-on-write, these should be const and return `const *T`
       iterator begin() const { return data(); }
       iterator end() const {
-         return _data ? _data->data + _data->size : nullptr;
+         return _data ? data() + _data->size : nullptr;
       }
 
       const_iterator cbegin() const { return begin(); }
@@ -208,12 +309,84 @@ namespace chainbase {
       }
 
     private:
+      // an interned payload is immutable even when we hold its only reference, as it is indexed by its contents
+      bool is_writable() const {
+         return _data->reference_count == single_reference && !(_data->flags & (interned_flag | compressed_flag));
+      }
+
+      bool is_legacy() const {
+         return !(_data->reference_count & layout_bit);
+      }
+
+      T* legacy_data() const {
+         return reinterpret_cast<legacy_impl*>(&*_data)->data;
+      }
+
+      // number of bytes used in `data`
+      static std::size_t stored_size(const impl* p) {
+         return ((p->flags & compressed_flag) ? p->capacity : p->size) * sizeof(T);
+      }
+
+      // capacity to use when we need room for `new_size` elements. Keep the current capacity if it is
+      // large enough (we are reallocating only because the buffer is shared), otherwise grow geometrically.
+      std::size_t grown_capacity(std::size_t new_size) const {
+         std::size_t cap = capacity();
+         if (new_size <= cap)
+            return cap;
+         return std::max(new_size, std::min<std::size_t>(2 * cap, std::numeric_limits<uint32_t>::max()));
+      }
+
+      template<class F>
+      void _reallocate(std::size_t new_capacity, F&& emplace_last) {
+         if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this))
+            _reallocate(*ss_alloc, new_capacity, std::forward<F>(emplace_last));
+         else
+            _reallocate(std::allocator<char>(), new_capacity, std::forward<F>(emplace_last));
+      }
+
+      // Moves (or copies if the buffer is shared) the current elements into a new buffer of `new_capacity`
+      // elements. If `emplace_last` is not nullptr, it is called to construct an extra element after them.
+      template<class Alloc, class F>
+      void _reallocate(Alloc&& alloc, std::size_t new_capacity, F&& emplace_last) {
+         constexpr bool emplace = !std::is_same_v<std::decay_t<F>, std::nullptr_t>;
+         const std::size_t sz = size();
+         assert(new_capacity >= sz + emplace && new_capacity <= std::numeric_limits<uint32_t>::max());
+         impl* new_data = nullptr;
+         if (new_capacity > 0) {
+            new_data = (impl*)&*alloc.allocate(sizeof(impl) + (new_capacity * sizeof(T)));
+            bool emplaced = false;
+            auto guard = scope_exit{[&]{
+               if (emplaced)
+                  std::destroy_at(new_data->data + sz);
+               alloc.deallocate((char*)new_data, sizeof(impl) + (new_capacity * sizeof(T)));
+            }};
+            new_data->reference_count = single_reference;
+            new_data->size = sz + emplace;
+            new_data->capacity = new_capacity;
+            new_data->flags = 0;
+            if constexpr (emplace) {
+               static_cast<F&&>(emplace_last)(new_data->data + sz);
+               emplaced = true;
+            }
+            if (_data) {
+               if (is_writable())
+                  std::uninitialized_move(_data->data, _data->data + sz, new_data->data);
+               else
+                  std::uninitialized_copy(data(), data() + sz, new_data->data);
+            }
+            guard.cancel();
+         }
+         dec_refcount(std::forward<Alloc>(alloc));
+         _data = new_data;
+      }
+
       void _assign(const T* ptr, std::size_t size) {
-         if (_data && _data->reference_count == 1 && _data->size == size)
+         if (_data && is_writable() && _data->size == size)
             std::copy(ptr, ptr + size, _data->data);
          else {
             _alloc<false>(ptr, size, size);
          }
+         _seal();
       }
 
       void _assign(const std::vector<T>& v) {
@@ -222,17 +395,33 @@ namespace chainbase {
 
       template<class Alloc>
       void dec_refcount(Alloc&& alloc) {
-         if (_data && --_data->reference_count == 0) {
-            assert(_data->size);                                    // if size == 0, _data should be nullptr
-            std::destroy(_data->data, _data->data + _data->size);
-            std::forward<Alloc>(alloc).deallocate((char*)&*_data, sizeof(impl) + (_data->size * sizeof(T)));
+         if (_data && (--_data->reference_count & ~layout_bit) == 0) {
+            if (is_legacy()) {
+               std::destroy(legacy_data(), legacy_data() + _data->size);
+               // allocated from the segment manager: there were no pools then, nor payloads outside of segments
+               if constexpr (std::is_same_v<std::decay_t<Alloc>, small_size_allocator_t>)
+                  alloc.get_segment_manager()->deallocate(&*_data);
+               return;
+            }
+            assert(_data->capacity);                                // if capacity == 0, _data should be nullptr
+            if constexpr (bytewise) {
+               if (_data->flags & interned_flag) {
+                  intern_table_t* table = pinnable_mapped_file::get_intern_table(this);
+                  assert(table);
+                  table->erase(intern_table_t::hash(_data->data, stored_size(&*_data), intern_seed), (char*)&*_data);
+               }
+               if (_data->flags & compressed_flag)
+                  decompression_cache::erase(&*_data);
+            }
+            if (!(_data->flags & compressed_flag))
+               std::destroy(_data->data, _data->data + _data->size);
+            std::forward<Alloc>(alloc).deallocate((char*)&*_data, sizeof(impl) + (_data->capacity * sizeof(T)));
          }
       }
 
       void dec_refcount() {
-         auto alloc = get_allocator(this);
-         if (alloc)
-            dec_refcount(*alloc);
+         if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this))
+            dec_refcount(*ss_alloc);
          else
             dec_refcount(std::allocator<char>());
       }
@@ -241,19 +430,28 @@ namespace chainbase {
       void _alloc(Alloc&& alloc, const I* ptr, std::size_t size, std::size_t copy_size) {
          impl* new_data = nullptr;
          if (size > 0) {
-            new_data = (impl*)&*std::forward<Alloc>(alloc).allocate(sizeof(impl) + (size * sizeof(T)));
-            new_data->reference_count = 1;
-            new_data->size = size;
+            new_data = (impl*)&*alloc.allocate(sizeof(impl) + (size * sizeof(T)));
+            std::size_t constructed = 0;
+            auto guard = scope_exit{[&]{
+               std::destroy(new_data->data, new_data->data + constructed);
+               alloc.deallocate((char*)new_data, sizeof(impl) + (size * sizeof(T)));
+            }};
+            new_data->reference_count = single_reference;
+            new_data->size = construct ? size : copy_size;
+            new_data->capacity = size;
+            new_data->flags = 0;
             if (ptr && copy_size) {
                assert(copy_size <= size);
                std::uninitialized_copy(ptr, ptr + copy_size, new_data->data);
+               constructed = copy_size;
             }
             if constexpr (construct) {
                // default construct objects that were not copied
                assert(ptr || copy_size == 0);
-               for (std::size_t i=copy_size; i<size; ++i)
-                  new (new_data->data + i) T();
+               for (; constructed<size; ++constructed)
+                  new (new_data->data + constructed) T();
             }
+            guard.cancel();
          }
          dec_refcount(std::forward<Alloc>(alloc)); // has to be after copy above
          _data = new_data;
@@ -261,13 +459,84 @@ namespace chainbase {
       
       template<bool construct, class I, std::enable_if_t<std::is_constructible_v<T, I>, int> = 0>
       void _alloc(const I* ptr, std::size_t size, std::size_t copy_size) {
-         auto alloc = get_allocator(this);
-         if (alloc)
-            _alloc<construct>(*alloc, ptr, size, copy_size);
+         if (auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this))
+            _alloc<construct>(*ss_alloc, ptr, size, copy_size);
          else
             _alloc<construct>(std::allocator<char>(), ptr, size, copy_size);
       }
       
+      // called when the contents of a payload we own have been written
+      void _seal() {
+         _compress();
+         _intern();
+      }
+
+      // If compression is enabled for our segment, replaces our payload with a compressed copy when it is
+      // large enough and compresses well.
+      void _compress() {
+         if constexpr (bytewise) {
+            if (!_data || !is_writable())
+               return;
+            const std::size_t threshold = pinnable_mapped_file::get_compression_threshold(this);
+            const std::size_t num_bytes = _data->size * sizeof(T);
+            if (threshold == 0 || num_bytes < threshold)
+               return;
+            thread_local std::vector<char> buffer;       // reused, so compression doesn't allocate every time
+            if (buffer.size() < num_bytes)
+               buffer.resize(num_bytes);
+            const std::size_t compressed_size = compressed_payload::compress((const char*)_data->data, num_bytes, buffer.data(), num_bytes - num_bytes / 8);
+            if (compressed_size == 0)
+               return;                                  // saves less than 1/8th of the space, not worth it
+
+            const std::size_t new_capacity = (compressed_size + sizeof(T) - 1) / sizeof(T);
+            auto ss_alloc = pinnable_mapped_file::get_small_size_allocator(this);
+            impl* new_data = (impl*)&*ss_alloc->allocate(sizeof(impl) + (new_capacity * sizeof(T)));
+            new_data->reference_count = single_reference;
+            new_data->size = _data->size;
+            new_data->capacity = new_capacity;
+            new_data->flags = compressed_flag;
+            std::memcpy(new_data->data, buffer.data(), compressed_size);
+            std::memset((char*)new_data->data + compressed_size, 0, new_capacity * sizeof(T) - compressed_size);
+            dec_refcount(*ss_alloc);
+            _data = new_data;
+         }
+      }
+
+      // If interning is enabled for our segment, replaces our (just written) payload with an identical
+      // interned one, or registers it in the intern table if there is none.
+      void _intern() {
+         if constexpr (bytewise) {
+            // empty payloads (which may keep reserved capacity) are not worth sharing
+            if (!_data || _data->size == 0 || _data->reference_count != single_reference || (_data->flags & interned_flag))
+               return;
+            intern_table_t* table = pinnable_mapped_file::get_intern_table(this);
+            if (!table || _data->size * sizeof(T) < table->min_size())
+               return;
+            // compressed payloads are compared and hashed in their compressed form
+            const std::size_t num_bytes = stored_size(&*_data);
+            const uint64_t key = intern_table_t::hash(_data->data, num_bytes, intern_seed);
+            char* found = table->find(key, [&](char* c) {
+               const impl* o = (const impl*)c;
+               return o->size == _data->size && (o->flags & compressed_flag) == (_data->flags & compressed_flag) &&
+                      stored_size(o) == num_bytes && std::memcmp(o->data, _data->data, num_bytes) == 0;
+            });
+            if (found) {
+               impl* o = (impl*)found;
+               ++o->reference_count;
+               dec_refcount();
+               _data = o;
+            } else {
+               if (!is_compressed() && _data->capacity > _data->size)
+                  _reallocate(_data->size, nullptr);      // interned payloads never grow, don't keep unused capacity
+               _data->flags |= interned_flag;
+               table->insert(key, (char*)&*_data);
+            }
+         }
+      }
+
+      // keeps vectors of different element types from sharing payloads
+      static constexpr uint64_t intern_seed = (uint64_t(sizeof(T)) << 32) | alignof(T);
+
       bip::offset_ptr<impl> _data { nullptr };
    };
 
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <boost/interprocess/offset_ptr.hpp>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   // ---------------------------------------------------------------------------------------
+   // Pools of fixed size blocks used for the small payloads of `shared_cow_string` and
+   // `shared_cow_vector`.
+   //
+   // Requests of up to `max_size` bytes are rounded up to a multiple of `size_increment` and
+   // served from the freelist of the matching size class, so they don't pay for a best-fit
+   // search of the segment manager nor for its per-block header. Freelists are refilled from
+   // the segment manager in batches of about `batch_bytes`. Larger requests are forwarded to
+   // the segment manager.
+   //
+   // One instance lives in each segment (see `pinnable_mapped_file`) and is shared by all
+   // the indices of the database. Blocks released to a size class are kept in its freelist
+   // and are not returned to the segment manager.
+   // ---------------------------------------------------------------------------------------
+   template<typename SegmentManager, std::size_t size_increment = 8, std::size_t num_classes = 32>
+   class small_size_allocator {
+    public:
+      static constexpr std::size_t num_size_classes = num_classes;
+      static constexpr std::size_t max_size         = size_increment * num_classes;
+      static constexpr std::size_t batch_bytes      = 4096;
+
+      struct class_stats {
+         std::size_t block_size  = 0;
+         uint64_t    num_allocs  = 0;  // number of allocations served by this size class
+         std::size_t num_in_use  = 0;  // blocks currently handed out
+         std::size_t num_free    = 0;  // blocks available in the freelist
+      };
+
+      explicit small_size_allocator(SegmentManager* manager) : _manager(manager) {
+         for (std::size_t i = 0; i < num_classes; ++i)
+            _classes[i].stats.block_size = (i + 1) * size_increment;
+      }
+
+      small_size_allocator(const small_size_allocator&) = delete;
+      small_size_allocator& operator=(const small_size_allocator&) = delete;
+
+      char* allocate(std::size_t sz) {
+         if (sz == 0 || sz > max_size)
+            return (char*)_manager->allocate(sz);
+         size_class& c = _classes[class_index(sz)];
+         if (c.freelist == nullptr)
+            refill(c);
+         list_item* result = &*c.freelist;
+         c.freelist = result->_next;
+         result->~list_item();
+         --c.stats.num_free;
+         ++c.stats.num_in_use;
+         ++c.stats.num_allocs;
+         return (char*)result;
+      }
+
+      void deallocate(char* p, std::size_t sz) {
+         if (sz == 0 || sz > max_size) {
+            _manager->deallocate(p);
+            return;
+         }
+         size_class& c = _classes[class_index(sz)];
+         assert(c.stats.num_in_use > 0);
+         c.freelist = new (p) list_item{c.freelist};
+         --c.stats.num_in_use;
+         ++c.stats.num_free;
+      }
+
+      SegmentManager* get_segment_manager() const { return _manager.get(); }
+
+      const class_stats& stats(std::size_t class_idx) const { return _classes[class_idx].stats; }
+
+      static constexpr std::size_t class_index(std::size_t sz) { return (sz - 1) / size_increment; }
+
+      // memory held in the freelists, available for reuse by payloads of the same size class
+      std::size_t freelist_memory_usage() const {
+         std::size_t res = 0;
+         for (const auto& c : _classes)
+            res += c.stats.num_free * c.stats.block_size;
+         return res;
+      }
+
+      // memory taken from the segment manager to refill the freelists (including its allocation overhead)
+      std::size_t reserved_memory() const { return _reserved_memory; }
+
+    private:
+      struct list_item { bip::offset_ptr<list_item> _next; };
+
+      struct size_class {
+         bip::offset_ptr<list_item> freelist;
+         class_stats                stats;
+      };
+
+      static_assert(size_increment >= sizeof(list_item), "Too small for free list");
+      static_assert(size_increment % alignof(list_item) == 0, "Bad alignment for free list");
+
+      void refill(size_class& c) {
+         const std::size_t block_size = c.stats.block_size;
+         const std::size_t num_blocks = std::max<std::size_t>(batch_bytes / block_size, 8);
+         const std::size_t free_before = _manager->get_free_memory();
+         char* result = (char*)_manager->allocate(block_size * num_blocks);
+         _reserved_memory += free_before - _manager->get_free_memory();
+
+         c.freelist = bip::offset_ptr<list_item>{(list_item*)result};
+         for (std::size_t i = 0; i < num_blocks - 1; ++i) {
+            char* next = result + block_size;
+            new (result) list_item{bip::offset_ptr<list_item>{(list_item*)next}};
+            result = next;
+         }
+         new (result) list_item{nullptr};
+         c.stats.num_free += num_blocks;
+      }
+
+      bip::offset_ptr<SegmentManager>        _manager;
+      std::array<size_class, num_classes>    _classes;
+      std::size_t                            _reserved_memory = 0;
+   };
+
+}  // namespace chainbase
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace chainbase {
+
+   // ---------------------------------------------------------------------------------------
+   // Encoding of the rows of a snapshot (see `database::write_snapshot`).
+   //
+   // Values are written little-endian with their exact width, and strings are prefixed with
+   // their 32 bit size, so that a snapshot does not depend on the compiler, standard library
+   // or platform which wrote it.
+   // ---------------------------------------------------------------------------------------
+   class snapshot_row_writer {
+    public:
+      explicit snapshot_row_writer(std::vector<char>& out) : _out(out) {}
+
+      template<typename I>
+      requires std::is_integral_v<I> || std::is_enum_v<I>
+      void write(I v) {
+         if constexpr (std::is_enum_v<I>) {
+            write(static_cast<std::underlying_type_t<I>>(v));
+         } else if constexpr (std::is_same_v<I, bool>) {
+            _out.push_back(v ? 1 : 0);
+         } else {
+            auto u = static_cast<std::make_unsigned_t<I>>(v);
+            for (size_t i = 0; i < sizeof(I); ++i, u >>= 8)
+               _out.push_back(static_cast<char>(u & 0xff));
+         }
+      }
+
+      template<std::floating_point F>
+      void write(F v) {
+         static_assert(sizeof(F) == 4 || sizeof(F) == 8, "unsupported floating point type");
+         write(std::bit_cast<std::conditional_t<sizeof(F) == 4, uint32_t, uint64_t>>(v));
+      }
+
+      void write(std::string_view s) {
+         write(static_cast<uint32_t>(s.size()));
+         write_bytes(s.data(), s.size());
+      }
+
+      void write_bytes(const void* data, size_t size) {
+         _out.insert(_out.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+      }
+
+    private:
+      std::vector<char>& _out;
+   };
+
+   class snapshot_row_reader {
+    public:
+      snapshot_row_reader(const char* data, size_t size) : _pos(data), _end(data + size) {}
+
+      template<typename I>
+      requires std::is_integral_v<I> || std::is_enum_v<I>
+      I read() {
+         if constexpr (std::is_enum_v<I>) {
+            return static_cast<I>(read<std::underlying_type_t<I>>());
+         } else if constexpr (std::is_same_v<I, bool>) {
+            return read<uint8_t>() != 0;
+         } else {
+            check(sizeof(I));
+            std::make_unsigned_t<I> u = 0;
+            for (size_t i = sizeof(I); i-- > 0;) {
+               u = (u << 8) | static_cast<uint8_t>(_pos[i]);
+            }
+            _pos += sizeof(I);
+            return static_cast<I>(u);
+         }
+      }
+
+      template<std::floating_point F>
+      F read() {
+         static_assert(sizeof(F) == 4 || sizeof(F) == 8, "unsupported floating point type");
+         return std::bit_cast<F>(read<std::conditional_t<sizeof(F) == 4, uint32_t, uint64_t>>());
+      }
+
+      // the view is valid as long as the row being read
+      std::string_view read_string() {
+         const size_t size = read<uint32_t>();
+         check(size);
+         std::string_view res(_pos, size);
+         _pos += size;
+         return res;
+      }
+
+      void read_bytes(void* data, size_t size) {
+         check(size);
+         std::copy(_pos, _pos + size, static_cast<char*>(data));
+         _pos += size;
+      }
+
+      size_t remaining() const { return _end - _pos; }
+
+    private:
+      void check(size_t size) const {
+         if (size > remaining())
+            BOOST_THROW_EXCEPTION(std::runtime_error("truncated row in chainbase snapshot"));
+      }
+
+      const char* _pos;
+      const char* _end;
+   };
+
+   /**
+    * Must be specialized for the object type of every index of a database to snapshot, e.g.:
+    *
+    *    template<> struct chainbase::snapshot_serializer<book> {
+    *       static void write(snapshot_row_writer& w, const book& b) { w.write(b.a); w.write(b.b); }
+    *       static void read(snapshot_row_reader& r, book& b)        { b.a = r.read<int>(); b.b = r.read<int>(); }
+    *    };
+    *
+    * The id of the objects is stored by the snapshot itself. `read` must consume the whole row.
+    */
+   template<typename T>
+   struct snapshot_serializer;
+
+   template<typename T>
+   concept snapshot_serializable = requires(snapshot_row_writer& w, snapshot_row_reader& r, const T& c, T& t) {
+      snapshot_serializer<T>::write(w, c);
+      snapshot_serializer<T>::read(r, t);
+   };
+
+   // Splits the rows of an index into the chunks of a snapshot, handed to `sink` as they fill up.
+   class snapshot_section_writer {
+    public:
+      using chunk_sink = std::function<void(std::vector<char>&& rows, uint32_t num_rows)>;
+
+      static constexpr size_t chunk_size = 1024*1024;
+
+      explicit snapshot_section_writer(chunk_sink sink) : _sink(std::move(sink)) {}
+
+      snapshot_row_writer begin_row(int64_t id);
+      void                end_row();
+      void                finish();                         // hands over the last chunk
+
+      uint64_t            num_rows() const { return _total_rows; }
+      int64_t             next_id() const { return _next_id; }
+      void                set_next_id(int64_t id) { _next_id = id; }
+
+    private:
+      chunk_sink          _sink;
+      std::vector<char>   _rows;
+      size_t              _row_start = 0;
+      uint32_t            _num_rows = 0;                   // in `_rows`
+      uint64_t            _total_rows = 0;
+      int64_t             _next_id = 0;                    // of the index
+   };
+
+}  // namespace chainbase
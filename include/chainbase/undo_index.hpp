@@ -15,10 +15,19 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/core/demangle.hpp>
 #include <boost/interprocess/interprocess_fwd.hpp>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <optional>
 #include <type_traits>
+#include <unordered_map>
 #include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace chainbase {
    struct constructor_tag {};
@@ -193,6 +202,130 @@ namespace chainbase {
       }
    }
 
+   /**
+    * Called, when set, with the address of an undo_index before each of its modifications. The database sets it so
+    * that the readers of the segment containing the index never see it being modified (see `database::read_guard`),
+    * whether it is modified through the database or through an index reference kept across a publication. It may
+    * throw only if its second argument is true, which it is not for the noexcept modifications (such as `remove`
+    * or `undo`).
+    */
+   inline std::atomic<void (*)(const void*, bool)> undo_index_write_hook{nullptr};
+
+#ifdef CHAINBASE_OBSERVERS
+   /**
+    * Observer of the objects of an undo_index (see `undo_index::add_observer`), only compiled in when
+    * CHAINBASE_OBSERVERS is defined. Every change is notified, including the inverse changes made by `undo`.
+    * Callbacks must not throw nor access the index, which may be in the middle of being restored.
+    */
+   template<typename T>
+   class undo_index_observer {
+    public:
+      virtual ~undo_index_observer() = default;
+      virtual void on_create(const T& value) {}
+      virtual void on_modify(const T& old_value, const T& new_value) {}
+      virtual void on_remove(const T& value) {}
+      // session boundaries, with the revision the changes notified so far lead to
+      virtual void on_session_start(uint64_t revision) {}     // before the session starts
+      virtual void on_undo(uint64_t revision) {}
+      virtual void on_squash(uint64_t revision) {}
+      virtual void on_commit(uint64_t revision) {}
+   };
+
+   /**
+    * Accumulates the net change of every object between session boundaries, and hands them over at the boundary.
+    * Objects created and removed in between, as well as changes undone in between, are not delivered.
+    *
+    * Recording a change copies objects, which may fail, while the index notifies most changes where it cannot
+    * fail (`remove`, `undo`). A change which cannot be recorded is therefore not thrown: the changes accumulated
+    * are dropped, and `on_batch_lost` is called at the boundary instead of `on_batch`, so that the observer can
+    * resynchronize from the index.
+    */
+   template<typename T>
+   class batched_undo_index_observer : public undo_index_observer<T> {
+    public:
+      struct change {
+         std::optional<T> old_value;          // unset if created
+         std::optional<T> new_value;          // unset if removed
+      };
+      using id_type = std::remove_cvref_t<decltype(std::declval<const T&>().id)>;
+
+      virtual void on_batch(uint64_t revision, const std::map<id_type, change>& changes) = 0;
+      virtual void on_batch_lost(uint64_t revision) = 0;
+
+      void on_create(const T& value) override {
+         record([&] { _changes[value.id].new_value.emplace(value); });
+      }
+      void on_modify(const T& old_value, const T& new_value) override {
+         record([&] {
+            auto [it, first] = _changes.try_emplace(old_value.id);
+            if (first)
+               it->second.old_value.emplace(old_value);
+            it->second.new_value.reset();
+            it->second.new_value.emplace(new_value);
+         });
+      }
+      void on_remove(const T& value) override {
+         record([&] {
+            auto [it, first] = _changes.try_emplace(value.id);
+            if (first)
+               it->second.old_value.emplace(value);
+            it->second.new_value.reset();
+         });
+      }
+      void on_session_start(uint64_t revision) override {
+         deliver(revision);
+         _session_pending = true;
+      }
+      void on_undo(uint64_t revision) override {
+         // if nothing was delivered since the session started, its changes and their inverses cancel out
+         if (_session_pending) {
+            _changes.clear();
+            _lost = false;
+         } else {
+            deliver(revision);
+         }
+         _session_pending = false;
+      }
+      void on_squash(uint64_t revision) override {
+         deliver(revision);
+         _session_pending = false;
+      }
+      void on_commit(uint64_t revision) override {
+         deliver(revision);
+         _session_pending = false;
+      }
+
+    private:
+      template<typename F>
+      void record(F&& f) noexcept {
+         if (_lost)
+            return;
+         try {
+            f();
+         } catch (...) {
+            _changes.clear();
+            _lost = true;
+         }
+      }
+
+      void deliver(uint64_t revision) {
+         if (_lost) {
+            _lost = false;
+            on_batch_lost(revision);
+            return;
+         }
+         std::erase_if(_changes, [](const auto& c) { return !c.second.old_value && !c.second.new_value; });
+         if (!_changes.empty())
+            on_batch(revision, _changes);
+         _changes.clear();
+      }
+
+      std::map<id_type, change> _changes;
+      bool                      _session_pending = false;   // all the changes since the last session started are in `_changes`
+      bool                      _lost = false;              // changes since the last boundary were dropped
+   };
+#endif
+
    template<typename T, typename Allocator, typename... Indices>
    class undo_index;
   
@@ -352,6 +485,7 @@ namespace chainbase {
       // Exception safety: strong
       template<typename Constructor>
       const value_type& emplace( Constructor&& c ) {
+         before_write();
          auto p = alloc_traits::allocate(_allocator, 1);
          auto guard0 = scope_exit{[&]{ alloc_traits::deallocate(_allocator, p, 1); }};
          auto new_id = _next_id;
@@ -368,15 +502,48 @@ namespace chainbase {
          ++_next_id;
          guard1.cancel();
          guard0.cancel();
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_create(p->_item); });
+#endif
          return p->_item;
       }
 
+      // Bulk loading (e.g. from a snapshot): emplaces an object with the given id instead of the next one, which
+      // must not be smaller. Ids skipped are never assigned. Cannot be undone, so there must be no undo session.
+      // Exception safety: strong
+      template<typename Constructor>
+      const value_type& emplace_with_id( id_type id, Constructor&& c ) {
+         auto old_next_id = _next_id;
+         set_next_id( id );
+         auto guard = scope_exit{[&]{ _next_id = old_next_id; }};
+         const value_type& result = emplace( std::forward<Constructor>(c) );
+         guard.cancel();
+         return result;
+      }
+
+      void set_next_id( id_type id ) {
+         before_write();
+         if( !_undo_stack.empty() )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot bulk load objects while there is an existing undo stack") );
+         if( id < _next_id )
+            BOOST_THROW_EXCEPTION( std::logic_error("objects must be bulk loaded in increasing id order") );
+         _next_id = id;
+      }
+
+      id_type next_id() const { return _next_id; }
+
       // Exception safety: basic.
       // If the modifier leaves the object in a state that conflicts
       // with another object, it will either be reverted or erased.
       template<typename Modifier>
       void modify( const value_type& obj, Modifier&& m) {
+         before_write();
          value_type* backup = on_modify(obj);
+#ifdef CHAINBASE_OBSERVERS
+         std::optional<value_type> old_value;
+         if(!backup && observers())
+            old_value.emplace(obj);
+#endif
          value_type& node_ref = const_cast<value_type&>(obj);
          bool success = false;
          {
@@ -390,7 +557,13 @@ namespace chainbase {
                      assert(backup == &_old_values.front());
                      _old_values.pop_front_and_dispose([this](pointer p){ dispose_old(*p); });
                   } else {
-                     remove(obj);
+                     // observers are told the value the object had before `m`
+                     erase_impl(node_ref);
+#ifdef CHAINBASE_OBSERVERS
+                     if (old_value)
+                        notify([&](auto& o) { o.on_remove(*old_value); });
+#endif
+                     dispose_removed(node_ref);
                   }
                } else {
                   success = true;
@@ -403,14 +576,19 @@ namespace chainbase {
          }
          if(!success)
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_modify(backup ? *backup : *old_value, obj); });
+#endif
       }
 
       void remove( const value_type& obj ) noexcept {
+         before_write(false);
          auto& node_ref = const_cast<value_type&>(obj);
          erase_impl(node_ref);
-         if(on_remove(node_ref)) {
-            dispose_node(node_ref);
-         }
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_remove(node_ref); });
+#endif
+         dispose_removed(node_ref);
       }
 
     public:
@@ -486,6 +664,7 @@ namespace chainbase {
       }
 
       void set_revision( uint64_t revision ) {
+         before_write();
          if( _undo_stack.size() != 0 )
             BOOST_THROW_EXCEPTION( std::logic_error("cannot set revision while there is an existing undo stack") );
 
@@ -503,6 +682,7 @@ namespace chainbase {
        * Discards all undo history prior to revision
        */
       void commit( uint64_t revision ) noexcept {
+         before_write(false);
          revision = std::min(revision, _revision);
          if (revision == _revision) {
             dispose_undo();
@@ -512,6 +692,9 @@ namespace chainbase {
             dispose(get_old_values_end(*iter), get_removed_values_end(*iter));
             _undo_stack.erase(_undo_stack.begin(), iter);
          }
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_commit(_revision); });
+#endif
       }
 
       const undo_index& indices() const { return *this; }
@@ -565,6 +748,197 @@ namespace chainbase {
       auto begin() const { return get<0>().begin(); }
       auto end() const { return get<0>().end(); }
 
+      // Read-only view of the index as of a revision still on the undo stack, without copying objects nor
+      // undoing anything. Objects modified or removed since that revision are read from the undo stack, and
+      // objects created since then are hidden. Only lookups and iteration by id are supported. The view must
+      // not be used once the index has been modified.
+      class revision_view {
+       public:
+         revision_view(const undo_index& idx, uint64_t revision)
+            : _index(idx), _revision(revision), _next_id(idx._next_id), _current_end(idx.template get<0>().end()) {
+            const undo_state* since = idx.undo_state_at(revision);
+            if (!since)
+               return;
+            _next_id = since->old_next_id;
+            for (auto it = idx._old_values.begin(), end = idx.get_old_values_end(*since); it != end; ++it) {
+               if (it->id < _next_id)
+                  _old_values.push_back(&*it);
+            }
+            for (auto it = idx._removed_values.begin(), end = idx.get_removed_values_end(*since); it != end; ++it) {
+               if (it->id < _next_id)
+                  _removed_values.push_back(&*it);
+            }
+            // an object may have been modified in several sessions, the oldest value is the last one in `_old_values`
+            auto by_id = [](const value_type* a, const value_type* b) { return a->id < b->id; };
+            std::stable_sort(_old_values.begin(), _old_values.end(), by_id);
+            auto last = std::unique(_old_values.rbegin(), _old_values.rend(), [](const value_type* a, const value_type* b) { return a->id == b->id; });
+            _old_values.erase(_old_values.begin(), last.base());
+            std::sort(_removed_values.begin(), _removed_values.end(), by_id);
+            _current_end = idx.template get<0>().lower_bound(_next_id);
+         }
+
+         class const_iterator {
+          public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type        = typename undo_index::value_type;
+            using difference_type   = std::ptrdiff_t;
+            using pointer           = const value_type*;
+            using reference         = const value_type&;
+
+            const_iterator() = default;
+            reference operator*() const { return *_view->committed_value(current()); }
+            pointer operator->() const { return _view->committed_value(current()); }
+            const_iterator& operator++() {
+               if (from_index())
+                  ++_current;
+               else
+                  ++_removed;
+               return *this;
+            }
+            const_iterator operator++(int) { const_iterator res = *this; ++*this; return res; }
+            friend bool operator==(const const_iterator& a, const const_iterator& b) {
+               return a._current == b._current && a._removed == b._removed;
+            }
+          private:
+            friend class revision_view;
+            using removed_iterator = typename std::vector<const value_type*>::const_iterator;
+            const_iterator(const revision_view* view, typename undo_index::const_iterator current, removed_iterator removed)
+               : _view(view), _current(current), _removed(removed) {}
+            bool from_index() const {
+               return _removed == _view->_removed_values.end() || (_current != _view->_current_end && _current->id < (*_removed)->id);
+            }
+            const value_type* current() const { return from_index() ? &*_current : *_removed; }
+
+            const revision_view*                  _view = nullptr;
+            typename undo_index::const_iterator   _current;          // objects still in the index
+            removed_iterator                      _removed;          // objects removed since the committed revision
+         };
+
+         const_iterator begin() const {
+            return const_iterator(this, _index.template get<0>().begin(), _removed_values.begin());
+         }
+         const_iterator end() const {
+            return const_iterator(this, _current_end, _removed_values.end());
+         }
+
+         const value_type* find(id_type id) const {
+            if (!(id < _next_id))
+               return nullptr;
+            auto it = std::lower_bound(_removed_values.begin(), _removed_values.end(), id, [](const value_type* v, const id_type& id) { return v->id < id; });
+            if (it != _removed_values.end() && (*it)->id == id)
+               return committed_value(*it);
+            const value_type* current = _index.find(id);
+            return current ? committed_value(current) : nullptr;
+         }
+
+         // the revision the view is at
+         uint64_t revision() const { return _revision; }
+         id_type next_id() const { return _next_id; }
+
+       private:
+         const value_type* committed_value(const value_type* v) const {
+            auto it = std::lower_bound(_old_values.begin(), _old_values.end(), v->id, [](const value_type* o, const id_type& id) { return o->id < id; });
+            return it != _old_values.end() && (*it)->id == v->id ? *it : v;
+         }
+
+         const undo_index&                        _index;
+         uint64_t                                 _revision;
+         id_type                                  _next_id;                // objects created since are hidden
+         typename undo_index::const_iterator      _current_end;            // of the objects not created since
+         std::vector<const value_type*>           _old_values;             // oldest value of the objects modified since, by id
+         std::vector<const value_type*>           _removed_values;         // objects removed since, by id
+      };
+
+      revision_view get_view_at(uint64_t revision) const { return revision_view(*this, revision); }
+
+      // the view as of the oldest revision of the undo stack (the last committed one)
+      revision_view get_committed_view() const { return get_view_at(undo_stack_revision_range().first); }
+
+      // Returns the object with the given id as of a revision still on the undo stack, or nullptr if it did
+      // not exist then. Objects which were not modified since that revision are found in O(log n), the
+      // others by walking the changes made since.
+      const value_type* find_at(id_type id, uint64_t revision) const {
+         const undo_state* since = undo_state_at(revision);
+         if (!since)
+            return find(id);
+         if (!(id < since->old_next_id))
+            return nullptr;
+         const value_type* res = find(id);
+         if (!res) {
+            auto removed = std::find_if(_removed_values.begin(), get_removed_values_end(*since), [&](const value_type& v) { return v.id == id; });
+            if (removed == get_removed_values_end(*since))
+               return nullptr;
+            res = &*removed;
+         }
+         if (to_node(*res)._mtime < since->ctime)
+            return res;
+         // the oldest value saved since `revision` is the last one
+         for (auto it = _old_values.begin(), end = get_old_values_end(*since); it != end; ++it) {
+            if (it->id == id)
+               res = &*it;
+         }
+         return res;
+      }
+
+      // The objects changed between two revisions of the undo stack, sorted by id. The pointers are
+      // valid until the index is next modified. Objects created and removed between the two revisions
+      // do not appear.
+      struct revision_diff {
+         std::vector<const value_type*>                                   created;    // values at the later revision
+         std::vector<std::pair<const value_type*, const value_type*>>     modified;   // values at both revisions
+         std::vector<const value_type*>                                   removed;    // values at the earlier revision
+      };
+
+      // Computes the changes from `rev_a` to `rev_b` (rev_a <= rev_b) without modifying the undo stack nor
+      // copying objects. Modified objects are reported even if their value was changed back.
+      revision_diff diff(uint64_t rev_a, uint64_t rev_b) const {
+         const undo_state* since_a = undo_state_at(rev_a);
+         const undo_state* since_b = undo_state_at(rev_b);
+         if (rev_a > rev_b)
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot diff to an earlier revision") );
+         revision_diff res;
+         if (!since_a)
+            return res;
+         revision_view view_b(*this, rev_b);
+         const id_type next_id_a = since_a->old_next_id;
+         const id_type next_id_b = view_b.next_id();
+
+         // objects which existed at `rev_a` and were modified or removed up to `rev_b`
+         std::vector<id_type> touched;
+         auto old_begin = since_b ? get_old_values_end(*since_b) : _old_values.begin();
+         for (auto it = old_begin, end = get_old_values_end(*since_a); it != end; ++it) {
+            if (it->id < next_id_a)
+               touched.push_back(it->id);
+         }
+         auto removed_begin = since_b ? get_removed_values_end(*since_b) : _removed_values.begin();
+         for (auto it = removed_begin, end = get_removed_values_end(*since_a); it != end; ++it) {
+            if (it->id < next_id_a)
+               touched.push_back(it->id);
+         }
+         std::sort(touched.begin(), touched.end());
+         touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+         if (!touched.empty()) {
+            revision_view view_a(*this, rev_a);
+            for (const id_type& id : touched) {
+               const value_type* a = view_a.find(id);
+               if (const value_type* b = view_b.find(id))
+                  res.modified.emplace_back(a, b);
+               else
+                  res.removed.push_back(a);
+            }
+         }
+
+         // objects created between the two revisions, and still there at `rev_b`
+         for (auto it = get<0>().lower_bound(next_id_a), end = get<0>().lower_bound(next_id_b); it != end; ++it)
+            res.created.push_back(view_b.find(it->id));
+         for (auto it = _removed_values.begin(), end = removed_begin; it != end; ++it) {
+            if (!(it->id < next_id_a) && it->id < next_id_b)
+               res.created.push_back(view_b.find(it->id));
+         }
+         std::sort(res.created.begin(), res.created.end(), [](const value_type* a, const value_type* b) { return a->id < b->id; });
+         return res;
+      }
+
       void undo_all() {
          while(!_undo_stack.empty()) {
             undo();
@@ -573,6 +947,7 @@ namespace chainbase {
 
       // Resets the contents to the state at the top of the undo stack.
       void undo() noexcept {
+         before_write(false);
          if (_undo_stack.empty()) return;
          undo_state& undo_info = _undo_stack.back();
          // erase all new_ids
@@ -580,6 +955,9 @@ namespace chainbase {
          auto new_ids_iter = by_id.lower_bound(undo_info.old_next_id);
          by_id.erase_and_dispose(new_ids_iter, by_id.end(), [this](pointer p){
             erase_impl<1>(*p);
+#ifdef CHAINBASE_OBSERVERS
+            notify([&](auto& o) { o.on_remove(*p); });
+#endif
             dispose_node(*p);
          });
          // replace old_values
@@ -589,6 +967,10 @@ namespace chainbase {
             // Duplicate modifies can only happen because of squash.
             if(restored_mtime < undo_info.ctime) {
                auto iter = &to_old_node(*p)._current->_item;
+#ifdef CHAINBASE_OBSERVERS
+               if (get_removed_field(*iter) != erased_flag)
+                  notify([&](auto& o) { o.on_modify(*iter, *p); });
+#endif
                *iter = std::move(*p);
                auto& node_mtime = to_node(*iter)._mtime;
                node_mtime = restored_mtime;
@@ -607,6 +989,9 @@ namespace chainbase {
             if (p->id < undo_info.old_next_id) {
                set_removed_field(*p, 0); // Will be overwritten by tree algorithms, because we're reusing the color.
                insert_impl(*p);
+#ifdef CHAINBASE_OBSERVERS
+               notify([&](auto& o) { o.on_create(*p); });
+#endif
             } else {
                dispose_node(*p);
             }
@@ -614,6 +999,9 @@ namespace chainbase {
          _next_id = undo_info.old_next_id;
          _undo_stack.pop_back();
          --_revision;
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_undo(_revision); });
+#endif
       }
 
       // Combines the top two states on the undo stack
@@ -622,6 +1010,7 @@ namespace chainbase {
       }
 
       void squash_fast() noexcept {
+         before_write(false);
          if (_undo_stack.empty()) {
             return;
          } else if (_undo_stack.size() == 1) {
@@ -629,9 +1018,13 @@ namespace chainbase {
          }
          _undo_stack.pop_back();
          --_revision;
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_squash(_revision); });
+#endif
       }
 
       void squash_and_compress() noexcept {
+         before_write(false);
          if(_undo_stack.size() >= 2) {
             compress_impl(_undo_stack[_undo_stack.size() - 2]);
          }
@@ -639,6 +1032,7 @@ namespace chainbase {
       }
 
       void compress_last_undo_session() noexcept {
+         before_write(false);
          compress_impl(_undo_stack.back());
       }
 
@@ -646,8 +1040,47 @@ namespace chainbase {
          return _allocator.freelist_memory_usage() + _old_values_allocator.freelist_memory_usage();
       }
 
+#ifdef CHAINBASE_OBSERVERS
+      // Observers are kept by the process, not in the index, and must be removed before the index is unmapped.
+      // They must not be added or removed while the index is being modified.
+      void add_observer(undo_index_observer<value_type>& o) {
+         observer_registry()[this].push_back(&o);
+      }
+      void remove_observer(undo_index_observer<value_type>& o) {
+         auto& registry = observer_registry();
+         auto it = registry.find(this);
+         if (it == registry.end())
+            return;
+         std::erase(it->second, &o);
+         if (it->second.empty())
+            registry.erase(it);
+      }
+#endif
+
     private:
 
+#ifdef CHAINBASE_OBSERVERS
+      using observer_list = std::vector<undo_index_observer<value_type>*>;
+      static std::unordered_map<const undo_index*, observer_list>& observer_registry() {
+         static std::unordered_map<const undo_index*, observer_list> registry;
+         return registry;
+      }
+      const observer_list* observers() const {
+         const auto& registry = observer_registry();
+         if (registry.empty())
+            return nullptr;
+         auto it = registry.find(this);
+         return it == registry.end() ? nullptr : &it->second;
+      }
+      template<typename F>
+      void notify(F&& f) const {
+         if (const observer_list* list = observers()) {
+            for (undo_index_observer<value_type>* o : *list)
+               f(*o);
+         }
+      }
+#endif
+
       // Removes elements of the last undo session that would be redundant
       // if all the sessions after @c session were squashed.
       //
@@ -676,9 +1109,18 @@ namespace chainbase {
                                      [this](pointer p) { dispose_node(*p); });
       }
 
+      void before_write(bool may_throw = true) const {
+         if (auto hook = undo_index_write_hook.load(std::memory_order_relaxed))
+            hook(this, may_throw);
+      }
+
       // starts a new undo session.
       // Exception safety: strong
       int64_t add_session() {
+         before_write();
+#ifdef CHAINBASE_OBSERVERS
+         notify([&](auto& o) { o.on_session_start(_revision); });
+#endif
          _undo_stack.emplace_back();
          _undo_stack.back().old_values_end = _old_values.empty()?nullptr:&*_old_values.begin();
          _undo_stack.back().removed_values_end = _removed_values.empty()?nullptr:&*_removed_values.begin();
@@ -840,6 +1282,14 @@ namespace chainbase {
          return static_cast<decltype(_removed_values.cend())>(const_cast<undo_index*>(this)->get_removed_values_end(info));
       }
 
+      // the undo state holding the changes made since `revision`, or nullptr for the current revision
+      const undo_state* undo_state_at(uint64_t revision) const {
+         auto [first, last] = undo_stack_revision_range();
+         if (revision < first || revision > last)
+            BOOST_THROW_EXCEPTION( std::out_of_range("revision " + std::to_string(revision) + " is not on the undo stack") );
+         return revision == last ? nullptr : &_undo_stack[revision - first];
+      }
+
       // returns true if the node should be destroyed
       bool on_remove( value_type& obj) {
          if (!_undo_stack.empty()) {
@@ -854,6 +1304,12 @@ namespace chainbase {
          }
          return true;
       }
+      // keeps `obj`, which was erased from the indices, on the undo stack, or frees it
+      void dispose_removed( value_type& obj ) noexcept {
+         if(on_remove(obj)) {
+            dispose_node(obj);
+         }
+      }
       // Returns the field indicating whether the node has been removed
       static int get_removed_field(const value_type& obj) {
          return static_cast<hook<index0_type, Allocator>&>(to_node(obj))._color;
@@ -1,6 +1,7 @@
 #include <chainbase/chainbase.hpp>
 #include <boost/array.hpp>
 
+#include <algorithm>
 #include <iostream>
 
 #ifndef _WIN32
@@ -17,6 +18,11 @@ namespace chainbase {
       _read_only_mode = _read_only;
    }
 
+   database::database(pinnable_mapped_file&& file) :
+      _db_file(std::move(file))
+   {
+   }
+
    database::~database()
    {
       _index_list.clear();
@@ -27,40 +33,53 @@ namespace chainbase {
    {
       if ( _read_only_mode )
          BOOST_THROW_EXCEPTION( std::logic_error( "attempting to undo in read-only mode" ) );
+      _db_file.begin_write();
       for( auto& item : _index_list )
       {
          item->undo();
       }
+      discard_changes();
+      publish();
    }
 
    void database::squash()
    {
       if ( _read_only_mode )
          BOOST_THROW_EXCEPTION( std::logic_error( "attempting to squash in read-only mode" ) );
+      _db_file.begin_write();
       for( auto& item : _index_list )
       {
          item->squash();
       }
+      discard_changes();
+      publish();
    }
 
    void database::commit( int64_t revision )
    {
       if ( _read_only_mode )
          BOOST_THROW_EXCEPTION( std::logic_error( "attempting to commit in read-only mode" ) );
+      if( _change_log )
+         log_changes( revision );
+      _db_file.begin_write();
       for( auto& item : _index_list )
       {
          item->commit( revision );
       }
+      on_revision_boundary( true );
    }
 
    void database::undo_all()
    {
       if ( _read_only_mode )
          BOOST_THROW_EXCEPTION( std::logic_error( "attempting to undo_all in read-only mode" ) );
+      _db_file.begin_write();
       for( auto& item : _index_list )
       {
          item->undo_all();
       }
+      discard_changes();
+      publish();
    }
 
    database::session database::start_undo_session( bool enabled )
@@ -68,15 +87,137 @@ namespace chainbase {
       if ( _read_only_mode )
          BOOST_THROW_EXCEPTION( std::logic_error( "attempting to start_undo_session in read-only mode" ) );
       if( enabled ) {
+         if( _change_log && !_index_list.empty() )
+            record_changes();
+         on_revision_boundary( false );
+         _db_file.begin_write();
          vector< std::unique_ptr<abstract_session> > _sub_sessions;
          _sub_sessions.reserve( _index_list.size() );
          for( auto& item : _index_list ) {
             _sub_sessions.push_back( item->start_undo_session( enabled ) );
          }
-         return session( std::move( _sub_sessions ) );
+         return session( std::move( _sub_sessions ), *this, true );
       } else {
          return session();
       }
    }
 
+   database::session database::start_nested_undo_session()
+   {
+      if ( _read_only_mode )
+         BOOST_THROW_EXCEPTION( std::logic_error( "attempting to start_nested_undo_session in read-only mode" ) );
+      _db_file.begin_write();
+      vector< std::unique_ptr<abstract_session> > _sub_sessions;
+      _sub_sessions.reserve( _index_list.size() );
+      for( auto& item : _index_list ) {
+         _sub_sessions.push_back( item->start_undo_session( true ) );
+      }
+      return session( std::move( _sub_sessions ), *this, false );
+   }
+
+   void database::flush( size_t max_bytes )
+   {
+      if ( !_read_only )
+         _db_file.flush( max_bytes );
+   }
+
+   void database::checkpoint()
+   {
+      if ( _read_only )
+         BOOST_THROW_EXCEPTION( std::logic_error( "attempting to checkpoint a read-only database" ) );
+      _db_file.checkpoint();
+      if( _checkpoint_interval.count() )
+         _next_checkpoint = std::chrono::steady_clock::now() + _checkpoint_interval;
+   }
+
+   void database::set_checkpoint_interval( std::chrono::milliseconds interval )
+   {
+      if ( _read_only && interval.count() )
+         BOOST_THROW_EXCEPTION( std::logic_error( "attempting to checkpoint a read-only database" ) );
+      _checkpoint_interval = interval;
+      _next_checkpoint = std::chrono::steady_clock::now() + interval;
+   }
+
+   void database::enable_journal()
+   {
+      if ( _read_only )
+         BOOST_THROW_EXCEPTION( std::logic_error( "attempting to journal a read-only database" ) );
+      _db_file.enable_journal();
+      if( _checkpoint_interval.count() )
+         _next_checkpoint = std::chrono::steady_clock::now() + _checkpoint_interval;
+   }
+
+   void database::enable_concurrent_reads()
+   {
+      if ( _read_only )
+         BOOST_THROW_EXCEPTION( std::logic_error( "attempting to write a read-only database" ) );
+      _db_file.enable_concurrent_reads();
+      publish();
+   }
+
+   database database::fork()const
+   {
+      database f( _db_file.fork() );
+      for( abstract_index* i : _index_list ) {
+         const uint32_t type_id = i->type_id();
+         if( type_id >= f._index_map.size() )
+            f._index_map.resize( type_id + 1 );
+         f._index_map[ type_id ] = i->fork( _db_file.get_segment_manager(), f._db_file.get_segment_manager() );
+         f._index_list.push_back( f._index_map[ type_id ].get() );
+      }
+      return f;
+   }
+
+   // The changes from `revision` to the next one. Those of the top session only read its undo state, the others
+   // also the undo states of the sessions after it.
+   std::vector<char> database::changes_of( int64_t revision )const
+   {
+      change_record_writer out( revision + 1 );
+      for( auto& item : _index_list )
+         item->write_changes( revision, out );
+      return out.finish();
+   }
+
+   void database::log_changes( int64_t revision )
+   {
+      if( _index_list.empty() )
+         return;
+      const auto [first, last] = _index_list[0]->undo_stack_revision_range();
+      for( int64_t r = first; r < std::min<int64_t>( revision, last ); ++r ) {
+         while( !_pending_changes.empty() && _pending_changes.front().first <= r )
+            _pending_changes.pop_front();
+         if( !_pending_changes.empty() && _pending_changes.front().first == r + 1 ) {
+            _change_log->append( r + 1, std::move( _pending_changes.front().second ) );
+            _pending_changes.pop_front();
+         } else {
+            _change_log->append( r + 1, changes_of( r ) );
+         }
+      }
+   }
+
+   // Called before a session starts: the changes of the top session are final unless it is undone or squashed,
+   // which discards them. Only pushed sessions are recorded, as the others are usually squashed or undone.
+   void database::record_changes()
+   {
+      const int64_t r = revision();
+      if( r != _pushed_revision || !_index_list[0]->has_undo_session() )
+         return;
+      if( _pending_changes.empty() || _pending_changes.back().first < r )
+         _pending_changes.emplace_back( r, changes_of( r - 1 ) );
+   }
+
+   void database::discard_changes()
+   {
+      while( !_pending_changes.empty() && _pending_changes.back().first >= revision() )
+         _pending_changes.pop_back();
+   }
+
+   void database::on_revision_boundary( bool durable )
+   {
+      publish();
+      _db_file.journal_commit( revision(), durable );
+      if( _checkpoint_interval.count() && std::chrono::steady_clock::now() >= _next_checkpoint )
+         checkpoint();
+   }
+
 }  // namespace chainbase
@@ -0,0 +1,167 @@
+#include <chainbase/change_log.hpp>
+#include <chainbase/scope_exit.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace chainbase {
+
+namespace {
+   constexpr size_t count_offset = sizeof(int64_t);          // of the number of changes in a record
+
+   void patch_u32(std::vector<char>& v, size_t pos, uint32_t x) {
+      for (size_t i = 0; i < sizeof(x); ++i, x >>= 8)
+         v[pos + i] = static_cast<char>(x & 0xff);
+   }
+
+   [[noreturn]] void throw_error(const std::string& what) {
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), what));
+   }
+}
+
+change_record_writer::change_record_writer(int64_t revision) {
+   snapshot_row_writer w(_record);
+   w.write(revision);
+   w.write(uint32_t(0));
+}
+
+void change_record_writer::write_header(uint16_t type_id, change_kind kind, int64_t id) {
+   snapshot_row_writer w(_record);
+   w.write(type_id);
+   w.write(kind);
+   w.write(id);
+   ++_num_changes;
+}
+
+snapshot_row_writer change_record_writer::begin_change(uint16_t type_id, change_kind kind, int64_t id) {
+   write_header(type_id, kind, id);
+   snapshot_row_writer(_record).write(uint32_t(0));
+   _row_start = _record.size();
+   return snapshot_row_writer(_record);
+}
+
+void change_record_writer::end_change() {
+   patch_u32(_record, _row_start - sizeof(uint32_t), _record.size() - _row_start);
+}
+
+void change_record_writer::add_removed(uint16_t type_id, int64_t id) {
+   write_header(type_id, change_kind::removed, id);
+}
+
+std::vector<char> change_record_writer::finish() {
+   patch_u32(_record, count_offset, _num_changes);
+   return std::move(_record);
+}
+
+change_record_reader::change_record_reader(const char* data, size_t size) : _in(data, size) {
+   _revision    = _in.read<int64_t>();
+   _num_changes = _in.read<uint32_t>();
+}
+
+std::optional<change_record_reader::change> change_record_reader::next() {
+   if (_num_read == _num_changes)
+      return {};
+   ++_num_read;
+   const auto type_id = _in.read<uint16_t>();
+   const auto kind    = _in.read<change_kind>();
+   const auto id      = _in.read<int64_t>();
+   std::string_view row;
+   if (kind != change_kind::removed)
+      row = _in.read_string();
+   return change{ type_id, kind, id, snapshot_row_reader(row.data(), row.size()) };
+}
+
+// ---------------------------------------------------------------------------------------
+
+void change_ring::append(int64_t revision, std::vector<char>&& record) {
+   std::lock_guard g(_mutex);
+   _size += record.size();
+   _records.push_back(entry{ revision, std::move(record) });
+   while (_size > _capacity && _records.size() > 1) {
+      _size -= _records.front().record.size();
+      _records.pop_front();
+   }
+}
+
+void change_ring::read_after(int64_t revision, const std::function<void(int64_t, std::string_view)>& f) const {
+   std::lock_guard g(_mutex);
+   auto it = std::upper_bound(_records.begin(), _records.end(), revision, [](int64_t r, const entry& e) { return r < e.revision; });
+   for (; it != _records.end(); ++it)
+      f(it->revision, std::string_view(it->record.data(), it->record.size()));
+}
+
+int64_t change_ring::first_revision() const {
+   std::lock_guard g(_mutex);
+   return _records.empty() ? -1 : _records.front().revision;
+}
+
+size_t change_ring::size() const {
+   std::lock_guard g(_mutex);
+   return _size;
+}
+
+// ---------------------------------------------------------------------------------------
+
+change_file::change_file(const std::filesystem::path& path) : _path(path) {
+   _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (_fd < 0)
+      throw_error("opening " + _path.string());
+}
+
+change_file::~change_file() {
+   if (_fd >= 0)
+      ::close(_fd);
+}
+
+void change_file::append(int64_t, std::vector<char>&& record) {
+   // a single write, so that the file never holds a size without its record unless the write is torn
+   std::vector<char> framed;
+   framed.reserve(sizeof(uint32_t) + record.size());
+   snapshot_row_writer(framed).write(static_cast<uint32_t>(record.size()));
+   framed.insert(framed.end(), record.begin(), record.end());
+   const char* p = framed.data();
+   for (size_t sz = framed.size(); sz;) {
+      ssize_t n = ::write(_fd, p, sz);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         throw_error("writing " + _path.string());
+      p += n;
+      sz -= n;
+   }
+}
+
+void change_file::read(const std::filesystem::path& path, const std::function<void(std::string_view)>& f) {
+   int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      throw_error("opening " + path.string());
+   auto close_fd = scope_exit([&]() { ::close(fd); });
+
+   std::vector<char> data;
+   char buf[64*1024];
+   for (;;) {
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         throw_error("reading " + path.string());
+      if (n == 0)
+         break;
+      data.insert(data.end(), buf, buf + n);
+   }
+
+   snapshot_row_reader in(data.data(), data.size());
+   while (in.remaining() >= sizeof(uint32_t)) {
+      snapshot_row_reader peek = in;
+      if (peek.read<uint32_t>() > peek.remaining())
+         break;                                   // torn last record
+      f(in.read_string());
+   }
+}
+
+}  // namespace chainbase
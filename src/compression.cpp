@@ -0,0 +1,272 @@
+#include <chainbase/compression.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+
+namespace chainbase {
+
+namespace lz {
+
+constexpr size_t   min_match       = 4;
+constexpr size_t   max_offset      = 65535;
+constexpr unsigned hash_log        = 14;
+constexpr size_t   last_literals   = 8;      // the end of the input is always emitted as literals
+
+static uint32_t read32(const char* p) {
+   uint32_t v;
+   std::memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static size_t length_bytes(size_t len) {
+   return len >= 15 ? 1 + (len - 15) / 255 + 1 : 0;
+}
+
+static char* write_length(char* op, size_t len) {
+   if (len >= 15) {
+      for (len -= 15; len >= 255; len -= 255)
+         *op++ = (char)255;
+      *op++ = (char)len;
+   }
+   return op;
+}
+
+// emits `lit_len` literals followed by a match of `match_len` bytes at `offset` (no match if `match_len` == 0)
+static char* write_sequence(char* op, char* op_end, const char* lit, size_t lit_len, size_t offset, size_t match_len) {
+   const size_t ml = match_len ? match_len - min_match : 0;
+   const size_t needed = 1 + length_bytes(lit_len) + lit_len + (match_len ? 2 + length_bytes(ml) : 0);
+   if ((size_t)(op_end - op) < needed)
+      return nullptr;
+   *op++ = (char)((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(ml, 15));
+   op = write_length(op, lit_len);
+   std::memcpy(op, lit, lit_len);
+   op += lit_len;
+   if (match_len) {
+      *op++ = (char)(offset & 0xff);
+      *op++ = (char)(offset >> 8);
+      op = write_length(op, ml);
+   }
+   return op;
+}
+
+size_t compress(const char* src, size_t src_size, char* dst, size_t dst_capacity) {
+   uint32_t table[1 << hash_log] = {};       // position + 1 of the last occurrence of each hashed 4 byte sequence
+   char* op = dst;
+   char* const op_end = dst + dst_capacity;
+   size_t anchor = 0;
+
+   if (src_size > last_literals + min_match) {
+      const size_t limit = src_size - last_literals;
+      size_t ip = 0;
+      while (ip < limit) {
+         const uint32_t seq = read32(src + ip);
+         uint32_t& slot = table[(seq * 2654435761u) >> (32 - hash_log)];
+         const size_t ref = slot;
+         slot = (uint32_t)(ip + 1);
+         if (ref == 0 || ip - (ref - 1) > max_offset || read32(src + ref - 1) != seq) {
+            ++ip;
+            continue;
+         }
+         const size_t match = ref - 1;
+         size_t len = min_match;
+         while (ip + len < limit && src[match + len] == src[ip + len])
+            ++len;
+         op = write_sequence(op, op_end, src + anchor, ip - anchor, ip - match, len);
+         if (!op)
+            return 0;
+         ip += len;
+         anchor = ip;
+      }
+   }
+   op = write_sequence(op, op_end, src + anchor, src_size - anchor, 0, 0);
+   return op ? op - dst : 0;
+}
+
+bool decompress(const char* src, size_t src_size, char* dst, size_t dst_size) {
+   const uint8_t* ip     = (const uint8_t*)src;
+   const uint8_t* ip_end = ip + src_size;
+   size_t op = 0;
+
+   auto read_length = [&](size_t len) -> std::optional<size_t> {
+      if (len == 15) {
+         uint8_t b;
+         do {
+            if (ip == ip_end)
+               return {};
+            b = *ip++;
+            len += b;
+         } while (b == 255);
+      }
+      return len;
+   };
+
+   while (ip < ip_end) {
+      const uint8_t token = *ip++;
+      auto lit_len = read_length(token >> 4);
+      if (!lit_len || *lit_len > (size_t)(ip_end - ip) || *lit_len > dst_size - op)
+         return false;
+      std::memcpy(dst + op, ip, *lit_len);
+      ip += *lit_len;
+      op += *lit_len;
+      if (op == dst_size)
+         return true;                         // anything left is padding
+
+      if (ip_end - ip < 2)
+         return false;
+      const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+      ip += 2;
+      auto match_len = read_length(token & 15);
+      if (!match_len || offset == 0 || offset > op || *match_len + min_match > dst_size - op)
+         return false;
+      const char* match = dst + op - offset;
+      for (size_t i = 0; i < *match_len + min_match; ++i)     // may overlap the bytes being written
+         dst[op + i] = match[i];
+      op += *match_len + min_match;
+      if (op == dst_size)
+         return true;
+   }
+   return false;
+}
+
+} // namespace lz
+
+namespace compressed_payload {
+
+static uint64_t checksum(const char* p, size_t sz) {
+   constexpr uint64_t m = 0x9e3779b97f4a7c15ULL;
+   auto mix = [](uint64_t h, uint64_t k) {
+      h = (h ^ k) * m;
+      return h ^ (h >> 29);
+   };
+   uint64_t h = sz * m;
+   for (; sz >= 8; sz -= 8, p += 8) {
+      uint64_t k;
+      std::memcpy(&k, p, 8);
+      h = mix(h, k);
+   }
+   if (sz) {
+      uint64_t k = 0;
+      std::memcpy(&k, p, sz);
+      h = mix(h, k);
+   }
+   return mix(h, h >> 32);
+}
+
+size_t compress(const char* src, size_t src_size, char* dst, size_t dst_capacity) {
+   if (dst_capacity <= header_size)
+      return 0;
+   const size_t stream_size = lz::compress(src, src_size, dst + header_size, dst_capacity - header_size);
+   if (stream_size == 0)
+      return 0;
+   const uint64_t sum = checksum(dst + header_size, stream_size);
+   std::memcpy(dst, &sum, header_size);
+   return header_size + stream_size;
+}
+
+} // namespace compressed_payload
+
+namespace {
+   struct cache_entry {
+      uint64_t                checksum;
+      std::unique_ptr<char[]> data;
+      size_t                  size;
+   };
+
+   std::atomic<size_t>        total_memory_usage{0};
+
+   // Entries are ordered by address, for `erase_range`. Payloads are spread over shards, so that threads
+   // reading different payloads rarely contend for a lock.
+   struct cache_shard {
+      std::mutex                            mutex;
+      std::map<const void*, cache_entry>    entries;
+
+      void erase(std::map<const void*, cache_entry>::iterator it) {
+         total_memory_usage -= it->second.size;
+         entries.erase(it);
+      }
+   };
+
+   constexpr size_t num_shards = 64;
+
+   // never destroyed, as databases may still be closed while static objects are destroyed
+   std::span<cache_shard> shards() {
+      static cache_shard* const s = new cache_shard[num_shards];
+      return { s, num_shards };
+   }
+
+   cache_shard& shard_of(const void* payload) {
+      // payloads are at least 8 bytes apart
+      return shards()[(reinterpret_cast<uintptr_t>(payload) >> 3) % num_shards];
+   }
+}
+
+const char* decompression_cache::get(const void* payload, const char* src, size_t src_size, size_t size) {
+   uint64_t checksum;
+   std::memcpy(&checksum, src, sizeof(checksum));
+   cache_shard& shard = shard_of(payload);
+   {
+      std::lock_guard g(shard.mutex);
+      auto it = shard.entries.find(payload);
+      if (it != shard.entries.end()) {
+         if (it->second.checksum == checksum)
+            return it->second.data.get();
+         shard.erase(it);                           // the payload was replaced since we cached it
+      }
+   }
+
+   // decompressed without holding the lock, which other payloads of the shard may need meanwhile
+   if (src_size < compressed_payload::header_size)
+      BOOST_THROW_EXCEPTION(std::runtime_error("corrupted compressed payload in chainbase database"));
+   std::unique_ptr<char[]> data(new char[size + 1]);
+   if (!lz::decompress(src + compressed_payload::header_size, src_size - compressed_payload::header_size, data.get(), size))
+      BOOST_THROW_EXCEPTION(std::runtime_error("corrupted compressed payload in chainbase database"));
+   data[size] = '\0';
+
+   std::lock_guard g(shard.mutex);
+   auto it = shard.entries.find(payload);
+   if (it != shard.entries.end()) {
+      if (it->second.checksum == checksum)
+         return it->second.data.get();              // cached by another thread meanwhile
+      shard.erase(it);
+   }
+   total_memory_usage += size + 1;
+   return shard.entries.emplace(payload, cache_entry{checksum, std::move(data), size + 1}).first->second.data.get();
+}
+
+void decompression_cache::erase(const void* payload) {
+   cache_shard& shard = shard_of(payload);
+   std::lock_guard g(shard.mutex);
+   if (auto it = shard.entries.find(payload); it != shard.entries.end())
+      shard.erase(it);
+}
+
+void decompression_cache::erase_range(const void* begin, const void* end) {
+   for (cache_shard& shard : shards()) {
+      std::lock_guard g(shard.mutex);
+      auto it = shard.entries.lower_bound(begin);
+      while (it != shard.entries.end() && it->first < end)
+         shard.erase(it++);
+   }
+}
+
+void decompression_cache::clear() {
+   for (cache_shard& shard : shards()) {
+      std::lock_guard g(shard.mutex);
+      while (!shard.entries.empty())
+         shard.erase(shard.entries.begin());
+   }
+}
+
+size_t decompression_cache::memory_usage() {
+   return total_memory_usage.load(std::memory_order_relaxed);
+}
+
+} // namespace chainbase
@@ -0,0 +1,241 @@
+#include <chainbase/page_journal.hpp>
+#include <chainbase/scope_exit.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace chainbase {
+
+namespace {
+   constexpr char     journal_magic[8] = { 'C', 'B', 'J', 'R', 'N', 'L', '0', '1' };
+   constexpr uint64_t commit_marker    = ~0ULL;      // never a page offset
+   constexpr size_t   write_size       = 8*1024*1024;
+
+   struct journal_header {
+      char     magic[8];
+      uint64_t page_size;
+   };
+
+   struct commit_record {
+      uint64_t marker;
+      uint64_t num_pages;
+      int64_t  revision;
+      uint64_t checksum;
+   };
+
+   uint64_t checksum(uint64_t h, const void* data, size_t sz) {
+      constexpr uint64_t m = 0x9e3779b97f4a7c15ULL;
+      const char* p = static_cast<const char*>(data);
+      for (; sz >= 8; sz -= 8, p += 8) {
+         uint64_t k;
+         std::memcpy(&k, p, 8);
+         h = (h ^ k) * m;
+         h ^= h >> 29;
+      }
+      for (; sz; --sz, ++p)
+         h = ((h ^ (uint8_t)*p) * m) ^ (h >> 29);
+      return h;
+   }
+
+   uint64_t final_checksum(uint64_t h, uint64_t num_pages, int64_t revision) {
+      h = checksum(h, &num_pages, sizeof(num_pages));
+      return checksum(h, &revision, sizeof(revision));
+   }
+
+   [[noreturn]] void throw_error(const std::string& what) {
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), what));
+   }
+
+   void sync_data(int fd, const std::string& what) {
+#ifdef __APPLE__
+      if (::fsync(fd) != 0)
+#else
+      if (::fdatasync(fd) != 0)
+#endif
+         throw_error("syncing " + what);
+   }
+
+   bool write_at(int fd, uint64_t offset, const char* data, size_t sz) {
+      while (sz) {
+         ssize_t n = ::pwrite(fd, data, sz, offset);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0)
+            return false;
+         data += n;
+         offset += n;
+         sz -= n;
+      }
+      return true;
+   }
+
+   bool read_at(int fd, uint64_t offset, void* data, size_t sz) {
+      char* p = static_cast<char*>(data);
+      while (sz) {
+         ssize_t n = ::pread(fd, p, sz, offset);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n <= 0)
+            return false;
+         p += n;
+         offset += n;
+         sz -= n;
+      }
+      return true;
+   }
+}
+
+page_journal::page_journal(std::filesystem::path path, size_t page_size)
+   : _path(std::move(path))
+   , _page_size(page_size) {
+   _fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (_fd < 0)
+      throw_error("creating " + _path.string());
+   auto close_on_fail = scope_fail([&]() { ::close(_fd); });
+
+   journal_header header;
+   std::memcpy(header.magic, journal_magic, sizeof(header.magic));
+   header.page_size = _page_size;
+   if (!write_at(_fd, 0, (const char*)&header, sizeof(header)))
+      throw_error("writing " + _path.string());
+   _size = _committed_size = _synced_size = sizeof(header);
+   sync_data(_fd, _path.string());
+
+   // make the new directory entry durable as well
+   int dir_fd = ::open(_path.parent_path().c_str(), O_RDONLY | O_CLOEXEC);
+   if (dir_fd >= 0) {
+      ::fsync(dir_fd);
+      ::close(dir_fd);
+   }
+}
+
+page_journal::~page_journal() {
+   if (_fd >= 0)
+      ::close(_fd);
+}
+
+void page_journal::append(uint64_t offset, const void* page) {
+   _checksum = checksum(_checksum, &offset, sizeof(offset));
+   _checksum = checksum(_checksum, page, _page_size);
+   ++_num_pages;
+
+   _buffer.insert(_buffer.end(), (const char*)&offset, (const char*)&offset + sizeof(offset));
+   _buffer.insert(_buffer.end(), (const char*)page, (const char*)page + _page_size);
+   if (_buffer.size() >= write_size)
+      write_buffer();
+}
+
+void page_journal::commit(int64_t revision) {
+   commit_record rec { commit_marker, _num_pages, revision, final_checksum(_checksum, _num_pages, revision) };
+   _buffer.insert(_buffer.end(), (const char*)&rec, (const char*)&rec + sizeof(rec));
+   write_buffer();
+   _committed_size = _size;
+   _num_pages = 0;
+   _checksum  = 0;
+}
+
+void page_journal::sync() {
+   if (_synced_size == _committed_size)
+      return;
+   sync_data(_fd, _path.string());
+   _synced_size = _committed_size;
+}
+
+void page_journal::rollback() {
+   _buffer.clear();
+   _num_pages = 0;
+   _checksum  = 0;
+   if (_size != _committed_size) {
+      if (::ftruncate(_fd, _committed_size) != 0)
+         throw_error("truncating " + _path.string());
+      _size = _committed_size;
+   }
+}
+
+void page_journal::reset() {
+   _buffer.clear();
+   _num_pages = 0;
+   _checksum  = 0;
+   _size = _committed_size = sizeof(journal_header);
+   if (::ftruncate(_fd, _size) != 0)
+      throw_error("truncating " + _path.string());
+   sync_data(_fd, _path.string());
+   _synced_size = _size;
+}
+
+void page_journal::remove() {
+   ::close(_fd);
+   _fd = -1;
+   std::error_code ec;
+   std::filesystem::remove(_path, ec);
+}
+
+void page_journal::write_buffer() {
+   if (!write_at(_fd, _size, _buffer.data(), _buffer.size()))
+      throw_error("writing " + _path.string());
+   _size += _buffer.size();
+   _buffer.clear();
+}
+
+std::optional<page_journal::replay_result> page_journal::replay(const std::filesystem::path& path, int fd) {
+   int journal_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (journal_fd < 0)
+      return {};
+   auto close_journal = scope_exit([&]() { ::close(journal_fd); });
+
+   journal_header header;
+   if (!read_at(journal_fd, 0, &header, sizeof(header)) || std::memcmp(header.magic, journal_magic, sizeof(header.magic)) ||
+       header.page_size == 0 || header.page_size > 1024*1024*1024)
+      return {};
+
+   const size_t page_size   = header.page_size;
+   const size_t record_size = sizeof(uint64_t) + page_size;
+   std::vector<char> page(page_size);
+   replay_result res;
+   uint64_t pos = sizeof(header);
+
+   for (;;) {
+      // check that the transaction is complete before applying any of it
+      uint64_t end = pos, h = 0, num_pages = 0, marker;
+      commit_record rec;
+      bool complete = false;
+      while (read_at(journal_fd, end, &marker, sizeof(marker))) {
+         if (marker == commit_marker) {
+            complete = read_at(journal_fd, end, &rec, sizeof(rec)) && rec.num_pages == num_pages &&
+                       rec.checksum == final_checksum(h, num_pages, rec.revision);
+            break;
+         }
+         if (!read_at(journal_fd, end + sizeof(marker), page.data(), page_size))
+            break;
+         h = checksum(checksum(h, &marker, sizeof(marker)), page.data(), page_size);
+         ++num_pages;
+         end += record_size;
+      }
+      if (!complete)
+         break;
+
+      for (uint64_t p = pos; p != end; p += record_size) {
+         uint64_t offset;
+         if (!read_at(journal_fd, p, &offset, sizeof(offset)) || !read_at(journal_fd, p + sizeof(offset), page.data(), page_size))
+            throw_error("reading " + path.string());
+         if (!write_at(fd, offset, page.data(), page_size))
+            throw_error("applying " + path.string());
+      }
+      ++res.num_transactions;
+      res.num_pages += num_pages;
+      res.revision = rec.revision;
+      pos = end + sizeof(rec);
+   }
+
+   if (res.num_transactions)
+      sync_data(fd, "database file");
+   return res;
+}
+
+}  // namespace chainbase
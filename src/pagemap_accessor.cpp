@@ -0,0 +1,140 @@
+#include <chainbase/pagemap_accessor.hpp>
+
+#if defined(__linux__) && __has_include(<linux/userfaultfd.h>)
+#include <linux/userfaultfd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#if defined(SYS_userfaultfd)
+#define CHAINBASE_HAS_WRITE_PROTECT_TRACKER
+#endif
+#endif
+
+#ifdef CHAINBASE_HAS_WRITE_PROTECT_TRACKER
+// definitions from Linux 6.7, for older kernel headers
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1<<13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC       (1<<15)
+#endif
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY         1
+#endif
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN             (1 << 1)
+#define PM_SCAN_WP_MATCHING         (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC       (1 << 1)
+
+struct page_region {
+   __u64 start;
+   __u64 end;
+   __u64 categories;
+};
+
+struct pm_scan_arg {
+   __u64 size;
+   __u64 flags;
+   __u64 start;
+   __u64 end;
+   __u64 walk_end;
+   __u64 vec;
+   __u64 vec_len;
+   __u64 max_pages;
+   __u64 category_inverted;
+   __u64 category_mask;
+   __u64 category_anyof_mask;
+   __u64 return_mask;
+};
+
+#define PAGEMAP_SCAN                _IOWR('f', 16, struct pm_scan_arg)
+#endif
+#endif
+
+namespace chainbase {
+
+int open_userfaultfd() {
+#ifdef CHAINBASE_HAS_WRITE_PROTECT_TRACKER
+   int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+   if (fd < 0 && errno == EINVAL)
+      fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+   return fd;
+#else
+   return -1;
+#endif
+}
+
+std::unique_ptr<write_protect_tracker> write_protect_tracker::create(std::span<std::byte> mapping) {
+   std::unique_ptr<write_protect_tracker> tracker(new write_protect_tracker);
+   if (!tracker->_init(mapping))
+      return {};
+   return tracker;
+}
+
+write_protect_tracker::~write_protect_tracker() {
+   if (_uffd >= 0)
+      ::close(_uffd);
+   if (_pagemap_fd >= 0)
+      ::close(_pagemap_fd);
+}
+
+bool write_protect_tracker::scan_written(std::span<std::byte> rgn, const std::function<void(std::byte*, std::byte*)>& f, bool protect) const {
+#ifdef CHAINBASE_HAS_WRITE_PROTECT_TRACKER
+   const uintptr_t start = (uintptr_t)rgn.data();
+   const uintptr_t end   = start + rgn.size();
+   page_region regions[512];
+   pm_scan_arg arg = {};
+   arg.size          = sizeof(arg);
+   arg.flags         = (protect ? PM_SCAN_WP_MATCHING : 0) | PM_SCAN_CHECK_WPASYNC;
+   arg.start         = start;
+   arg.end           = end;
+   arg.vec           = (uintptr_t)regions;
+   arg.vec_len       = std::size(regions);
+   arg.category_mask = PAGE_IS_WRITTEN;
+   arg.return_mask   = PAGE_IS_WRITTEN;
+   while (arg.start != end) {
+      int num_regions = ioctl(_pagemap_fd, PAGEMAP_SCAN, &arg);
+      if (num_regions < 0)
+         return false;
+      for (int i = 0; i < num_regions; ++i) {
+         // a region may extend past `rgn` when the mapping uses huge pages
+         f((std::byte*)std::max<uintptr_t>(regions[i].start, start), (std::byte*)std::min<uintptr_t>(regions[i].end, end));
+      }
+      if (arg.walk_end <= arg.start)
+         return false;
+      arg.start = arg.walk_end;
+   }
+   return true;
+#else
+   return false;
+#endif
+}
+
+bool write_protect_tracker::_init(std::span<std::byte> mapping) {
+#ifdef CHAINBASE_HAS_WRITE_PROTECT_TRACKER
+   _uffd = open_userfaultfd();
+   if (_uffd < 0)
+      return false;
+
+   // with `UFFD_FEATURE_WP_UNPOPULATED`, pages not populated yet are protected as well
+   uffdio_api api = { .api = UFFD_API, .features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED };
+   if (ioctl(_uffd, UFFDIO_API, &api) != 0)
+      return false;
+
+   const uffdio_range range = { .start = (uintptr_t)mapping.data(), .len = mapping.size() };
+   uffdio_register reg = { .range = range, .mode = UFFDIO_REGISTER_MODE_WP };
+   if (ioctl(_uffd, UFFDIO_REGISTER, &reg) != 0)
+      return false;
+
+   uffdio_writeprotect wp = { .range = range, .mode = UFFDIO_WRITEPROTECT_MODE_WP };
+   if (ioctl(_uffd, UFFDIO_WRITEPROTECT, &wp) != 0)
+      return false;
+
+   _pagemap_fd = ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+   return _pagemap_fd >= 0;
+#else
+   return false;
+#endif
+}
+
+}  // namespace chainbase
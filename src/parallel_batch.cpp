@@ -0,0 +1,129 @@
+#include <chainbase/parallel_batch.hpp>
+#include <chainbase/scope_exit.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <unordered_set>
+
+namespace chainbase {
+
+void transaction_context::add_read(uint16_t type_id, int64_t id) {
+   // before the merge, the transaction does not see its own writes
+   if (_speculative && !_read_own_write) {
+      for (const auto& w : _write_set) {
+         if (w.type_id == type_id && (w.id == id || w.id == object_key::any_id || id == object_key::any_id)) {
+            _read_own_write = true;
+            break;
+         }
+      }
+   }
+   _read_set.push_back({type_id, id});
+}
+
+void transaction_context::add_write(uint16_t type_id, int64_t id) {
+   // a second write of an object modifies what the first one wrote, which the transaction only saw as it was
+   if (_speculative && id != object_key::any_id &&
+       std::find(_write_set.begin(), _write_set.end(), object_key{type_id, id}) != _write_set.end())
+      _read_own_write = true;
+   _write_set.push_back({type_id, id});
+}
+
+std::vector<transaction_result> apply_parallel(database& db, size_t num_transactions,
+                                               const std::function<void(size_t, transaction_context&)>& f,
+                                               unsigned num_threads) {
+   std::vector<transaction_result> results(num_transactions);
+   std::vector<std::unique_ptr<transaction_context>> speculative;
+   std::vector<char> failed(num_transactions, false);
+   for (size_t i = 0; i < num_transactions; ++i)
+      speculative.push_back(std::make_unique<transaction_context>(db, true));
+
+   // run all the transactions against the state before the batch, which nothing writes meanwhile
+   {
+      std::atomic<size_t> next = 0;
+      auto work = [&]() {
+         for (size_t i; (i = next++) < num_transactions;) {
+            try {
+               f(i, *speculative[i]);
+            } catch (...) {
+               failed[i] = true;             // run again, to get its error (or its result) in order
+            }
+         }
+      };
+
+      std::vector<std::thread> workers;
+      auto join = scope_exit([&]() {
+         for (auto& t : workers)
+            t.join();
+      });
+      const unsigned num_workers = (unsigned)std::max<size_t>(1, std::min<size_t>(num_threads, num_transactions));
+      try {
+         for (unsigned i = 1; i < num_workers; ++i)
+            workers.emplace_back(work);
+      } catch (...) {
+         // fewer threads, the calling thread runs whatever they do not
+      }
+      work();
+   }
+
+   // merge them in order
+   std::unordered_set<object_key, object_key_hash> written;
+   std::unordered_set<uint16_t>                    written_types;
+
+   auto conflicts = [&](size_t i) {
+      const transaction_context& ctx = *speculative[i];
+      if (failed[i] || ctx.read_own_write())
+         return true;
+      for (const auto& k : ctx.read_set()) {
+         if (k.id == object_key::any_id ? written_types.count(k.type_id) : written.count(k))
+            return true;
+      }
+      for (const auto& k : ctx.write_set()) {
+         if (k.id != object_key::any_id && written.count(k))
+            return true;
+      }
+      return false;
+   };
+
+   auto add_writes = [&](const transaction_context& ctx) {
+      for (const auto& k : ctx.write_set()) {
+         written.insert(k);
+         written_types.insert(k.type_id);
+      }
+   };
+
+   auto reexecute = [&](size_t i) {
+      results[i].reexecuted = true;
+      transaction_context direct(db, false);
+      auto session = db.start_nested_undo_session();
+      try {
+         f(i, direct);
+      } catch (...) {
+         session.undo();
+         results[i].error = std::current_exception();
+         return;
+      }
+      session.squash();
+      add_writes(direct);
+   };
+
+   for (size_t i = 0; i < num_transactions; ++i) {
+      if (conflicts(i)) {
+         reexecute(i);
+         continue;
+      }
+      auto session = db.start_nested_undo_session();
+      try {
+         speculative[i]->apply();
+      } catch (...) {
+         // e.g. a create which violates a unique index given the writes of an earlier transaction
+         session.undo();
+         reexecute(i);
+         continue;
+      }
+      session.squash();
+      add_writes(*speculative[i]);
+   }
+   return results;
+}
+
+}  // namespace chainbase
@@ -2,10 +2,19 @@
 #include <chainbase/environment.hpp>
 #include <chainbase/pagemap_accessor.hpp>
 #include <chainbase/scope_exit.hpp>
+#include <chainbase/compression.hpp>
+#include <chainbase/page_journal.hpp>
+#include <chainbase/undo_index.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 //#include <unistd.h>
+#include <fcntl.h>
 
 #ifdef __linux__
 #include <linux/mman.h>
@@ -13,6 +22,26 @@
 #include <linux/magic.h>
 #include <sys/sysinfo.h>
 #include <sys/resource.h>
+#include <linux/falloc.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/userfaultfd.h>)
+#include <linux/userfaultfd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#if defined(SYS_userfaultfd)
+#define CHAINBASE_HAS_USERFAULTFD
+#endif
+#endif
+
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23         // Linux 5.14, for older kernel headers
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 // use mlock2() on Linux to avoid a noop intercept of mlock() when ASAN is enabled (still present in compiler-rt 18.1)
@@ -25,8 +54,315 @@
 namespace chainbase {
 
 std::vector<pinnable_mapped_file*> pinnable_mapped_file::_instance_tracker;
-pinnable_mapped_file::segment_manager_map_t  pinnable_mapped_file::_segment_manager_map;
-   
+std::array<pinnable_mapped_file::segment_record, pinnable_mapped_file::max_segments> pinnable_mapped_file::_segments;
+std::array<std::atomic<pinnable_mapped_file*>, pinnable_mapped_file::max_segments> pinnable_mapped_file::_segment_files;
+std::atomic<size_t>                pinnable_mapped_file::_segments_in_use;
+std::atomic<uint64_t>              pinnable_mapped_file::_segments_generation;
+
+static std::mutex                  segments_mutex;
+
+// The forks which still share pages with the file of the database they were forked from (see `fork()`)
+struct fork_view {
+   std::filesystem::path file;
+   std::byte*            mapping;
+   size_t                size;
+};
+static std::mutex                  forks_mutex;
+static std::vector<fork_view>      fork_views;
+
+static bool has_forks(const std::filesystem::path& file) {
+   std::lock_guard g(forks_mutex);
+   return std::any_of(fork_views.begin(), fork_views.end(), [&](const fork_view& v) { return v.file == file; });
+}
+
+static constexpr const char* intern_table_name = "$$chainbase_intern_table";
+static constexpr const char* compression_threshold_name = "$$chainbase_compression_threshold";
+
+// Returns the first extent of the file at or after `offset` which may hold data, clamped to `end`, or an empty
+// range at `end` if there is none. Without SEEK_DATA/SEEK_HOLE support the whole remaining range is returned.
+static std::pair<size_t, size_t> next_data_extent(int fd, size_t offset, size_t end) {
+   if (offset >= end)
+      return { end, end };
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+   off_t data = lseek(fd, offset, SEEK_DATA);
+   if (data < 0)
+      return errno == ENXIO ? std::pair<size_t, size_t>{ end, end } : std::pair<size_t, size_t>{ offset, end };
+   if ((size_t)data >= end)
+      return { end, end };
+   off_t hole = lseek(fd, data, SEEK_HOLE);
+   if (hole < 0)
+      return { (size_t)data, end };
+   return { (size_t)data, std::min((size_t)hole, end) };
+#else
+   return { offset, end };
+#endif
+}
+
+// The writer makes the sequence odd before modifying the database and even again once it is done (the usual
+// seqlock), so a reader which saw the same even sequence before and after reading saw no modification.
+static std::atomic_ref<uint64_t> header_sequence(const bip::mapped_region& rgn) {
+   return std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t*>((char*)rgn.get_address() + offsetof(db_header, sequence)));
+}
+
+static std::atomic_ref<int64_t> header_published_revision(const bip::mapped_region& rgn) {
+   return std::atomic_ref<int64_t>(*reinterpret_cast<int64_t*>((char*)rgn.get_address() + offsetof(db_header, published_revision)));
+}
+
+static std::filesystem::path journal_path(const std::filesystem::path& data_file_path) {
+   return data_file_path.parent_path() / "shared_memory.journal";
+}
+
+static std::filesystem::path readers_path(const std::filesystem::path& data_file_path) {
+   return data_file_path.parent_path() / "shared_memory.readers";
+}
+
+// deallocates a range of the file, which then reads as zeros
+static bool punch_hole(int fd, size_t offset, size_t sz) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+   return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, sz) == 0;
+#else
+   return false;
+#endif
+}
+
+// ---------------------------------------------------------------------------------------
+// Populates the anonymous mapping of a `heap_lazy` database from its file on demand.
+//
+// The mapping is registered with userfaultfd, so that the first access to any of its pages
+// blocks until our thread has copied it from the file, along with the rest of its
+// `fault_block_size` block. In between faults, the thread streams the data extents of the
+// file into the mapping. Once they are all loaded, the mapping is unregistered and the
+// pages still missing (the holes of the file) are zero-filled by the kernel as usual.
+//
+// The kernel marks the pages we copy Soft-Dirty, as if they were written. Where it supports
+// write protection, we copy them write-protected instead, and record the pages written
+// during the load as their protection faults come in. The mapping then stays registered
+// once loaded, until `stop` returns the pages written, so that the bits can be cleared and
+// only those pages saved. Otherwise the mapping is unregistered as soon as it is loaded.
+//
+// The mapping is only ever accessed through page faults while the thread runs, so the
+// database can be used (and saved) right away. The process must not fork until the load
+// completes, as the child would see the pages not loaded yet as zeros.
+// ---------------------------------------------------------------------------------------
+class pinnable_mapped_file::lazy_loader {
+public:
+   static constexpr size_t fault_block_size  = 64*1024;
+   static constexpr size_t stream_block_size = 1024*1024;
+
+   // returns nullptr if userfaultfd is not available
+   static std::unique_ptr<lazy_loader> start(const bip::file_mapping& file, void* mapping, size_t size) {
+#ifdef CHAINBASE_HAS_USERFAULTFD
+      std::unique_ptr<lazy_loader> loader(new lazy_loader(mapping, size));
+      if (!loader->init(file))
+         return {};
+      loader->_thread = std::thread([l = loader.get()]() { l->run(); });
+      return loader;
+#else
+      return {};
+#endif
+   }
+
+   // whether the whole file is loaded
+   bool loaded() const { return _loaded.load(std::memory_order_acquire); }
+
+   // returns once the whole file is loaded
+   void wait() {
+      std::unique_lock g(_mutex);
+      _loaded_cv.wait(g, [this]() { return loaded(); });
+   }
+
+   // Stops the thread and unregisters the mapping. Returns whether each page was written since it was loaded, or
+   // an empty vector if writes are not tracked. Must be called by the only thread writing the mapping, once loaded.
+   std::vector<bool> stop() {
+      assert(loaded());
+      shutdown();
+      return std::move(_written);
+   }
+
+   // must not be destroyed before the mapping is unused
+   ~lazy_loader() {
+      shutdown();
+      if (_uffd >= 0)
+         ::close(_uffd);
+      if (_wake_fd >= 0)
+         ::close(_wake_fd);
+      if (_fd >= 0)
+         ::close(_fd);
+   }
+
+private:
+   lazy_loader(void* mapping, size_t size) : _dst((char*)mapping), _size(size) {}
+
+   void shutdown() {
+      _stop = true;
+#ifdef CHAINBASE_HAS_USERFAULTFD
+      if (_wake_fd >= 0) {
+         const uint64_t one = 1;
+         if (::write(_wake_fd, &one, sizeof(one)) != sizeof(one))
+            fail("waking the loading thread");
+      }
+#endif
+      if (_thread.joinable())
+         _thread.join();
+#ifdef CHAINBASE_HAS_USERFAULTFD
+      if (_registered) {
+         uffdio_range range = { .start = (uintptr_t)_dst, .len = _size };
+         if (ioctl(_uffd, UFFDIO_UNREGISTER, &range) != 0)
+            fail("unregistering the database mapping");
+         _registered = false;
+      }
+#endif
+   }
+
+#ifdef CHAINBASE_HAS_USERFAULTFD
+   bool init(const bip::file_mapping& file) {
+      // we only need faults from user space
+      _uffd = open_userfaultfd();
+      if (_uffd < 0)
+         return false;
+
+      uffdio_api api = { .api = UFFD_API, .features = 0 };
+      if (ioctl(_uffd, UFFDIO_API, &api) != 0)
+         return false;
+
+      _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (_wake_fd < 0)
+         return false;
+      _fd = ::dup(file.get_mapping_handle().handle);
+      if (_fd < 0)
+         return false;
+      _src = bip::mapped_region(file, bip::read_only, 0, _size);
+
+      const uffdio_range range = { .start = (uintptr_t)_dst, .len = _size };
+      uffdio_register reg = { .range = range, .mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP };
+      if (ioctl(_uffd, UFFDIO_REGISTER, &reg) == 0 && (reg.ioctls & (1ull << _UFFDIO_WRITEPROTECT))) {
+         _written.assign(_size / page_size(), false);
+      } else {
+         reg = { .range = range, .mode = UFFDIO_REGISTER_MODE_MISSING };
+         if (ioctl(_uffd, UFFDIO_REGISTER, &reg) != 0)
+            return false;
+      }
+      _registered = true;
+      return true;
+   }
+
+   void run() {
+      size_t next = 0;
+      while (!_stop) {
+         if (next == _size) {
+            {
+               std::lock_guard g(_mutex);
+               _loaded.store(true, std::memory_order_release);
+            }
+            _loaded_cv.notify_all();
+            if (_written.empty()) {
+               uffdio_range range = { .start = (uintptr_t)_dst, .len = _size };
+               if (ioctl(_uffd, UFFDIO_UNREGISTER, &range) != 0)
+                  fail("unregistering the database mapping");
+               _registered = false;
+               return;
+            }
+            serve_faults(-1);              // only protection faults are left, until `stop`
+            continue;
+         }
+         serve_faults(0);
+         auto [b, e] = next_data_extent(_fd, next, _size);
+         if (b == e) {
+            next = _size;
+            continue;
+         }
+         const size_t len = std::min(stream_block_size, e - b);
+         copy(b, len);
+         next = b + len;
+      }
+   }
+
+   // serves the pending faults, waiting for them for up to `timeout` milliseconds (forever if -1) or until `shutdown`
+   void serve_faults(int timeout) {
+      uffd_msg msgs[16];
+      for (;;) {
+         pollfd fds[2] = { { .fd = _uffd, .events = POLLIN, .revents = 0 }, { .fd = _wake_fd, .events = POLLIN, .revents = 0 } };
+         int res = ::poll(fds, 2, timeout);
+         if (res < 0 && errno == EINTR)
+            continue;
+         if (res < 0)
+            fail("waiting for page faults");
+         if (!(fds[0].revents & POLLIN))
+            return;
+         ssize_t n = ::read(_uffd, msgs, sizeof(msgs));
+         if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+               continue;
+            fail("reading page faults");
+         }
+         for (size_t i = 0; i < n / sizeof(uffd_msg); ++i) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT)
+               continue;
+            const size_t offset = (size_t)(msgs[i].arg.pagefault.address - (uintptr_t)_dst);
+            const size_t page   = offset / page_size() * page_size();
+            if (msgs[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+               // lifting the protection wakes the thread writing
+               _written[page / page_size()] = true;
+               uffdio_writeprotect wp = { .range = { .start = (uintptr_t)_dst + page, .len = page_size() }, .mode = 0 };
+               if (ioctl(_uffd, UFFDIO_WRITEPROTECT, &wp) != 0)
+                  fail("write-enabling a page");
+               continue;
+            }
+            const size_t block  = offset / fault_block_size * fault_block_size;
+            copy(block, std::min(fault_block_size, _size - block));
+
+            // the faulting page may have been present already, so make sure the thread waiting for it resumes
+            uffdio_range range = { .start = (uintptr_t)_dst + page, .len = page_size() };
+            ioctl(_uffd, UFFDIO_WAKE, &range);
+         }
+         timeout = 0;
+      }
+   }
+
+   // copies the pages of [offset, offset+len) which are not present yet, write-protected if writes are tracked
+   void copy(size_t offset, size_t len) {
+      const uint64_t mode = _written.empty() ? 0 : UFFDIO_COPY_MODE_WP;
+      while (len) {
+         uffdio_copy c = { .dst = (uintptr_t)_dst + offset, .src = (uintptr_t)_src.get_address() + offset, .len = len, .mode = mode, .copy = 0 };
+         if (ioctl(_uffd, UFFDIO_COPY, &c) == 0)
+            return;
+         size_t done = c.copy > 0 ? (size_t)c.copy : 0;
+         if (errno == EEXIST)
+            done += page_size();                  // skip the page which is already there
+         else if (errno != EAGAIN)
+            fail("copying pages");
+         done = std::min(done, len);
+         offset += done;
+         len -= done;
+      }
+   }
+
+   // threads accessing the missing pages would otherwise wait forever, or see zeros instead of their contents
+   [[noreturn]] static void fail(const char* what) {
+      std::cerr << "CHAINBASE: FATAL: lazy loading of database failed while " << what << ": " << strerror(errno) << '\n';
+      std::abort();
+   }
+
+   static size_t page_size() { return pagemap_accessor::page_size(); }
+#else
+   bool init(const bip::file_mapping&) { return false; }
+#endif
+
+   char* const             _dst;
+   const size_t            _size;
+   int                     _uffd = -1;
+   int                     _wake_fd = -1;         // signaled by `shutdown`, which the thread may be waiting for
+   int                     _fd = -1;              // the database file, to find its data extents
+   bip::mapped_region      _src;                  // read-only view of the database file
+   bool                    _registered = false;
+   std::vector<bool>       _written;              // pages written since loaded, if writes are tracked
+   std::atomic<bool>       _stop = false;
+   std::atomic<bool>       _loaded = false;
+   std::mutex              _mutex;
+   std::condition_variable _loaded_cv;
+   std::thread             _thread;
+};
+
 const char* chainbase_error_category::name() const noexcept {
    return "chainbase";
 }
@@ -83,7 +419,8 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
    _database_name(dir.filename().string()),
    _database_size(shared_file_size),
    _writable(writable),
-   _sharable(mode == mapped)
+   _sharable(mode == mapped),
+   _publishing(mode == mapped)
 {
    if(shared_file_size % _db_size_multiple_requirement) {
       std::string what_str("Database must be mulitple of " + std::to_string(_db_size_multiple_requirement) + " bytes");
@@ -100,6 +437,17 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
 
    std::filesystem::create_directories(dir);
 
+   // a journal left by a crash rolls the file forward before we look at it
+   bool file_locked = false;
+   if(_writable && std::filesystem::exists(_data_file_path) && std::filesystem::exists(journal_path(_data_file_path))) {
+      _mapped_file_lock = bip::file_lock(_data_file_path.generic_string().c_str());
+      if(!_mapped_file_lock.try_lock())
+         BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_access)));
+      file_locked = true;
+      replay_journal();
+   }
+
+   bool upgrade_header = false;
    if(std::filesystem::exists(_data_file_path)) {
       char header[header_size];
       std::ifstream hs(_data_file_path.generic_string(), std::ifstream::binary);
@@ -108,7 +456,8 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
          BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_header)));
 
       db_header* dbheader = reinterpret_cast<db_header*>(header);
-      if(dbheader->id != header_id) {
+      upgrade_header = dbheader->id == chainb01_header_id;
+      if(dbheader->id != header_id && !upgrade_header) {
          std::string what_str("\"" + _database_name + "\" database format not compatible with this version of chainbase.");
          BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::incorrect_db_version), what_str));
       }
@@ -128,6 +477,8 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
 
    segment_manager* file_mapped_segment_manager = nullptr;
    if(!std::filesystem::exists(_data_file_path)) {
+      std::error_code ec;
+      std::filesystem::remove(journal_path(_data_file_path), ec);     // it would apply to a previous file
       std::ofstream ofs(_data_file_path.generic_string(), std::ofstream::trunc);
       ofs.close();
       std::filesystem::resize_file(_data_file_path, shared_file_size);
@@ -166,14 +517,32 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
       std::error_code ec;
       std::filesystem::remove(std::filesystem::absolute(dir/"shared_memory.meta"), ec);
 
-      _mapped_file_lock = bip::file_lock(_data_file_path.generic_string().c_str());
-      if(!_mapped_file_lock.try_lock())
-         BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_access)));
+      if(!file_locked) {
+         _mapped_file_lock = bip::file_lock(_data_file_path.generic_string().c_str());
+         if(!_mapped_file_lock.try_lock())
+            BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_access)));
+      }
 
+      // the payloads written from now on cannot be read by `CHAINB01`
+      if(upgrade_header) {
+         db_header* dbheader = reinterpret_cast<db_header*>(_file_mapped_region.get_address());
+         dbheader->id = header_id;
+         dbheader->sequence = 0;
+         dbheader->published_revision = -1;
+      }
       set_mapped_file_db_dirty(true);
+
+      // a writer which crashed while modifying the database leaves readers waiting for a publication
+      if(_sharable) {
+         auto sequence = header_sequence(_file_mapped_region);
+         if(sequence.load(std::memory_order_relaxed) & 1)
+            sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
    }
 
    auto reset_on_ctor_fail = scope_fail([&]() {
+      _write_tracker.reset();
+      _lazy_loader.reset();
       _file_mapped_region = bip::mapped_region();
       if(_non_file_mapped_mapping && _non_file_mapped_mapping != MAP_FAILED)
          munmap(_non_file_mapped_mapping, _non_file_mapped_mapping_size);
@@ -218,9 +587,18 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
          BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::aborted)));
       });
 
-      setup_non_file_mapping();
+      // userfaultfd can't copy single regular pages into a mapping of huge pages
+      setup_non_file_mapping(mode != heap_lazy);
       _file_mapped_region = bip::mapped_region();
-      load_database_file(sig_ios);
+      if(mode == heap_lazy) {
+         _lazy_loader = lazy_loader::start(_file_mapping, _non_file_mapped_mapping, _database_size);
+         if(_lazy_loader)
+            std::cerr << "CHAINBASE: Loading \"" << _database_name << "\" database file on demand" << '\n';
+         else
+            std::cerr << "CHAINBASE: userfaultfd not available, \"" << _database_name << "\" database file will be preloaded" << '\n';
+      }
+      if(!_lazy_loader)
+         load_database_file(sig_ios);
 
 #ifndef _WIN32
       if(mode == locked) {
@@ -247,34 +625,469 @@ pinnable_mapped_file::pinnable_mapped_file(const std::filesystem::path& dir, boo
       }
 #endif
 
+      // our mapping now matches the file, so only the pages modified from now on need to be saved
+      if (_writable)
+         start_dirty_page_tracking();
+
       _segment_manager = reinterpret_cast<segment_manager*>((char*)_non_file_mapped_mapping+header_size);
    }
+   setup_small_size_allocator();
+   _intern_table = _segment_manager->find_no_lock<intern_table_t>(intern_table_name).first;
+   _compression_threshold = _segment_manager->find_no_lock<size_t>(compression_threshold_name).first;
+   if (_sharable)
+      map_reader_registry();
+
+   register_segment();
+}
+
+void pinnable_mapped_file::publish_segment_info(const segment_info& info) {
+   // caller holds `segments_mutex`
+   segment_record& r = _segments[info.slot];
+   const uint64_t version = r.version.load(std::memory_order_relaxed);
+   r.version.store(version + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   r.start.store(info.start, std::memory_order_relaxed);
+   r.end.store(info.end, std::memory_order_relaxed);
+   r.ss_alloc.store(info.ss_alloc, std::memory_order_relaxed);
+   r.intern_table.store(info.intern_table, std::memory_order_relaxed);
+   r.compression_threshold.store(info.compression_threshold, std::memory_order_relaxed);
+   r.version.store(version + 2, std::memory_order_release);
+   _segments_generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void pinnable_mapped_file::register_segment() {
    std::byte* start = (std::byte*)_segment_manager;
-   assert(_segment_manager_map.find(start) == _segment_manager_map.end());
-   _segment_manager_map[start] = start + _segment_manager->get_size();
+   std::lock_guard g(segments_mutex);
+   size_t slot = 0;
+   while (slot < max_segments && _segments[slot].start.load(std::memory_order_relaxed) != nullptr)
+      ++slot;
+   if (slot == max_segments)
+      BOOST_THROW_EXCEPTION(std::runtime_error("too many chainbase databases open in this process"));
+   _segment_files[slot].store(this, std::memory_order_relaxed);
+   publish_segment_info(segment_info{ start, start + _segment_manager->get_size(), _ss_alloc, _intern_table,
+                                      get_compression_threshold(), slot });
+   if (slot >= _segments_in_use.load(std::memory_order_relaxed))
+      _segments_in_use.store(slot + 1, std::memory_order_release);
+   _segment_slot = slot;
+   undo_index_write_hook.store(&begin_write_of, std::memory_order_relaxed);
 }
 
-void pinnable_mapped_file::setup_copy_on_write_mapping() {
-   // before we clear the Soft-Dirty bits for the whole process, make sure all writable,
-   // non-sharable chainbase dbs using mapped mode are flushed to disk
-   // ----------------------------------------------------------------------------------
-   for (auto pmm : _instance_tracker) {
-      // we only populate _instance_tracker if pagemap *is* supported
-      assert(pagemap_accessor::pagemap_supported());
-      pmm->save_database_file(true); 
+void pinnable_mapped_file::begin_write_of(const void* object, bool may_throw) {
+   // only the thread writing the database modifies its indices, so the file of the segment is not moved meanwhile
+   if (const segment_info* info = find_segment(const_cast<void*>(object)))
+      _segment_files[info->slot].load(std::memory_order_relaxed)->begin_write(may_throw);
+}
+
+void pinnable_mapped_file::unregister_segment() {
+   std::lock_guard g(segments_mutex);
+   segment_info info;
+   read_segment(_segment_slot, info);
+   decompression_cache::erase_range(info.start, info.end);
+   publish_segment_info(segment_info{ nullptr, nullptr, nullptr, nullptr, 0, _segment_slot });
+   size_t in_use = _segments_in_use.load(std::memory_order_relaxed);
+   while (in_use > 0 && _segments[in_use - 1].start.load(std::memory_order_relaxed) == nullptr)
+      --in_use;
+   _segments_in_use.store(in_use, std::memory_order_release);
+   _segment_slot = max_segments;
+}
+
+void pinnable_mapped_file::enable_interning(size_t min_size) {
+   if (!_writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot enable interning on a read-only database"));
+   if (_intern_table)
+      return;
+   _intern_table = _segment_manager->construct<intern_table_t>(intern_table_name)(_segment_manager, min_size);
+   std::lock_guard g(segments_mutex);
+   segment_info info;
+   read_segment(_segment_slot, info);
+   info.intern_table = _intern_table;
+   publish_segment_info(info);
+}
+
+void pinnable_mapped_file::set_compression_threshold(size_t min_size) {
+   if (!_writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot change the compression threshold of a read-only database"));
+   if (!_compression_threshold)
+      _compression_threshold = _segment_manager->construct<size_t>(compression_threshold_name)(0);
+   *_compression_threshold = min_size;
+
+   std::lock_guard g(segments_mutex);
+   segment_info info;
+   read_segment(_segment_slot, info);
+   info.compression_threshold = min_size;
+   publish_segment_info(info);
+}
+
+void pinnable_mapped_file::map_reader_registry() {
+   // The readers of a `mapped` database register in a file next to it, which they can write even when they map
+   // the database read-only. Readers which cannot register could not keep the writer from modifying what they
+   // read, so opening the database fails instead.
+   try {
+      const auto path = readers_path(_data_file_path);
+      _reader_owner = std::make_unique<reader_owner>(path);
+      _readers_file_mapping = bip::file_mapping(path.generic_string().c_str(), bip::read_write);
+      _readers_region = bip::mapped_region(_readers_file_mapping, bip::read_write, 0, sizeof(reader_registry));
+      _reader_registry = reinterpret_cast<reader_registry*>(_readers_region.get_address());
+   } catch (const std::exception& e) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("unable to register as a reader of \"" + _database_name + "\": " + e.what()));
    }
+}
+
+void pinnable_mapped_file::enable_concurrent_reads() {
+   if (!_writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot enable concurrent reads of a read-only database"));
+   if (_concurrent_reads)
+      return;
+   _concurrent_reads = std::make_unique<concurrent_reads>();
+   if (!_sharable)
+      _reader_registry = &_concurrent_reads->readers;
+   _publishing = true;
+}
+
+pinnable_mapped_file pinnable_mapped_file::fork() const {
+#ifdef _WIN32
+   BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::unsupported_win32_mode)));
+#else
+   // The segment only holds offsets, so it works at any address.
+   pinnable_mapped_file f;
+   f._database_name = _database_name;
+   f._database_size = _database_size;
+   f._writable      = true;
+   f._fork          = true;
+
+   const auto [src, sz] = get_region_to_save();
+   const size_t pagesz = pagemap_accessor::page_size();
+   f._non_file_mapped_mapping_size = (sz + pagesz - 1) / pagesz * pagesz;
+
+#ifdef __linux__
+   // Only our saves write the file, which then holds our state but for the pages modified since the last save: they
+   // are copied to a private mapping of the file, which shares the other pages with it until they are written. The
+   // first page of the mapping is written to check that `detach_forks` will be able to do so.
+   if (_writable && !_sharable && !_fork) {
+      const int fd = _file_mapping.get_mapping_handle().handle;
+      void* m = mmap(NULL, f._non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+         f._non_file_mapped_mapping = m;
+         std::byte* const dst = (std::byte*)m;
+         if (madvise(m, pagesz, MADV_POPULATE_WRITE) == 0 &&
+             scan_unsaved([&](size_t b, size_t e) { memcpy(dst + b, src + b, e - b); })) {
+            std::lock_guard g(forks_mutex);
+            fork_views.push_back({ _data_file_path, dst, f._non_file_mapped_mapping_size });
+         } else {
+            munmap(m, f._non_file_mapped_mapping_size);
+            f._non_file_mapped_mapping = nullptr;
+         }
+      }
+   }
+#endif
 
+   if (!f._non_file_mapped_mapping) {
+      f._non_file_mapped_mapping = mmap(NULL, f._non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if(f._non_file_mapped_mapping == MAP_FAILED) {
+         f._non_file_mapped_mapping = nullptr;
+         BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Failed to map fork of database ") + _database_name + ": " + strerror(errno)));
+      }
+
+      // our mapping is zero filled, so the pages never written (or freed) don't need to be copied, nor take memory
+      std::byte* const dst = (std::byte*)f._non_file_mapped_mapping;
+      for (size_t i = 0; i < sz; i += pagesz) {
+         const size_t n = std::min(pagesz, sz - i);
+         if (!all_zeros(src + i, n))
+            memcpy(dst + i, src + i, n);
+      }
+   }
+
+   f._segment_manager = reinterpret_cast<segment_manager*>((std::byte*)f._non_file_mapped_mapping + header_size);
+   f.setup_small_size_allocator();
+   f._intern_table = f._segment_manager->find_no_lock<intern_table_t>(intern_table_name).first;
+   f._compression_threshold = f._segment_manager->find_no_lock<size_t>(compression_threshold_name).first;
+   f.register_segment();
+   return f;
+#endif
+}
+
+void pinnable_mapped_file::setup_small_size_allocator() {
+   constexpr const char* ss_alloc_name = "$$chainbase_small_size_allocator";
+   if (_writable) {
+      _ss_alloc = _segment_manager->find_or_construct<small_size_allocator_t>(ss_alloc_name)(_segment_manager);
+   } else {
+      _ss_alloc = _segment_manager->find_no_lock<small_size_allocator_t>(ss_alloc_name).first;
+      if (!_ss_alloc) {
+         // database was never opened read/write by a chainbase with size-class pools. We can't
+         // construct them in a read-only mapping, and we won't allocate from it anyway.
+         _local_ss_alloc = std::make_unique<small_size_allocator_t>(_segment_manager);
+         _ss_alloc = _local_ss_alloc.get();
+      }
+   }
+}
+
+void pinnable_mapped_file::setup_copy_on_write_mapping() {
    _file_mapped_region = bip::mapped_region(_file_mapping, bip::copy_on_write);
    *((char*)_file_mapped_region.get_address()+header_dirty_bit_offset) = dirty; // set dirty bit in our memory mapping
 
    _segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
 
-   // then clear the Soft-Dirty bits
-   // ------------------------------
+   // then track the pages we modify, so that only those are written back
+   // --------------------------------------------------------------------
+   start_dirty_page_tracking();
+}
+
+// The Soft-Dirty bits of the process are about to be cleared for another database: remembers which of our pages are
+// Soft-Dirty, so that our next save still writes them. Only if they can't be scanned are they saved right away.
+void pinnable_mapped_file::keep_dirty_pages_before_clear_refs() {
+   auto [src, sz] = get_region_to_save();
+   const size_t page_size = pagemap_accessor::page_size();
+   if (_journaled_pages.empty())
+      _journaled_pages.assign(sz / page_size, false);
+   bool scanned = pagemap_accessor().scan_dirty({ src, sz }, [&](std::byte* b, std::byte* e) {
+      for (size_t p = (b - src) / page_size; p < (size_t)(e - src + page_size - 1) / page_size; ++p)
+         _journaled_pages[p] = true;
+   });
+   if (scanned)
+      return;
+
+   // the file is about to be modified outside of a checkpoint
+   if (_file_marked_clean) {
+      set_mapped_file_db_dirty(true);
+      _file_marked_clean = false;
+   }
+   save_database_file(true, false);
+}
+
+bool pinnable_mapped_file::is_tracking_dirty_pages() const {
+   return std::find(_instance_tracker.begin(), _instance_tracker.end(), this) != _instance_tracker.end();
+}
+
+// Must be called when our mapping matches the file but for the pages in `_journaled_pages` (right after it was loaded or
+// saved), so that the next save only writes those and the pages modified from now on. Only our own mapping is tracked if the kernel supports it, otherwise the Soft-Dirty bits
+// of the whole process are cleared.
+void pinnable_mapped_file::start_dirty_page_tracking() {
+   if (_write_tracker)
+      return;                      // saves protect the pages they write again
+   _write_tracker = write_protect_tracker::create(get_mapping());
+   if (_write_tracker) {
+      std::erase(_instance_tracker, this);
+      return;
+   }
+
+   // the Soft-Dirty bits of all the tracked instances are about to be cleared: they keep track of their modified
+   // pages themselves until their next save, rather than save them now
+   for (auto pmm : _instance_tracker) {
+      if (pmm != this)
+         pmm->keep_dirty_pages_before_clear_refs();
+   }
+
    pagemap_accessor pagemap;
-   if (pagemap.check_pagemap_support_and_clear_refs()) {
-      _instance_tracker.push_back(this); // so we can save dirty pages before another instance calls `clear_refs()`
+   if (!pagemap.check_pagemap_support_and_clear_refs() || !pagemap.clear_refs() || is_tracking_dirty_pages())
+      return;
+
+   if (_non_file_mapped_mapping) {
+      // Soft-Dirty tracking may not work for all kinds of anonymous mappings (e.g. some kernels don't
+      // support it for huge pages), so check that a write to our own mapping is detected.
+      volatile char* probe = (volatile char*)_non_file_mapped_mapping;
+      uint64_t entry;
+      if (!pagemap.read((uintptr_t)probe, {&entry, 1}) || pagemap_accessor::is_marked_dirty(entry))
+         return;
+      *probe = *probe;
+      if (!pagemap.read((uintptr_t)probe, {&entry, 1}) || !pagemap_accessor::is_marked_dirty(entry)) {
+         std::cerr << "CHAINBASE: Soft-Dirty tracking not supported for \"" << _database_name << "\" database mapping" << '\n';
+         return;
+      }
+   }
+   _instance_tracker.push_back(this);
+}
+
+// Stops the lazy loader once the whole file is loaded (waiting for it if `wait`). The pages written during the load are
+// then saved like the journaled ones, and only the writes from now on are tracked: the pages loaded are not Soft-Dirty
+// anymore. If the loader did not track the writes, the pages loaded remain Soft-Dirty until the next save.
+void pinnable_mapped_file::finish_lazy_load(bool wait) {
+   if (!_lazy_loader)
+      return;
+   if (wait)
+      _lazy_loader->wait();
+   else if (!_lazy_loader->loaded())
+      return;
+   std::vector<bool> written = _lazy_loader->stop();
+   _lazy_loader.reset();
+   if (!_writable || written.empty())
+      return;
+   if (_journaled_pages.empty())
+      _journaled_pages.assign(written.size(), false);
+   for (size_t p = 0; p < written.size(); ++p) {
+      if (written[p])
+         _journaled_pages[p] = true;
+   }
+   start_dirty_page_tracking();
+}
+
+void pinnable_mapped_file::checkpoint() {
+   if (!_writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot checkpoint a read-only database"));
+   if (_fork)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot checkpoint a fork of a database"));
+   if (_sharable) {
+      if (!_file_mapped_region.flush(0, 0, false))
+         std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << '\n';
+      return;
+   }
+   // with all our changes journaled, the file can be rolled forward if we crash while it is partially updated
+   if (_journal && !write_journal_transaction(_journal_revision, true) && _journal)
+      disable_journal();
+   if (_file_marked_clean)
+      set_mapped_file_db_dirty(true);      // in case we crash while the file is partially updated
+   save_database_file(true, false);
+   start_dirty_page_tracking();
+   set_mapped_file_db_dirty(false);
+   _file_marked_clean = true;
+   if (_journal) {
+      // replaying the journal onto the new checkpoint would still be correct, so this only reclaims its space
+      try {
+         _journal->reset();
+      } catch (const std::exception& e) {
+         std::cerr << "CHAINBASE: ERROR: " << e.what() << '\n';
+      }
+   }
+}
+
+void pinnable_mapped_file::enable_journal() {
+   if (!_writable || _sharable)
+      BOOST_THROW_EXCEPTION(std::logic_error("a journal can only be kept for a writable database in heap, locked, heap_lazy or mapped_private mode"));
+   if (_journal)
+      return;
+   // our writes can only be tracked once the mapping is not registered for missing pages anymore
+   finish_lazy_load(true);
+   checkpoint();
+   if (!_write_tracker)
+      BOOST_THROW_EXCEPTION(std::runtime_error("journaling \"" + _database_name + "\" database requires userfaultfd write protection (Linux 6.7+)"));
+   _journaled_pages.assign(_database_size / pagemap_accessor::page_size(), false);
+   _journal = std::make_unique<page_journal>(journal_path(_data_file_path), pagemap_accessor::page_size());
+}
+
+void pinnable_mapped_file::journal_commit(int64_t revision, bool sync) {
+   if (_journal && !write_journal_transaction(revision, sync))
+      checkpoint();                        // so that our changes are durable anyway
+}
+
+uint64_t pinnable_mapped_file::journal_size() const {
+   return _journal ? _journal->size() : 0;
+}
+
+// Appends the pages written since the previous transaction to the journal, which are then not tracked anymore until
+// they are saved. If appending fails, the journal is rolled back to its previous transaction, and the pages are
+// appended again by the next attempt. If the written pages cannot be scanned, the journal is disabled.
+bool pinnable_mapped_file::write_journal_transaction(int64_t revision, bool sync) {
+   auto [src, sz] = get_region_to_save();
+   bool scanned = _write_tracker->scan_written({ src, sz }, [&](std::byte* b, std::byte* e) {
+      _unjournaled_pages.emplace_back(b - src, e - src);
+   });
+   if (!scanned) {
+      std::cerr << "CHAINBASE: ERROR: scanning the pages written to \"" << _database_name << "\" database failed" << '\n';
+      disable_journal();
+      return false;
+   }
+   const size_t page_size = pagemap_accessor::page_size();
+   if (_file_marked_clean && !_unjournaled_pages.empty()) {
+      set_mapped_file_db_dirty(true);      // the journal rolls the file forward only if it is dirty
+      _file_marked_clean = false;
    }
+   try {
+      for (auto [b, e] : _unjournaled_pages) {
+         for (size_t offset = b; offset < e; offset += page_size)
+            _journal->append(offset, src + offset);
+      }
+      _journal->commit(revision);
+      _journal_revision = revision;
+   } catch (const std::exception& e) {
+      std::cerr << "CHAINBASE: ERROR: " << e.what() << '\n';
+      try {
+         _journal->rollback();
+      } catch (const std::exception& e) {
+         std::cerr << "CHAINBASE: ERROR: " << e.what() << '\n';
+         disable_journal();
+      }
+      return false;
+   }
+   for (auto [b, e] : _unjournaled_pages) {
+      for (size_t p = b / page_size; p < e / page_size; ++p)
+         _journaled_pages[p] = true;
+   }
+   _unjournaled_pages.clear();
+   if (sync) {
+      try {
+         _journal->sync();
+      } catch (const std::exception& e) {
+         std::cerr << "CHAINBASE: ERROR: " << e.what() << '\n';
+         return false;
+      }
+   }
+   return true;
+}
+
+// Stops journaling, since the journal can't roll the file forward to our current state. The pages which were
+// not journaled are not tracked anymore either, so they are saved like the journaled ones.
+void pinnable_mapped_file::disable_journal() {
+   const size_t page_size = pagemap_accessor::page_size();
+   for (auto [b, e] : _unjournaled_pages) {
+      for (size_t p = b / page_size; p < e / page_size; ++p)
+         _journaled_pages[p] = true;
+   }
+   _unjournaled_pages.clear();
+   std::cerr << "CHAINBASE: ERROR: journaling of \"" << _database_name << "\" database disabled" << '\n';
+   _journal->remove();
+   _journal.reset();
+}
+
+// Applies the journal left by a crash to the file, which then holds the state of its last complete transaction. The
+// journal of a file which was saved cleanly is older than the file, and is only removed. A dirty file with a journal
+// was last saved by a checkpoint, so it is consistent even when none of the transactions which followed is complete.
+void pinnable_mapped_file::replay_journal() {
+   const std::filesystem::path path = journal_path(_data_file_path);
+   int fd = ::open(_data_file_path.c_str(), O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "opening " + _data_file_path.string()));
+   auto close_fd = scope_exit([&]() { ::close(fd); });
+
+   char dirty = 0;
+   if (::pread(fd, &dirty, 1, header_dirty_bit_offset) != 1)
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "reading " + _data_file_path.string()));
+   if (dirty) {
+      auto res = page_journal::replay(path, fd);
+      if (res) {
+         const char clean = 0;
+         if (::pwrite(fd, &clean, 1, header_dirty_bit_offset) != 1 || ::fsync(fd) != 0)
+            BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "writing " + _data_file_path.string()));
+      }
+      if (res && res->num_transactions) {
+         std::cerr << "CHAINBASE: \"" << _database_name << "\" database rolled forward to revision " << res->revision <<
+                      " from its journal (" << res->num_pages << " pages in " << res->num_transactions << " transactions)" << '\n';
+      }
+   }
+   std::filesystem::remove(path);
+}
+
+void pinnable_mapped_file::flush(size_t max_bytes) {
+   if (!_writable || _fork || _database_size == 0)
+      return;
+   const size_t pending_offset = (_flush_offset + _database_size - _flush_pending_size) % _database_size;
+   const size_t size           = std::min(max_bytes, _database_size - _flush_offset);
+#if defined(__linux__)
+   const int fd = _file_mapping.get_mapping_handle().handle;
+   if (_flush_pending_size &&
+       sync_file_range(fd, pending_offset, _flush_pending_size, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER))
+      std::cerr << "CHAINBASE: ERROR: waiting for writeback failed: " << strerror(errno) << '\n';
+   if (size && sync_file_range(fd, _flush_offset, size, SYNC_FILE_RANGE_WRITE))
+      std::cerr << "CHAINBASE: ERROR: starting writeback failed: " << strerror(errno) << '\n';
+#else
+   // only our shared mapping can be written back without blocking
+   if (_sharable) {
+      if (_flush_pending_size)
+         _file_mapped_region.flush(pending_offset, _flush_pending_size, false);
+      if (size)
+         _file_mapped_region.flush(_flush_offset, size, true);
+   }
+#endif
+   _flush_pending_size = size;
+   _flush_offset = (_flush_offset + size) % _database_size;
 }
 
 // returns the number of pages flushed to disk
@@ -310,7 +1123,7 @@ size_t pinnable_mapped_file::check_memory_and_flush_if_needed() {
    return written_pages;
 }
 
-void pinnable_mapped_file::setup_non_file_mapping() {
+void pinnable_mapped_file::setup_non_file_mapping(bool huge_pages) {
    int common_map_opts = MAP_PRIVATE|MAP_ANONYMOUS;
 
    _non_file_mapped_mapping_size = _file_mapped_region.get_size();
@@ -321,35 +1134,37 @@ void pinnable_mapped_file::setup_non_file_mapping() {
    const unsigned _1gb = 1u<<30u;
    const unsigned _2mb = 1u<<21u;
 
+   if(huge_pages) {
 #if defined(MAP_HUGETLB) && defined(MAP_HUGE_1GB)
-   _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts|MAP_HUGETLB|MAP_HUGE_1GB, -1, 0);
-   if(_non_file_mapped_mapping != MAP_FAILED) {
-      round_up_mmaped_size(_1gb);
-      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 1GB pages" << '\n';
-      return;
-   }
+      _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts|MAP_HUGETLB|MAP_HUGE_1GB, -1, 0);
+      if(_non_file_mapped_mapping != MAP_FAILED) {
+         round_up_mmaped_size(_1gb);
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 1GB pages" << '\n';
+         return;
+      }
 #endif
 
 #if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
-   //in the future as we expand to support other platforms, consider not specifying any size here so we get the default size. However
-   // when mapping the default hugepage size, we'll need to go figure out that size so that the munmap() can be specified correctly
-   _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts|MAP_HUGETLB|MAP_HUGE_2MB, -1, 0);
-   if(_non_file_mapped_mapping != MAP_FAILED) {
-      round_up_mmaped_size(_2mb);
-      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 2MB pages" << '\n';
-      return;
-   }
+      //in the future as we expand to support other platforms, consider not specifying any size here so we get the default size. However
+      // when mapping the default hugepage size, we'll need to go figure out that size so that the munmap() can be specified correctly
+      _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts|MAP_HUGETLB|MAP_HUGE_2MB, -1, 0);
+      if(_non_file_mapped_mapping != MAP_FAILED) {
+         round_up_mmaped_size(_2mb);
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 2MB pages" << '\n';
+         return;
+      }
 #endif
 
 #if defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
-   round_up_mmaped_size(_2mb);
-   _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
-   if(_non_file_mapped_mapping != MAP_FAILED) {
-      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 2MB pages" << '\n';
-      return;
-   }
-   _non_file_mapped_mapping_size = _file_mapped_region.get_size();  //restore to non 2MB rounded size
+      round_up_mmaped_size(_2mb);
+      _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+      if(_non_file_mapped_mapping != MAP_FAILED) {
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using 2MB pages" << '\n';
+         return;
+      }
+      _non_file_mapped_mapping_size = _file_mapped_region.get_size();  //restore to non 2MB rounded size
 #endif
+   }
 
 #ifndef _WIN32
    _non_file_mapped_mapping = mmap(NULL, _non_file_mapped_mapping_size, PROT_READ|PROT_WRITE, common_map_opts, -1, 0);
@@ -361,13 +1176,18 @@ void pinnable_mapped_file::setup_non_file_mapping() {
 void pinnable_mapped_file::load_database_file(boost::asio::io_context& sig_ios) {
    std::cerr << "CHAINBASE: Preloading \"" << _database_name << "\" database file, this could take a moment..." << '\n';
    char* const dst = (char*)_non_file_mapped_mapping;
+   const int fd = _file_mapping.get_mapping_handle().handle;
    size_t offset = 0;
    time_t t = time(nullptr);
+   // our mapping is zero filled, so the holes of the file don't need to be read
    while(offset != _database_size) {
-      size_t copy_size = std::min(_db_size_copy_increment, _database_size - offset);
-      bip::mapped_region src_rgn(_file_mapping, bip::read_only, offset, copy_size);
-      memcpy(dst+offset, src_rgn.get_address(), copy_size);
-      offset += copy_size;
+      auto [data, hole] = next_data_extent(fd, offset, _database_size);
+      if(data == hole)
+         break;
+      size_t copy_size = std::min(_db_size_copy_increment, hole - data);
+      bip::mapped_region src_rgn(_file_mapping, bip::read_only, data, copy_size);
+      memcpy(dst+data, src_rgn.get_address(), copy_size);
+      offset = data + copy_size;
 
       if(time(nullptr) != t) {
          t = time(nullptr);
@@ -379,58 +1199,184 @@ void pinnable_mapped_file::load_database_file(boost::asio::io_context& sig_ios)
    std::cerr << "CHAINBASE: Preloading \"" << _database_name << "\" database file, complete." << '\n';
 }
 
+// scans 64 bytes per iteration, the accumulated bits are tested once per block
 bool pinnable_mapped_file::all_zeros(const std::byte* data, size_t sz) {
-   uint64_t* p = (uint64_t*)data;
-   uint64_t* end = p+sz/sizeof(uint64_t);
-   while(p != end) {
-      if(*p++ != 0)
+   const std::byte* p   = data;
+   const std::byte* end = data + sz;
+#if defined(__SSE2__)
+   for (; end - p >= 64; p += 64) {
+      __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)p),        _mm_loadu_si128((const __m128i*)(p + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 32)), _mm_loadu_si128((const __m128i*)(p + 48))));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+         return false;
+   }
+#else
+   for (; end - p >= 64; p += 64) {
+      uint64_t w[8];
+      memcpy(w, p, sizeof(w));
+      if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+         return false;
+   }
+#endif
+   for (; p != end; ++p) {
+      if (*p != std::byte{0})
          return false;
    }
    return true;
 }
 
+// Writes `sz` bytes from `src` at `offset` in the database file. Runs of zero pages are not copied: the ranges of
+// the file they cover are deallocated instead (or cleared if the filesystem can't punch holes), and skipped
+// altogether when they already are holes. So the file only takes space for the live data of the database.
+void pinnable_mapped_file::write_region_to_file(const std::byte* src, size_t sz, size_t offset, bool flush) {
+   const int    fd     = _file_mapping.get_mapping_handle().handle;
+   const size_t pagesz = pagemap_accessor::page_size();
+   bip::mapped_region dst_rgn;      // only mapped if something needs to be written
+   bool punched = false;
+
+   auto dst = [&]() {
+      if (!dst_rgn.get_address())
+         dst_rgn = bip::mapped_region(_file_mapping, bip::read_write, offset, sz);
+      return (std::byte*)dst_rgn.get_address();
+   };
+   auto is_zero_page = [&](size_t i) { return all_zeros(src + i, std::min(pagesz, sz - i)); };
+
+   for (size_t i = 0; i != sz; ) {
+      const bool zero = is_zero_page(i);
+      size_t j = std::min(i + pagesz, sz);
+      while (j != sz && is_zero_page(j) == zero)
+         j = std::min(j + pagesz, sz);
+
+      if (!zero) {
+         memcpy(dst() + i, src + i, j - i);
+      } else {
+         for (auto [b, e] = next_data_extent(fd, offset + i, offset + j); b != e; std::tie(b, e) = next_data_extent(fd, e, offset + j)) {
+            if (e - b >= _db_min_hole_size && punch_hole(fd, b, e - b))
+               punched = true;
+            else
+               memset(dst() + (b - offset), 0, e - b);
+         }
+      }
+      i = j;
+   }
+
+   if (flush) {
+      if (dst_rgn.get_address() && !dst_rgn.flush(0, 0, false))
+         std::cerr << "CHAINBASE: ERROR: flushing buffers failed" << '\n';
+      if (punched && ::fsync(fd) != 0)
+         std::cerr << "CHAINBASE: ERROR: syncing database file failed: " << strerror(errno) << '\n';
+   }
+}
+
+std::span<std::byte> pinnable_mapped_file::get_mapping() const {
+   if (_non_file_mapped_mapping)
+      return { (std::byte*)_non_file_mapped_mapping, _non_file_mapped_mapping_size };
+   return { (std::byte*)_file_mapped_region.get_address(), _file_mapped_region.get_size() };
+}
+
 std::pair<std::byte*, size_t> pinnable_mapped_file::get_region_to_save() const {
    if (_non_file_mapped_mapping)
       return { (std::byte*)_non_file_mapped_mapping, _database_size };
    return { (std::byte*)_file_mapped_region.get_address(), _database_size };
 }
 
-void pinnable_mapped_file::save_database_file(bool flush /* = true */) {
+void pinnable_mapped_file::save_database_file(bool flush /* = true */, bool verbose /* = true */) {
    assert(_writable);
-   std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << '\n';
+   if (verbose)
+      std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << '\n';
    size_t offset = 0;
    time_t t = time(nullptr);
    pagemap_accessor pagemap;
    size_t written_pages {0};
+   finish_lazy_load(false);
    auto [src, sz] = get_region_to_save();
+   const bool soft_dirty_tracked = is_tracking_dirty_pages();
+   if (has_forks(_data_file_path) && !scan_unsaved([&](size_t b, size_t e) { detach_forks(b, e - b); }))
+      detach_forks(0, sz);
    
+   if (!_write_tracker && !soft_dirty_tracked && !_untracked_save_logged) {
+      std::cerr << "CHAINBASE: The pages modified in \"" << _database_name << "\" database are not tracked, "
+                   "each save writes the whole database" << '\n';
+      _untracked_save_logged = true;
+   }
+
    while(offset != sz) {
       size_t copy_size = std::min(_db_size_copy_increment,  sz - offset);
-      bool mapped_writable_instance = std::find(_instance_tracker.begin(), _instance_tracker.end(), this) != _instance_tracker.end();
-      if (!mapped_writable_instance ||
-          !pagemap.update_file_from_region({ src + offset, copy_size }, _file_mapping, offset, flush, written_pages)) {
-         if (mapped_writable_instance)
+      bool updated = false;
+      if (_write_tracker)
+         updated = _write_tracker->update_file_from_region({ src + offset, copy_size }, _file_mapping, offset, flush, written_pages);
+      else if (soft_dirty_tracked)
+         updated = pagemap.update_file_from_region({ src + offset, copy_size }, _file_mapping, offset, flush, written_pages);
+      if (!updated) {
+         if (_write_tracker || soft_dirty_tracked)
             std::cerr << "CHAINBASE: ERROR: pagemap update of db file failed... using non-pagemap version" << '\n';
-         if(!all_zeros(src+offset, copy_size)) {
-            bip::mapped_region dst_rgn(_file_mapping, bip::read_write, offset, copy_size);
-            char *dst = (char *)dst_rgn.get_address();
-            memcpy(dst, src+offset, copy_size);
-
-            if (flush) {
-               if(dst_rgn.flush(0, 0, false) == false)
-                  std::cerr << "CHAINBASE: ERROR: flushing buffers failed" << '\n';
-            }
-         }
+         write_region_to_file(src+offset, copy_size, offset, flush);
+      } else if (!_journaled_pages.empty()) {
+         write_journaled_pages(src+offset, copy_size, offset, flush);
       }
       offset += copy_size;
 
-      if(time(nullptr) != t) {
+      if(verbose && time(nullptr) != t) {
          t = time(nullptr);
          std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, " <<
             offset/(sz/100) << "% complete..." << '\n';
       }
    }
-   std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, complete." << '\n';
+   std::fill(_journaled_pages.begin(), _journaled_pages.end(), false);
+   if (verbose)
+      std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, complete." << '\n';
+}
+
+// writes the pages of the region which were journaled since the last save, as they are not reported as written anymore
+void pinnable_mapped_file::write_journaled_pages(const std::byte* src, size_t sz, size_t offset, bool flush) {
+   const size_t page_size = pagemap_accessor::page_size();
+   std::optional<bip::mapped_region> dst;
+   for (size_t p = offset / page_size; p < (offset + sz) / page_size; ++p) {
+      if (!_journaled_pages[p])
+         continue;
+      if (!dst)
+         dst.emplace(_file_mapping, bip::read_write, offset, sz);
+      memcpy((std::byte*)dst->get_address() + p * page_size - offset, src + p * page_size - offset, page_size);
+   }
+   if (dst && flush && !dst->flush(0, sz, /* async = */ false))
+      std::cerr << "CHAINBASE: ERROR: flushing buffers failed" << '\n';
+}
+
+// Calls `f(begin, end)` with the offsets of ranges covering the pages of the segment which may differ from the database
+// file, or returns false if they are not tracked.
+bool pinnable_mapped_file::scan_unsaved(const std::function<void(size_t, size_t)>& f) const {
+   auto [src, sz] = get_region_to_save();
+   auto report = [&](std::byte* b, std::byte* e) { f(b - src, e - src); };
+   bool scanned = false;
+   if (_write_tracker)
+      scanned = _write_tracker->scan_written({ src, sz }, report, /* protect = */ false);
+   else if (is_tracking_dirty_pages())
+      scanned = pagemap_accessor().scan_dirty({ src, sz }, report);
+   if (!scanned)
+      return false;
+
+   const size_t page_size = pagemap_accessor::page_size();
+   for (size_t p = 0; p < _journaled_pages.size(); ++p) {
+      if (_journaled_pages[p])
+         f(p * page_size, (p + 1) * page_size);
+   }
+   for (auto [b, e] : _unjournaled_pages)
+      f(b, e);
+   return true;
+}
+
+// Gives the forks which share the pages of our file from `offset` their own copy of the `size` bytes we are about to
+// write there, which they would see otherwise.
+void pinnable_mapped_file::detach_forks(size_t offset, size_t size) const {
+#ifdef __linux__
+   std::lock_guard g(forks_mutex);
+   for (const fork_view& v : fork_views) {
+      if (v.file != _data_file_path || offset >= v.size)
+         continue;
+      if (madvise(v.mapping + offset, std::min(size, v.size - offset), MADV_POPULATE_WRITE) != 0)
+         std::cerr << "CHAINBASE: ERROR: copying the pages of a fork of \"" << _database_name << "\" database failed: " << strerror(errno) << '\n';
+   }
+#endif
 }
 
 pinnable_mapped_file::pinnable_mapped_file(pinnable_mapped_file&& o) noexcept
@@ -446,19 +1392,70 @@ pinnable_mapped_file& pinnable_mapped_file::operator=(pinnable_mapped_file&& o)
    std::swap(_database_size, o._database_size);
    std::swap(_writable, o._writable);
    std::swap(_sharable, o._sharable);
+   std::swap(_file_marked_clean, o._file_marked_clean);
+   std::swap(_untracked_save_logged, o._untracked_save_logged);
+   std::swap(_fork, o._fork);
+   std::swap(_flush_offset, o._flush_offset);
+   std::swap(_flush_pending_size, o._flush_pending_size);
    std::swap(_file_mapping, o._file_mapping);
    std::swap(_file_mapped_region, o._file_mapped_region);
    std::swap(_non_file_mapped_mapping, o._non_file_mapped_mapping);
    std::swap(_non_file_mapped_mapping_size, o._non_file_mapped_mapping_size);
+   std::swap(_lazy_loader, o._lazy_loader);
+   std::swap(_write_tracker, o._write_tracker);
+   std::swap(_journal, o._journal);
+   std::swap(_journaled_pages, o._journaled_pages);
+   std::swap(_unjournaled_pages, o._unjournaled_pages);
+   std::swap(_journal_revision, o._journal_revision);
+   std::swap(_writing, o._writing);
+   std::swap(_publishing, o._publishing);
+   std::swap(_concurrent_reads, o._concurrent_reads);
+   std::swap(_reader_registry, o._reader_registry);
+   std::swap(_reader_owner, o._reader_owner);
+   std::swap(_reader_timeout, o._reader_timeout);
+   std::swap(_readers_file_mapping, o._readers_file_mapping);
+   std::swap(_readers_region, o._readers_region);
    std::swap(_db_permissions, o._db_permissions);
    std::swap(_segment_manager, o._segment_manager);
+   std::swap(_ss_alloc, o._ss_alloc);
+   std::swap(_local_ss_alloc, o._local_ss_alloc);
+   std::swap(_intern_table, o._intern_table);
+   std::swap(_compression_threshold, o._compression_threshold);
+   std::swap(_segment_slot, o._segment_slot);
+   if (_segment_slot != max_segments)
+      _segment_files[_segment_slot].store(this, std::memory_order_relaxed);
+   if (o._segment_slot != max_segments)
+      _segment_files[o._segment_slot].store(&o, std::memory_order_relaxed);
    return *this;
 }
 
 pinnable_mapped_file::~pinnable_mapped_file() {
-   if(_writable) {
+   if(_fork) {
+#ifndef _WIN32
+      {
+         std::lock_guard g(forks_mutex);
+         std::erase_if(fork_views, [&](const fork_view& v) { return v.mapping == _non_file_mapped_mapping; });
+      }
+      if(_non_file_mapped_mapping && munmap(_non_file_mapped_mapping, _non_file_mapped_mapping_size))
+         std::cerr << "CHAINBASE: ERROR: unmapping failed: " << strerror(errno) << '\n';
+#endif
+   }
+   else if(_writable) {
+      // once closed, the file may be written by anyone
+      if (has_forks(_data_file_path)) {
+         detach_forks(0, _database_size);
+         std::lock_guard g(forks_mutex);
+         std::erase_if(fork_views, [&](const fork_view& v) { return v.file == _data_file_path; });
+      }
+      if (_journal && !write_journal_transaction(_journal_revision, true) && _journal)
+         disable_journal();
       if(_non_file_mapped_mapping) { //in heap or locked mode
+         if (_file_marked_clean)
+            set_mapped_file_db_dirty(true);
          save_database_file();
+         std::erase(_instance_tracker, this);
+         _write_tracker.reset();
+         _lazy_loader.reset();
 #ifndef _WIN32
          if(munmap(_non_file_mapped_mapping, _non_file_mapped_mapping_size))
             std::cerr << "CHAINBASE: ERROR: unmapping failed: " << strerror(errno) << '\n';
@@ -468,28 +1465,124 @@ pinnable_mapped_file::~pinnable_mapped_file() {
             if(_file_mapped_region.flush(0, 0, false) == false)
                std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << '\n';
          } else {
+            if (_file_marked_clean)
+               set_mapped_file_db_dirty(true);
             save_database_file(); // must be before `this` is removed from _instance_tracker
             if (auto it = std::find(_instance_tracker.begin(), _instance_tracker.end(), this); it != _instance_tracker.end())
                _instance_tracker.erase(it);
+            _write_tracker.reset();
             _file_mapped_region = bip::mapped_region();
             set_mapped_file_db_dirty(false);
          }
       }
       set_mapped_file_db_dirty(false);
+      if (_journal)
+         _journal->remove();               // the file is clean and up to date
    }
-   if (_segment_manager)
-      _segment_manager_map.erase(_segment_manager);
+   if (_segment_slot != max_segments)
+      unregister_segment();
 }
 
 void pinnable_mapped_file::set_mapped_file_db_dirty(bool dirty) {
    assert(_writable);
+   detach_forks(0, header_size);
+   if (!_sharable && _segment_manager && (char*)_file_mapped_region.get_address() + header_size == (char*)_segment_manager) {
+      // in `mapped_private` mode, `_file_mapped_region` is our copy_on_write view of the file
+      bip::mapped_region header_rgn(_file_mapping, bip::read_write, 0, header_size);
+      *((char*)header_rgn.get_address()+header_dirty_bit_offset) = dirty;
+      if (header_rgn.flush(0, header_size, false) == false)
+         std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << '\n';
+      return;
+   }
    if (_file_mapped_region.get_address() == nullptr)
       _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write, 0, _db_size_multiple_requirement);
    *((char*)_file_mapped_region.get_address()+header_dirty_bit_offset) = dirty;
-   if (_file_mapped_region.flush(0, 0, false) == false)
+   if (_file_mapped_region.flush(0, header_size, false) == false)      // only the header page, not the whole database
       std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << '\n';
 }
 
+std::atomic_ref<uint64_t> pinnable_mapped_file::sequence_word() const {
+   if (!_sharable)
+      return std::atomic_ref<uint64_t>(_concurrent_reads->sequence);
+   return header_sequence(_file_mapped_region);
+}
+
+std::atomic_ref<int64_t> pinnable_mapped_file::published_revision_word() const {
+   if (!_sharable)
+      return std::atomic_ref<int64_t>(_concurrent_reads->published_revision);
+   return header_published_revision(_file_mapped_region);
+}
+
+void pinnable_mapped_file::start_write(bool may_throw) {
+   if (_reader_registry && _reader_registry->pinned_by_this_thread()) {
+      if (may_throw)
+         BOOST_THROW_EXCEPTION(std::logic_error("cannot write a database read by a read_guard of the same thread"));
+      // waiting for the read of this thread would last until the timeout
+      if (size_t evicted = _reader_registry->evict_this_thread())
+         std::cerr << "CHAINBASE: evicted " << evicted << " reader(s) of \"" << _database_name
+                   << "\" held by the thread writing it" << '\n';
+   }
+   auto sequence = sequence_word();
+   // readers pin their slot before checking the sequence, so either they see it odd, or we see their slot
+   sequence.store(sequence.load(std::memory_order_relaxed) | 1, std::memory_order_seq_cst);
+   if (_reader_registry) {
+      if (size_t evicted = _reader_registry->wait_for_readers(_reader_timeout, _reader_owner.get()))
+         std::cerr << "CHAINBASE: evicted " << evicted << " reader(s) of \"" << _database_name
+                   << "\" still reading after " << _reader_timeout.count() << " us" << '\n';
+   }
+   _writing = true;
+}
+
+void pinnable_mapped_file::publish(int64_t revision) {
+   if (!_writable || !_publishing)
+      return;
+   begin_write();
+   published_revision_word().store(revision, std::memory_order_relaxed);
+   auto sequence = sequence_word();
+   sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   _writing = false;
+}
+
+std::pair<uint64_t, int64_t> pinnable_mapped_file::begin_read(reader_registry::pinned_slot& slot) const {
+   slot = {};
+   if (!_publishing)
+      return { 0, -1 };
+   auto sequence = sequence_word();
+   for (unsigned spins = 0;; ++spins) {
+      if (_reader_registry)
+         slot = _reader_registry->pin(_reader_owner ? _reader_owner->id() : 0);
+      uint64_t seq = sequence.load(std::memory_order_seq_cst);
+      if (!(seq & 1)) {
+         int64_t revision = published_revision_word().load(std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_acquire);
+         if (sequence.load(std::memory_order_relaxed) == seq)
+            return { seq, revision };
+      }
+      // the writer is modifying the database, and waits for the slot
+      end_read(slot);
+      slot = {};
+      if (spins < 64)
+         continue;
+      std::this_thread::sleep_for(std::chrono::microseconds(spins < 1024 ? 0 : 100));
+   }
+}
+
+void pinnable_mapped_file::end_read(const reader_registry::pinned_slot& slot) const {
+   if (slot.index != reader_registry::no_slot)
+      _reader_registry->unpin(slot);
+}
+
+bool pinnable_mapped_file::still_pinned(const reader_registry::pinned_slot& slot) const {
+   return slot.index != reader_registry::no_slot && _reader_registry->still_pinned(slot);
+}
+
+bool pinnable_mapped_file::still_published(uint64_t seq) const {
+   if (!_publishing)
+      return true;
+   std::atomic_thread_fence(std::memory_order_acquire);
+   return sequence_word().load(std::memory_order_relaxed) == seq;
+}
+
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime) {
    std::string s;
    in >> s;
@@ -501,6 +1594,8 @@ std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runti
       runtime = pinnable_mapped_file::map_mode::heap;
    else if (s == "locked")
       runtime = pinnable_mapped_file::map_mode::locked;
+   else if (s == "heap_lazy")
+      runtime = pinnable_mapped_file::map_mode::heap_lazy;
    else
       in.setstate(std::ios_base::failbit);
    return in;
@@ -515,6 +1610,8 @@ std::ostream& operator<<(std::ostream& osm, pinnable_mapped_file::map_mode m) {
       osm << "heap";
    else if (m == pinnable_mapped_file::map_mode::locked)
       osm << "locked";
+   else if (m == pinnable_mapped_file::map_mode::heap_lazy)
+      osm << "heap_lazy";
 
    return osm;
 }
@@ -0,0 +1,192 @@
+#include <chainbase/reader_registry.hpp>
+
+#include <boost/throw_exception.hpp>
+
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace chainbase {
+
+// slots pinned by the calling thread, so that writers which are not reading never scan the registry
+static thread_local size_t pins_of_this_thread = 0;
+
+static uint64_t current_pid() {
+#ifndef _WIN32
+   return static_cast<uint64_t>(getpid());
+#else
+   return 0;
+#endif
+}
+
+static uint64_t current_thread() {
+   static thread_local char tag;
+   return reinterpret_cast<uintptr_t>(&tag);
+}
+
+reader_registry::pinned_slot reader_registry::pin(uint64_t owner) noexcept {
+   // the slot this thread used last, so that concurrent readers rarely contend for the same slots
+   static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id()) % max_readers;
+   for (;;) {
+      for (size_t i = 0; i < max_readers; ++i) {
+         const size_t s = (hint + i) % max_readers;
+         uint64_t ticket = slots[s].ticket.load(std::memory_order_relaxed);
+         if ((ticket & 1) || !slots[s].ticket.compare_exchange_strong(ticket, ticket + 1, std::memory_order_seq_cst))
+            continue;
+         slots[s].owner.store(owner, std::memory_order_relaxed);
+         slots[s].pid.store(current_pid(), std::memory_order_relaxed);
+         slots[s].thread.store(current_thread(), std::memory_order_relaxed);
+         hint = s;
+         ++pins_of_this_thread;
+         return { s, ticket + 1 };
+      }
+      std::this_thread::yield();
+   }
+}
+
+void reader_registry::unpin(const pinned_slot& p) noexcept {
+   --pins_of_this_thread;
+   slot& s = slots[p.index];
+   uint64_t ticket = p.ticket;
+   if (s.ticket.load(std::memory_order_relaxed) != ticket)
+      return;                                                      // evicted, and maybe pinned by another reader
+   s.thread.store(0, std::memory_order_relaxed);
+   s.ticket.compare_exchange_strong(ticket, ticket + 1, std::memory_order_release);
+}
+
+bool reader_registry::pinned_by_this_thread() const noexcept {
+   if (pins_of_this_thread == 0)
+      return false;
+   for (const auto& s : slots) {
+      if ((s.ticket.load(std::memory_order_relaxed) & 1) && s.pid.load(std::memory_order_relaxed) == current_pid() &&
+          s.thread.load(std::memory_order_relaxed) == current_thread())
+         return true;
+   }
+   return false;
+}
+
+size_t reader_registry::evict_this_thread() noexcept {
+   if (pins_of_this_thread == 0)
+      return 0;
+   size_t evicted = 0;
+   for (auto& s : slots) {
+      uint64_t ticket = s.ticket.load(std::memory_order_relaxed);
+      if ((ticket & 1) && s.pid.load(std::memory_order_relaxed) == current_pid() &&
+          s.thread.load(std::memory_order_relaxed) == current_thread())
+         evicted += s.ticket.compare_exchange_strong(ticket, ticket + 1, std::memory_order_seq_cst);
+   }
+   return evicted;
+}
+
+size_t reader_registry::wait_for_readers(std::chrono::microseconds timeout, const reader_owner* owners) noexcept {
+   const auto deadline = std::chrono::steady_clock::now() + timeout;
+   size_t evicted = 0;
+   for (auto& s : slots) {
+      for (unsigned spins = 0;; ++spins) {
+         uint64_t ticket = s.ticket.load(std::memory_order_seq_cst);
+         if (!(ticket & 1))
+            break;
+         if (spins < 64)
+            continue;
+         const bool died = owners && owners->died(s.owner.load(std::memory_order_relaxed));
+         if (died || std::chrono::steady_clock::now() >= deadline) {
+            if (s.ticket.compare_exchange_strong(ticket, ticket + 1, std::memory_order_seq_cst))
+               evicted += !died;
+            continue;
+         }
+         std::this_thread::sleep_for(std::chrono::microseconds(spins < 1024 ? 0 : 100));
+      }
+   }
+   return evicted;
+}
+
+#ifndef _WIN32
+
+reader_owner::reader_owner(const std::filesystem::path& path) {
+   _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (_fd < 0)
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "unable to open " + path.string()));
+   try {
+      // a new file is all zeros, which is a valid registry with no reader; size it once, under a lock, so that
+      // processes opening it concurrently never see it partially sized
+      if (flock(_fd, LOCK_EX) != 0)
+         BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "unable to lock " + path.string()));
+      struct stat st;
+      int res = fstat(_fd, &st);
+      if (res == 0 && st.st_size < (off_t)sizeof(reader_registry))
+         res = ftruncate(_fd, sizeof(reader_registry));
+      const int err = errno;
+      flock(_fd, LOCK_UN);
+      if (res != 0)
+         BOOST_THROW_EXCEPTION(std::system_error(err, std::generic_category(), "unable to size " + path.string()));
+
+#ifdef F_OFD_SETLK
+      for (uint64_t id = 1; id <= max_owners; ++id) {
+         struct flock lock = {};
+         lock.l_type   = F_WRLCK;
+         lock.l_whence = SEEK_SET;
+         lock.l_start  = sizeof(reader_registry) + id;
+         lock.l_len    = 1;
+         if (fcntl(_fd, F_OFD_SETLK, &lock) == 0) {
+            _id = id;
+            return;
+         }
+         if (errno != EAGAIN && errno != EACCES)
+            BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "unable to lock " + path.string()));
+      }
+      BOOST_THROW_EXCEPTION(std::runtime_error("too many processes reading " + path.string()));
+#endif
+   } catch (...) {
+      ::close(_fd);
+      throw;
+   }
+}
+
+reader_owner::~reader_owner() {
+   ::close(_fd);
+}
+
+bool reader_owner::died(uint64_t owner) const noexcept {
+#ifdef F_OFD_GETLK
+   if (owner == 0 || owner == _id || owner > max_owners)
+      return false;
+   struct flock lock = {};
+   lock.l_type   = F_WRLCK;
+   lock.l_whence = SEEK_SET;
+   lock.l_start  = sizeof(reader_registry) + owner;
+   lock.l_len    = 1;
+   return fcntl(_fd, F_OFD_GETLK, &lock) == 0 && lock.l_type == F_UNLCK;
+#else
+   return false;
+#endif
+}
+
+#else
+
+reader_owner::reader_owner(const std::filesystem::path& path) {
+   if (!std::filesystem::exists(path) || std::filesystem::file_size(path) < sizeof(reader_registry)) {
+      std::ofstream(path, std::ios::binary | std::ios::app);
+      std::filesystem::resize_file(path, sizeof(reader_registry));
+   }
+}
+
+reader_owner::~reader_owner() = default;
+
+bool reader_owner::died(uint64_t) const noexcept {
+   return false;
+}
+
+#endif
+
+}  // namespace chainbase
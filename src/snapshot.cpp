@@ -0,0 +1,414 @@
+#include <chainbase/chainbase.hpp>
+#include <chainbase/scope_exit.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <optional>
+
+namespace chainbase {
+
+// ---------------------------------------------------------------------------------------
+// Snapshot stream format (all integers little-endian):
+//
+//    header:  magic, version, revision, number of sections, and for each section (index)
+//             the type id and type name of its objects, followed by a checksum of the header
+//    chunks:  section, number of rows, payload size, checksum of the chunk, payload
+//
+// The payload of a chunk is a sequence of rows, each made of the object id, the row size
+// and the row written by the `snapshot_serializer`. The last chunk of a section has
+// `end_of_section` rows and holds the next id of the index and its number of rows. The
+// chunks of different sections are interleaved, the stream ends with an `end_of_stream`
+// chunk.
+// ---------------------------------------------------------------------------------------
+namespace {
+   constexpr char     snapshot_magic[8] = { 'C', 'B', 'S', 'N', 'A', 'P', '0', '1' };
+   constexpr uint32_t snapshot_version  = 1;
+   constexpr uint32_t end_of_section    = ~0u;
+   constexpr uint32_t end_of_stream     = ~0u;
+   constexpr size_t   chunk_header_size = 3 * sizeof(uint32_t) + sizeof(uint64_t);
+   constexpr size_t   max_payload_size  = 1024*1024*1024;
+
+   struct chunk {
+      uint32_t          section;
+      uint32_t          num_rows;
+      std::vector<char> payload;
+      uint64_t          checksum = 0;
+   };
+
+   // same result on any platform
+   uint64_t checksum(uint64_t h, const char* data, size_t sz) {
+      constexpr uint64_t m = 0x9e3779b97f4a7c15ULL;
+      for (; sz >= 8; sz -= 8, data += 8) {
+         uint64_t k = 0;
+         for (size_t i = 8; i-- > 0;)
+            k = (k << 8) | (uint8_t)data[i];
+         h = (h ^ k) * m;
+         h ^= h >> 29;
+      }
+      for (; sz; --sz, ++data)
+         h = ((h ^ (uint8_t)*data) * m) ^ (h >> 29);
+      return h;
+   }
+
+   uint64_t chunk_checksum(const chunk& c) {
+      return checksum((uint64_t(c.section) << 32) | c.num_rows, c.payload.data(), c.payload.size());
+   }
+
+   void write_chunk(std::ostream& out, const chunk& c) {
+      std::vector<char> header;
+      snapshot_row_writer w(header);
+      w.write(c.section);
+      w.write(c.num_rows);
+      w.write((uint32_t)c.payload.size());
+      w.write(chunk_checksum(c));
+      out.write(header.data(), header.size());
+      out.write(c.payload.data(), c.payload.size());
+   }
+
+   void read_exactly(std::istream& in, char* data, size_t sz) {
+      if (!in.read(data, sz))
+         BOOST_THROW_EXCEPTION(std::runtime_error("truncated chainbase snapshot"));
+   }
+
+   [[noreturn]] void throw_corrupted() {
+      BOOST_THROW_EXCEPTION(std::runtime_error("corrupted chainbase snapshot"));
+   }
+
+   unsigned worker_count(unsigned num_threads, size_t num_sections) {
+      return (unsigned)std::max<size_t>(1, std::min<size_t>(num_threads, num_sections));
+   }
+
+   template<typename T>
+   class bounded_queue {
+    public:
+      explicit bounded_queue(size_t capacity) : _capacity(capacity) {}
+
+      // returns false if the queue was aborted
+      bool push(T&& v) {
+         std::unique_lock g(_mutex);
+         _not_full.wait(g, [&]() { return _aborted || _items.size() < _capacity; });
+         if (_aborted)
+            return false;
+         _items.push_back(std::move(v));
+         _not_empty.notify_one();
+         return true;
+      }
+
+      // returns nothing once the queue is closed and empty, or aborted
+      std::optional<T> pop() {
+         std::unique_lock g(_mutex);
+         _not_empty.wait(g, [&]() { return _aborted || _closed || !_items.empty(); });
+         if (_aborted || _items.empty())
+            return {};
+         std::optional<T> v(std::move(_items.front()));
+         _items.pop_front();
+         _not_full.notify_one();
+         return v;
+      }
+
+      void close() {
+         std::lock_guard g(_mutex);
+         _closed = true;
+         _not_empty.notify_all();
+      }
+
+      void abort() {
+         std::lock_guard g(_mutex);
+         _aborted = true;
+         _not_empty.notify_all();
+         _not_full.notify_all();
+      }
+
+    private:
+      const size_t            _capacity;
+      std::mutex              _mutex;
+      std::condition_variable _not_empty;
+      std::condition_variable _not_full;
+      std::deque<T>           _items;
+      bool                    _closed  = false;
+      bool                    _aborted = false;
+   };
+
+   // keeps the first exception thrown by any thread
+   class first_error {
+    public:
+      void set(std::exception_ptr e) {
+         std::lock_guard g(_mutex);
+         if (!_error)
+            _error = e;
+      }
+      void rethrow() {
+         if (_error)
+            std::rethrow_exception(_error);
+      }
+    private:
+      std::mutex         _mutex;
+      std::exception_ptr _error;
+   };
+}
+
+snapshot_row_writer snapshot_section_writer::begin_row(int64_t id) {
+   snapshot_row_writer w(_rows);
+   w.write(id);
+   w.write(uint32_t(0));                     // size, set by `end_row`
+   _row_start = _rows.size();
+   return w;
+}
+
+void snapshot_section_writer::end_row() {
+   const size_t size = _rows.size() - _row_start;
+   if (size > max_payload_size)
+      BOOST_THROW_EXCEPTION(std::runtime_error("row too large for a chainbase snapshot"));
+   for (size_t i = 0; i < sizeof(uint32_t); ++i)
+      _rows[_row_start - sizeof(uint32_t) + i] = (char)(size >> (8 * i));
+   ++_num_rows;
+   ++_total_rows;
+   if (_rows.size() >= chunk_size)
+      finish();
+}
+
+void snapshot_section_writer::finish() {
+   if (_num_rows) {
+      _sink(std::move(_rows), _num_rows);
+      _rows.clear();
+      _rows.reserve(chunk_size + chunk_size / 8);
+      _num_rows = 0;
+   }
+}
+
+void database::write_snapshot( std::ostream& out, unsigned num_threads )const
+{
+   write_snapshot(out, num_threads, false);
+}
+
+void database::write_committed_snapshot( std::ostream& out, unsigned num_threads )const
+{
+   write_snapshot(out, num_threads, true);
+}
+
+void database::write_snapshot( std::ostream& out, unsigned num_threads, bool committed )const
+{
+   const size_t num_sections = _index_list.size();
+   {
+      std::vector<char> header;
+      snapshot_row_writer w(header);
+      w.write_bytes(snapshot_magic, sizeof(snapshot_magic));
+      w.write(snapshot_version);
+      w.write(committed && num_sections ? (int64_t)_index_list[0]->undo_stack_revision_range().first : revision());
+      w.write((uint32_t)num_sections);
+      for (const abstract_index* idx : _index_list) {
+         w.write(idx->type_id());
+         w.write(std::string_view(idx->type_name()));
+      }
+      w.write(checksum(0, header.data(), header.size()));
+      out.write(header.data(), header.size());
+   }
+
+   const unsigned num_workers = worker_count(num_threads, num_sections);
+   bounded_queue<chunk> queue(2 * num_workers);
+   std::atomic<size_t> next_section = 0;
+   std::atomic<unsigned> running = num_workers;
+   first_error error;
+
+   auto work = [&]() {
+      try {
+         for (size_t s; (s = next_section++) < num_sections;) {
+            auto push = [&](chunk&& c) {
+               if (!queue.push(std::move(c)))
+                  BOOST_THROW_EXCEPTION(std::runtime_error("chainbase snapshot aborted"));
+            };
+            snapshot_section_writer section([&](std::vector<char>&& rows, uint32_t num_rows) {
+               push({ (uint32_t)s, num_rows, std::move(rows) });
+            });
+            _index_list[s]->write_snapshot(section, committed);
+            section.finish();
+
+            chunk end{ (uint32_t)s, end_of_section, {} };
+            snapshot_row_writer w(end.payload);
+            w.write(section.next_id());
+            w.write(section.num_rows());
+            push(std::move(end));
+         }
+      } catch (...) {
+         error.set(std::current_exception());
+         queue.abort();
+      }
+      if (--running == 0)
+         queue.close();
+   };
+
+   std::vector<std::thread> workers;
+   auto join = scope_exit([&]() {
+      queue.abort();                          // we are exiting early
+      for (auto& t : workers)
+         t.join();
+   });
+   try {
+      for (unsigned i = 0; i < num_workers; ++i)
+         workers.emplace_back(work);
+   } catch (...) {
+      error.set(std::current_exception());
+      queue.abort();
+   }
+
+   while (auto c = queue.pop()) {
+      write_chunk(out, *c);
+      if (!out) {
+         error.set(std::make_exception_ptr(std::runtime_error("writing chainbase snapshot failed")));
+         queue.abort();
+      }
+   }
+   for (auto& t : workers)
+      t.join();
+   workers.clear();
+   error.rethrow();
+
+   write_chunk(out, { end_of_stream, 0, {} });
+   if (!out.flush())
+      BOOST_THROW_EXCEPTION(std::runtime_error("writing chainbase snapshot failed"));
+}
+
+void database::read_snapshot( std::istream& in, unsigned num_threads )
+{
+   if ( _read_only_mode )
+      BOOST_THROW_EXCEPTION( std::logic_error( "attempting to read a snapshot in read-only mode" ) );
+
+   std::vector<char> header(sizeof(snapshot_magic) + sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t));
+   read_exactly(in, header.data(), header.size());
+   snapshot_row_reader r(header.data(), header.size());
+   char magic[sizeof(snapshot_magic)];
+   r.read_bytes(magic, sizeof(magic));
+   if (!std::equal(magic, magic + sizeof(magic), snapshot_magic))
+      BOOST_THROW_EXCEPTION(std::runtime_error("not a chainbase snapshot"));
+   if (r.read<uint32_t>() != snapshot_version)
+      BOOST_THROW_EXCEPTION(std::runtime_error("unsupported chainbase snapshot version"));
+   const int64_t  revision     = r.read<int64_t>();
+   const uint32_t num_sections = r.read<uint32_t>();
+
+   std::vector<abstract_index*> sections;
+   for (uint32_t s = 0; s < num_sections; ++s) {
+      char fixed[2 * sizeof(uint32_t)];
+      read_exactly(in, fixed, sizeof(fixed));
+      snapshot_row_reader fr(fixed, sizeof(fixed));
+      const uint32_t type_id   = fr.read<uint32_t>();
+      const uint32_t name_size = fr.read<uint32_t>();
+      if (name_size > 64*1024)
+         throw_corrupted();
+      std::string name(name_size, '\0');
+      read_exactly(in, name.data(), name.size());
+      header.insert(header.end(), fixed, fixed + sizeof(fixed));
+      header.insert(header.end(), name.begin(), name.end());
+
+      if (type_id >= _index_map.size() || !_index_map[type_id])
+         BOOST_THROW_EXCEPTION(std::runtime_error("chainbase snapshot contains objects of type " + name + ", whose index was not added"));
+      abstract_index* idx = _index_map[type_id].get();
+      if (std::find(sections.begin(), sections.end(), idx) != sections.end())
+         throw_corrupted();
+      if (idx->row_count() || idx->has_undo_session())
+         BOOST_THROW_EXCEPTION(std::logic_error("index of " + idx->type_name() + " must be empty and without undo session to load a snapshot"));
+      sections.push_back(idx);
+   }
+   {
+      char bytes[sizeof(uint64_t)];
+      read_exactly(in, bytes, sizeof(bytes));
+      if (snapshot_row_reader(bytes, sizeof(bytes)).read<uint64_t>() != checksum(0, header.data(), header.size()))
+         throw_corrupted();
+   }
+
+   // each section is loaded by a single worker, in the order of its chunks
+   const unsigned num_workers = worker_count(num_threads, num_sections);
+   std::vector<std::unique_ptr<bounded_queue<chunk>>> queues;
+   for (unsigned i = 0; i < num_workers; ++i)
+      queues.push_back(std::make_unique<bounded_queue<chunk>>(4));
+   std::vector<uint64_t> rows_loaded(num_sections);
+   std::vector<char>     section_ended(num_sections);
+   std::mutex            construct_mutex;
+   first_error           error;
+
+   auto load = [&](const chunk& c) {
+      if (chunk_checksum(c) != c.checksum || section_ended[c.section])
+         throw_corrupted();
+      abstract_index* idx = sections[c.section];
+      snapshot_row_reader r(c.payload.data(), c.payload.size());
+      if (c.num_rows == end_of_section) {
+         const int64_t  next_id  = r.read<int64_t>();
+         const uint64_t num_rows = r.read<uint64_t>();
+         if (num_rows != rows_loaded[c.section] || r.remaining())
+            throw_corrupted();
+         idx->set_next_id(next_id);
+         section_ended[c.section] = true;
+         return;
+      }
+      for (uint32_t i = 0; i < c.num_rows; ++i) {
+         const int64_t    id  = r.read<int64_t>();
+         std::string_view row = r.read_string();
+         snapshot_row_reader row_reader(row.data(), row.size());
+         idx->read_snapshot_row(id, row_reader, construct_mutex);
+         if (row_reader.remaining())
+            BOOST_THROW_EXCEPTION(std::runtime_error("row of " + idx->type_name() + " not fully read by its snapshot_serializer"));
+      }
+      if (r.remaining())
+         throw_corrupted();
+      rows_loaded[c.section] += c.num_rows;
+   };
+
+   auto abort_all = [&]() {
+      for (auto& q : queues)
+         q->abort();
+   };
+   std::vector<std::thread> workers;
+   auto join = scope_exit([&]() {
+      abort_all();                            // we are exiting early
+      for (auto& t : workers)
+         t.join();
+   });
+   for (unsigned i = 0; i < num_workers; ++i) {
+      workers.emplace_back([&, &queue = *queues[i]]() {
+         try {
+            while (auto c = queue.pop())
+               load(*c);
+         } catch (...) {
+            error.set(std::current_exception());
+            abort_all();
+         }
+      });
+   }
+
+   try {
+      for (;;) {
+         char bytes[chunk_header_size];
+         read_exactly(in, bytes, sizeof(bytes));
+         snapshot_row_reader hr(bytes, sizeof(bytes));
+         chunk c{ hr.read<uint32_t>(), hr.read<uint32_t>(), {} };
+         const uint32_t payload_size = hr.read<uint32_t>();
+         c.checksum = hr.read<uint64_t>();
+         if (c.section == end_of_stream) {
+            if (c.num_rows || payload_size || chunk_checksum(c) != c.checksum)
+               throw_corrupted();
+            break;
+         }
+         if (c.section >= num_sections || payload_size > max_payload_size)
+            throw_corrupted();
+         c.payload.resize(payload_size);
+         read_exactly(in, c.payload.data(), payload_size);
+         if (!queues[c.section % num_workers]->push(std::move(c)))
+            break;                            // a worker failed
+      }
+      for (auto& q : queues)
+         q->close();
+   } catch (...) {
+      error.set(std::current_exception());
+      abort_all();
+   }
+   for (auto& t : workers)
+      t.join();
+   workers.clear();
+   error.rethrow();
+
+   if (std::find(section_ended.begin(), section_ended.end(), false) != section_ended.end())
+      throw_corrupted();
+   if (revision >= 0)
+      set_revision(revision);
+}
+
+}  // namespace chainbase
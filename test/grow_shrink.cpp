@@ -8,7 +8,8 @@ using namespace chainbase;
 const pinnable_mapped_file::map_mode test_modes[] = {
    pinnable_mapped_file::map_mode::mapped,
    pinnable_mapped_file::map_mode::mapped_private,
-   pinnable_mapped_file::map_mode::heap
+   pinnable_mapped_file::map_mode::heap,
+   pinnable_mapped_file::map_mode::heap_lazy
 };
 
 BOOST_DATA_TEST_CASE(grow_shrink, boost::unit_test::data::make(test_modes), map_mode) {
@@ -1,14 +1,31 @@
 #define BOOST_TEST_MODULE chainbase test
 #include <boost/test/unit_test.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/environment.hpp>
+#include <chainbase/parallel_batch.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
 
 #include <iostream>
+#include <thread>
+#include <list>
+#include <deque>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <atomic>
 #include "temp_directory.hpp"
 
+#ifndef _WIN32
+#include <chainbase/pagemap_accessor.hpp>
+#include <chainbase/scope_exit.hpp>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 using namespace chainbase;
 using namespace boost::multi_index;
 
@@ -340,6 +357,50 @@ void check_shared_vector_apis(VecOfVec& vec_of_vec, const Alloc& expected_alloc)
       BOOST_REQUIRE_EQUAL(v.size(), 0u);
    }
 
+   {
+      // check push_back(), reserve(), shrink_to_fit(). Appending grows the capacity geometrically,
+      // and keeps copy-on-write semantics.
+      // -------------------------------------------------------------------------------------------
+      vec_of_vec.clear();
+      vec_of_vec.reserve(2);
+      vec_of_vec.emplace_back();
+      auto& v0 = vec_of_vec[0];
+      size_t reallocations = 0;
+      for (int i=0; i<1000; ++i) {
+         auto cap = v0.capacity();
+         v0.push_back(i);
+         if (v0.capacity() != cap)
+            ++reallocations;
+      }
+      BOOST_REQUIRE_EQUAL(v0.size(), 1000u);
+      BOOST_REQUIRE_LE(reallocations, 11u);
+      for (int i=0; i<1000; ++i)
+         BOOST_REQUIRE_EQUAL(v0[i], i);
+
+      vec_of_vec.emplace_back(v0);
+      auto& v1 = vec_of_vec[1];
+      BOOST_REQUIRE_EQUAL(v0.data(), v1.data());
+      v1.push_back(v1[0]);                       // appending to a shared buffer copies it first
+      BOOST_REQUIRE_NE(v0.data(), v1.data());
+      BOOST_REQUIRE_EQUAL(v0.size(), 1000u);
+      BOOST_REQUIRE_EQUAL(v1.size(), 1001u);
+      BOOST_REQUIRE_EQUAL(v1[1000], 0);
+
+      v0.shrink_to_fit();
+      BOOST_REQUIRE_EQUAL(v0.capacity(), v0.size());
+      v0.push_back(v0[999]);                     // element of the buffer being reallocated
+      BOOST_REQUIRE_EQUAL(v0[1000], 999);
+
+      v0.clear();
+      v0.reserve(10);
+      BOOST_REQUIRE_EQUAL(v0.capacity(), 10u);
+      BOOST_REQUIRE(v0.empty());
+      const auto* buf = v0.data();
+      for (int i=0; i<10; ++i)
+         v0.emplace_back(i);
+      BOOST_REQUIRE_EQUAL(v0.data(), buf);      // no reallocation within reserved capacity
+   }
+
    { 
       // check clear_and_construct()
       // ---------------------------
@@ -369,7 +430,7 @@ class instance_counter {
 public:
    instance_counter() { ++_count; }
    instance_counter(const instance_counter&) { ++_count; }
-   instance_counter(instance_counter&&) = default;
+   instance_counter(instance_counter&&) { ++_count; }
 
    bool operator==(const instance_counter&) const { return true; }
    
@@ -489,9 +550,87 @@ BOOST_AUTO_TEST_CASE(shared_vector_apis_segment_alloc) {
       BOOST_REQUIRE_EQUAL(my_string::num_instances(), 0);
    }
 
-   // make sure we didn't leak memory
-   // -------------------------------
-   BOOST_REQUIRE_EQUAL(free_memory, pmf.get_segment_manager()->get_free_memory());
+   // make sure we didn't leak memory. Small payloads are returned to the size-class pools
+   // rather than to the segment manager, so account for the memory the pools reserved.
+   // -------------------------------------------------------------------------------------
+   const auto& ss_alloc = *pmf.get_small_size_allocator();
+   for (size_t i = 0; i < small_size_allocator_t::num_size_classes; ++i)
+      BOOST_REQUIRE_EQUAL(ss_alloc.stats(i).num_in_use, 0u);
+   BOOST_REQUIRE_EQUAL(free_memory, pmf.get_segment_manager()->get_free_memory() + ss_alloc.reserved_memory());
+}
+
+// -----------------------------------------------------------------------------
+//   `shared_cow_vector` neither leaks nor loses elements when they throw
+// -----------------------------------------------------------------------------
+struct throwing_copy : public instance_counter<throwing_copy> {
+   static inline int copies_before_throw = -1;     // never throws if negative
+
+   throwing_copy(int v = 0) : value(v) {}
+   throwing_copy(const throwing_copy& o) : instance_counter<throwing_copy>(o), value(o.value) {
+      if (copies_before_throw >= 0 && copies_before_throw-- == 0)
+         throw std::runtime_error("throwing_copy");
+   }
+   throwing_copy& operator=(const throwing_copy&) = default;
+
+   int value;
+};
+
+BOOST_AUTO_TEST_CASE(shared_vector_exception_safety) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+
+   pinnable_mapped_file pmf(temp, true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+   auto* seg_mgr = pmf.get_segment_manager();
+   const auto& ss_alloc = *pmf.get_small_size_allocator();
+   auto blocks_in_use = [&]() {
+      size_t res = 0;
+      for (size_t i = 0; i < small_size_allocator_t::num_size_classes; ++i)
+         res += ss_alloc.stats(i).num_in_use;
+      return res;
+   };
+   auto values = [](const shared_vector<throwing_copy>& v) {
+      std::vector<int> res;
+      for (const auto& e : v)
+         res.push_back(e.value);
+      return res;
+   };
+
+   using sv = shared_vector<throwing_copy>;
+   sv* v = seg_mgr->construct<sv>(bip::anonymous_instance)(std::vector<throwing_copy>{ 1, 2, 3, 4 });
+   const throwing_copy extra(5);
+   const size_t in_use = blocks_in_use();
+   const int instances = throwing_copy::num_instances();
+
+   // the new element throws when the vector grows
+   throwing_copy::copies_before_throw = 0;
+   BOOST_CHECK_THROW(v->push_back(extra), std::runtime_error);
+   BOOST_REQUIRE_EQUAL(blocks_in_use(), in_use);
+   BOOST_REQUIRE_EQUAL(throwing_copy::num_instances(), instances);
+
+   // copying the elements of a shared payload to a new one throws after the new element and two copies
+   sv* copy = seg_mgr->construct<sv>(bip::anonymous_instance)(*v);
+   throwing_copy::copies_before_throw = 3;
+   BOOST_CHECK_THROW(v->push_back(extra), std::runtime_error);
+   BOOST_REQUIRE_EQUAL(blocks_in_use(), in_use);
+   BOOST_REQUIRE_EQUAL(throwing_copy::num_instances(), instances);
+   BOOST_REQUIRE(values(*v) == (std::vector<int>{ 1, 2, 3, 4 }));
+
+   // as does a copy into a fresh payload
+   throwing_copy::copies_before_throw = 2;
+   BOOST_CHECK_THROW(seg_mgr->construct<sv>(bip::anonymous_instance)(copy->data(), copy->size()), std::runtime_error);
+   BOOST_REQUIRE_EQUAL(blocks_in_use(), in_use);
+   BOOST_REQUIRE_EQUAL(throwing_copy::num_instances(), instances);
+   seg_mgr->destroy_ptr(copy);
+   throwing_copy::copies_before_throw = -1;
+
+   // a range of the vector's own elements is read before they are released
+   v->assign(v->begin() + 1, v->end());
+   BOOST_REQUIRE(values(*v) == (std::vector<int>{ 2, 3, 4 }));
+   v->assign(v->begin(), v->begin() + 2);
+   BOOST_REQUIRE(values(*v) == (std::vector<int>{ 2, 3 }));
+
+   seg_mgr->destroy_ptr(v);
+   BOOST_REQUIRE_EQUAL(throwing_copy::num_instances(), 1);
 }
 
 // -----------------------------------------------------------------------------
@@ -578,6 +717,40 @@ BOOST_AUTO_TEST_CASE(shared_cow_string_apis) {
       BOOST_REQUIRE_EQUAL(s1.size(), test_string.size());
    }
 
+   {
+      // test append(), push_back(), reserve() and shrink_to_fit()
+      // ----------------------------------------------------------
+      shared_cow_string s0;
+      std::string expected;
+      for (int i=0; i<200; ++i) {
+         s0.append(std::to_string(i));
+         s0.push_back(',');
+         expected += std::to_string(i) + ',';
+      }
+      BOOST_REQUIRE_EQUAL(s0, expected);
+      BOOST_REQUIRE_EQUAL(s0.data()[s0.size()], 0);
+      BOOST_REQUIRE_GE(s0.capacity(), s0.size());
+
+      shared_cow_string s1(s0);
+      BOOST_REQUIRE_EQUAL((void *)s1.data(), (void *)s0.data());
+      s1.append(s1.data(), 4);                    // append from the (shared) buffer itself
+      BOOST_REQUIRE_NE((void *)s1.data(), (void *)s0.data());
+      BOOST_REQUIRE_EQUAL(s0, expected);
+      BOOST_REQUIRE_EQUAL(s1, expected + expected.substr(0, 4));
+
+      s0.shrink_to_fit();
+      BOOST_REQUIRE_EQUAL(s0.capacity(), s0.size());
+      BOOST_REQUIRE_EQUAL(s0, expected);
+
+      shared_cow_string s2;
+      s2.reserve(64);
+      const char* buf = s2.data();
+      BOOST_REQUIRE_EQUAL(s2.size(), 0u);
+      s2.append(test_string);
+      BOOST_REQUIRE_EQUAL((void *)s2.data(), (void *)buf);
+      BOOST_REQUIRE_EQUAL(s2, test_string);
+   }
+
    {
       // test comparison operator
       // ------------------------
@@ -593,6 +766,160 @@ BOOST_AUTO_TEST_CASE(shared_cow_string_apis) {
 }
 
 
+// -----------------------------------------------------------------------------
+//   Check that small payloads are served by the segment's size-class pools
+// -----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE(small_size_allocator_pools) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+
+   pinnable_mapped_file pmf(temp, true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+   auto* seg_mgr = pmf.get_segment_manager();
+   const auto& ss_alloc = *pmf.get_small_size_allocator();
+   BOOST_REQUIRE(pinnable_mapped_file::get_small_size_allocator(seg_mgr) == &ss_alloc);
+
+   using string_vector = bip::vector<shared_string, chainbase::allocator<shared_string>>;
+   string_vector* strings = seg_mgr->construct<string_vector>(bip::anonymous_instance)(chainbase::allocator<shared_string>(seg_mgr));
+   strings->reserve(16);
+
+   const std::string small(20, 'a');
+   strings->emplace_back(small);
+   size_t cls = 0;
+   while (cls < small_size_allocator_t::num_size_classes && ss_alloc.stats(cls).num_in_use == 0)
+      ++cls;
+   BOOST_REQUIRE_LT(cls, small_size_allocator_t::num_size_classes);
+   BOOST_REQUIRE_GT(ss_alloc.stats(cls).block_size, small.size());
+   BOOST_REQUIRE_EQUAL(ss_alloc.stats(cls).num_in_use, 1u);
+   BOOST_REQUIRE_EQUAL(ss_alloc.stats(cls).num_allocs, 1u);
+   BOOST_REQUIRE_GT(ss_alloc.stats(cls).num_free, 0u);
+   const char* first_payload = strings->back().data();
+
+   // freed blocks go back to the freelist of their size class, and are reused first
+   strings->pop_back();
+   BOOST_REQUIRE_EQUAL(ss_alloc.stats(cls).num_in_use, 0u);
+   strings->emplace_back(small);
+   BOOST_REQUIRE_EQUAL(strings->back().data(), first_payload);
+   BOOST_REQUIRE_EQUAL(ss_alloc.stats(cls).num_allocs, 2u);
+
+   // large payloads bypass the pools
+   size_t reserved = ss_alloc.reserved_memory();
+   strings->emplace_back(std::string(small_size_allocator_t::max_size * 2, 'b'));
+   BOOST_REQUIRE_EQUAL(ss_alloc.reserved_memory(), reserved);
+   BOOST_REQUIRE_EQUAL(strings->back(), std::string(small_size_allocator_t::max_size * 2, 'b'));
+
+   seg_mgr->destroy_ptr(strings);
+   BOOST_REQUIRE_EQUAL(ss_alloc.stats(cls).num_in_use, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(segment_lookup_from_threads) {
+   temp_directory temp_dir0, temp_dir1, temp_dir2;
+
+   pinnable_mapped_file pmf0(temp_dir0.path(), true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+   pinnable_mapped_file pmf1(temp_dir1.path(), true, 1024 * 1024, false, pinnable_mapped_file::map_mode::heap);
+   auto* seg0 = pmf0.get_segment_manager();
+   auto* seg1 = pmf1.get_segment_manager();
+   char* obj0 = (char*)seg0->allocate(16);
+   char* obj1 = (char*)seg1->allocate(16);
+   char  on_stack;
+
+   // lookups from several threads, while another database is opened and closed
+   std::atomic<bool> done = false;
+   std::vector<std::thread> threads;
+   std::atomic<size_t> num_errors = 0;
+   for (size_t i = 0; i < 4; ++i) {
+      threads.emplace_back([&]() {
+         while (!done) {
+            if (pinnable_mapped_file::get_allocator<char>(obj0)->get_segment_manager() != seg0 ||
+                pinnable_mapped_file::get_allocator<char>(obj1)->get_segment_manager() != seg1 ||
+                pinnable_mapped_file::get_small_size_allocator(obj1) != pmf1.get_small_size_allocator() ||
+                pinnable_mapped_file::get_allocator<char>(&on_stack))
+               ++num_errors;
+         }
+      });
+   }
+   for (size_t i = 0; i < 10; ++i) {
+      pinnable_mapped_file pmf2(temp_dir2.path(), true, 1024 * 1024, false, pinnable_mapped_file::map_mode::heap);
+      BOOST_REQUIRE(pinnable_mapped_file::get_allocator<char>(pmf2.get_segment_manager())->get_segment_manager() == pmf2.get_segment_manager());
+   }
+   done = true;
+   for (auto& t : threads)
+      t.join();
+   BOOST_REQUIRE_EQUAL(num_errors, 0u);
+
+   seg0->deallocate(obj0);
+   seg1->deallocate(obj1);
+}
+
+BOOST_AUTO_TEST_CASE(shared_cow_string_inline) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+
+   static_assert(sizeof(shared_cow_string) == 8);
+
+   pinnable_mapped_file pmf(temp, true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+   auto* seg_mgr = pmf.get_segment_manager();
+   const auto& ss_alloc = *pmf.get_small_size_allocator();
+
+   using string_vector = bip::vector<shared_string, chainbase::allocator<shared_string>>;
+   string_vector* strings = seg_mgr->construct<string_vector>(bip::anonymous_instance)(chainbase::allocator<shared_string>(seg_mgr));
+   strings->reserve(16);
+   const size_t free_memory = seg_mgr->get_free_memory();
+
+   // strings of up to `max_inline_size` chars are stored within the object, without allocating
+   const std::string short_str(shared_cow_string::max_inline_size, 's');
+   strings->emplace_back(short_str);
+   strings->emplace_back(std::string_view{"ab"});
+   strings->emplace_back();
+   for (size_t i = 0; i < small_size_allocator_t::num_size_classes; ++i)
+      BOOST_REQUIRE_EQUAL(ss_alloc.stats(i).num_allocs, 0u);
+   BOOST_REQUIRE_EQUAL(seg_mgr->get_free_memory(), free_memory);
+
+   const shared_string& s0 = (*strings)[0];
+   BOOST_REQUIRE(s0.is_inline());
+   BOOST_REQUIRE_EQUAL(s0, short_str);
+   BOOST_REQUIRE_EQUAL(s0.data()[s0.size()], '\0');
+   BOOST_REQUIRE((const char*)&s0 < s0.data() && s0.data() < (const char*)(&s0 + 1));
+   BOOST_REQUIRE_EQUAL((*strings)[1], std::string_view{"ab"});
+   BOOST_REQUIRE_EQUAL((*strings)[2].size(), 0u);
+   BOOST_REQUIRE((*strings)[2].data() == nullptr);
+
+   // copies of inline strings don't share their chars
+   shared_string s1 = s0;
+   BOOST_REQUIRE(s1.is_inline());
+   BOOST_REQUIRE(s1.data() != s0.data());
+   BOOST_REQUIRE_EQUAL(s1, s0);
+
+   // growing past `max_inline_size` moves the chars out of line, and shrinking brings them back
+   shared_string& s2 = (*strings)[1];
+   s2.append(std::string_view{"cdefgh"});
+   BOOST_REQUIRE(!s2.is_inline());
+   BOOST_REQUIRE_EQUAL(s2, std::string_view{"abcdefgh"});
+   s2.assign("xyz", 3);
+   BOOST_REQUIRE(s2.is_inline());
+   BOOST_REQUIRE_EQUAL(s2, std::string_view{"xyz"});
+   s2.append("12345678", 8);
+   s2.resize_and_fill(4, [](char* data, std::size_t sz) { std::memcpy(data, "wxyz", sz); });
+   BOOST_REQUIRE(s2.is_inline());
+   BOOST_REQUIRE_EQUAL(s2, std::string_view{"wxyz"});
+   s2.append("1234567", 7);
+   s2.resize_and_fill(5, [](char* data, std::size_t sz) { std::memcpy(data, "vwxyz", sz); });
+   BOOST_REQUIRE_EQUAL(s2, std::string_view{"vwxyz"});
+   s2.reserve(32);
+   BOOST_REQUIRE(!s2.is_inline());
+   s2.shrink_to_fit();
+   BOOST_REQUIRE(s2.is_inline());
+   BOOST_REQUIRE_EQUAL(s2, std::string_view{"vwxyz"});
+
+   // inline strings survive the vector relocating them
+   strings->resize(strings->capacity() + 1);
+   BOOST_REQUIRE_EQUAL((*strings)[0], short_str);
+   BOOST_REQUIRE_EQUAL((*strings)[1], std::string_view{"vwxyz"});
+
+   seg_mgr->destroy_ptr(strings);
+   for (size_t i = 0; i < small_size_allocator_t::num_size_classes; ++i)
+      BOOST_REQUIRE_EQUAL(ss_alloc.stats(i).num_in_use, 0u);
+}
+
 // -----------------------------------------------------------------------------
 //      Check chainbase operations on items containing `shared` types
 // -----------------------------------------------------------------------------
@@ -658,6 +985,1446 @@ BOOST_AUTO_TEST_CASE( shared_string_object ) {
    BOOST_REQUIRE( new_titled_book.authors == copy_new_titled_book.authors );
 }
 
+struct note : public chainbase::object<1, note> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( note )
+
+   id_type       id;
+   int64_t       key = 0;
+   double        weight = 0;
+   shared_string text;
+};
+
+typedef multi_index_container<
+  note,
+  indexed_by<
+     ordered_unique< member<note,note::id_type,&note::id> >,
+     ordered_unique< member<note,int64_t,&note::key> >
+  >,
+  chainbase::node_allocator<note>
+> note_index;
+
+CHAINBASE_SET_INDEX_TYPE( note, note_index )
+
+template<>
+struct chainbase::snapshot_serializer<book> {
+   static void write(snapshot_row_writer& w, const book& b) { w.write(b.a); w.write(b.b); }
+   static void read(snapshot_row_reader& r, book& b)        { b.a = r.read<int>(); b.b = r.read<int>(); }
+};
+
+template<>
+struct chainbase::snapshot_serializer<note> {
+   static void write(snapshot_row_writer& w, const note& n) {
+      w.write(n.key);
+      w.write(n.weight);
+      w.write(std::string_view(n.text.data(), n.text.size()));
+   }
+   static void read(snapshot_row_reader& r, note& n) {
+      n.key    = r.read<int64_t>();
+      n.weight = r.read<double>();
+      n.text   = r.read_string();
+   }
+};
+
+BOOST_AUTO_TEST_CASE( snapshot_round_trip ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   std::stringstream snapshot;
+   {
+      chainbase::database db(temp / "a", database::read_write, 1024*1024*64);
+      db.add_index< book_index >();
+      db.add_index< note_index >();
+      {
+         auto session = db.start_undo_session(true);
+         for (int i = 0; i < 3000; ++i)
+            db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+         for (int i = 0; i < 5000; ++i) {
+            db.create<note>( [&](note& n) {
+               n.key    = i * 7;
+               n.weight = i / 3.0;
+               n.text   = std::string(i == 100 ? 3*1024*1024 : i % 300, 'a' + i % 26);   // one row larger than a chunk
+            } );
+         }
+         for (int i = 0; i < 3000; i += 7)
+            db.remove( db.get(book::id_type(i)) );
+         db.remove( db.get(book::id_type(2999)) );
+         session.push();
+      }
+      db.commit(db.revision());
+      db.write_snapshot(snapshot, 4);
+
+      // every index needs a serializer
+      chainbase::database db2(temp / "b", database::read_write, 1024*1024*8);
+      db2.add_index< titled_book_index >();
+      std::stringstream out;
+      BOOST_REQUIRE_THROW(db2.write_snapshot(out), std::logic_error);
+   }
+
+   const std::string bytes = snapshot.str();
+   for (unsigned num_threads : { 1, 3 }) {
+      temp_directory load_dir;
+      chainbase::database db(load_dir.path(), database::read_write, 1024*1024*64);
+      db.add_index< book_index >();
+      db.add_index< note_index >();
+      std::stringstream in(bytes);
+      db.read_snapshot(in, num_threads);
+
+      chainbase::database orig(temp / "a", database::read_write, 0);
+      orig.add_index< book_index >();
+      orig.add_index< note_index >();
+      BOOST_REQUIRE_EQUAL(db.revision(), orig.revision());
+      BOOST_REQUIRE(db.row_count_per_index() == orig.row_count_per_index());
+      for (const book& b : orig.get_index<book_index>().indices()) {
+         const book& l = db.get(b.id);
+         BOOST_REQUIRE_EQUAL(l.a, b.a);
+         BOOST_REQUIRE_EQUAL(l.b, b.b);
+      }
+      for (const note& n : orig.get_index<note_index>().indices()) {
+         const note& l = db.get(n.id);
+         BOOST_REQUIRE_EQUAL(l.key, n.key);
+         BOOST_REQUIRE_EQUAL(l.weight, n.weight);
+         BOOST_REQUIRE(l.text == n.text);
+      }
+      // ids removed before the snapshot are not reused
+      BOOST_REQUIRE_EQUAL(db.create<book>( [](book& b) { b.a = -1; b.b = 1; } ).id._id, 3000);
+
+      // the indices must be empty
+      std::stringstream again(bytes);
+      BOOST_REQUIRE_THROW(db.read_snapshot(again), std::logic_error);
+   }
+
+   auto load = [](const std::string& bytes) {
+      temp_directory load_dir;
+      chainbase::database db(load_dir.path(), database::read_write, 1024*1024*64);
+      db.add_index< book_index >();
+      db.add_index< note_index >();
+      std::stringstream in(bytes);
+      db.read_snapshot(in);
+   };
+   for (size_t pos : { bytes.size() / 2, bytes.size() - 1, size_t(10) }) {
+      std::string corrupted = bytes;
+      corrupted[pos] ^= 1;
+      BOOST_REQUIRE_THROW(load(corrupted), std::runtime_error);
+      BOOST_REQUIRE_THROW(load(bytes.substr(0, pos)), std::runtime_error);
+   }
+}
+
+
+BOOST_AUTO_TEST_CASE( committed_snapshot ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   chainbase::database db(temp / "a", database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   db.add_index< note_index >();
+   for (int i = 0; i < 100; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   db.create<note>( [&](note& n) { n.key = 1; n.text = "committed"; } );
+   const int64_t committed = db.revision();
+
+   // blocks applied on top of the committed revision
+   for (int r = 0; r < 3; ++r) {
+      auto session = db.start_undo_session(true);
+      for (int i = r; i < 100; i += 5)
+         db.modify( db.get(book::id_type(i)), [&](book& b) { b.a += 1000; } );
+      db.remove( db.get(book::id_type(50 + r)) );
+      db.create<book>( [&](book& b) { b.a = 5000 + r; b.b = 5000 + r; } );
+      db.modify( db.get(note::id_type(0)), [&](note& n) { n.text = "head"; } );
+      session.push();
+   }
+
+   std::stringstream snapshot;
+   db.write_committed_snapshot(snapshot, 2);
+   BOOST_REQUIRE_EQUAL(db.revision(), committed + 3);
+
+   temp_directory load_dir;
+   chainbase::database loaded(load_dir.path(), database::read_write, 1024*1024*8);
+   loaded.add_index< book_index >();
+   loaded.add_index< note_index >();
+   loaded.read_snapshot(snapshot);
+   BOOST_REQUIRE_EQUAL(loaded.revision(), committed);
+   BOOST_REQUIRE_EQUAL(loaded.get_index<book_index>().indices().size(), 100u);
+   for (int i = 0; i < 100; ++i) {
+      const book& b = loaded.get(book::id_type(i));
+      BOOST_REQUIRE_EQUAL(b.a, i);
+      BOOST_REQUIRE_EQUAL(b.b, -i);
+   }
+   BOOST_REQUIRE(loaded.get(note::id_type(0)).text == "committed");
+   BOOST_REQUIRE_EQUAL(loaded.create<book>( [](book& b) { b.a = 5000; b.b = 5000; } ).id._id, 100);
+}
+
+
+BOOST_AUTO_TEST_CASE( revision_diff ) {
+   temp_directory temp_dir;
+   chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   for (int i = 0; i < 10; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   const int64_t start = db.revision();
+
+   auto s1 = db.start_undo_session(true);
+   db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 100; } );
+   db.remove( db.get(book::id_type(2)) );
+   db.create<book>( [](book& b) { b.a = 10; b.b = -10; } );            // id 10
+   db.create<book>( [](book& b) { b.a = 11; b.b = -11; } );            // id 11
+   s1.push();
+   auto s2 = db.start_undo_session(true);
+   db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 200; } );
+   db.modify( db.get(book::id_type(3)), [](book& b) { b.a = 300; } );
+   db.modify( db.get(book::id_type(10)), [](book& b) { b.a = 1000; } );
+   db.remove( db.get(book::id_type(11)) );
+   db.create<book>( [](book& b) { b.a = 12; b.b = -12; } );            // id 12
+   s2.push();
+
+   auto ids = [](const auto& values) {
+      std::vector<int64_t> res;
+      for (const auto* v : values)
+         res.push_back(v->id._id);
+      return res;
+   };
+
+   // both sessions
+   auto d = db.diff<book>(start, start + 2);
+   BOOST_TEST(ids(d.created) == std::vector<int64_t>({ 10, 12 }), boost::test_tools::per_element());
+   BOOST_TEST(ids(d.removed) == std::vector<int64_t>({ 2 }), boost::test_tools::per_element());
+   BOOST_TEST(d.created[0]->a == 1000);
+   BOOST_TEST(d.removed[0]->a == 2);
+   BOOST_REQUIRE_EQUAL(d.modified.size(), 2u);
+   BOOST_TEST(d.modified[0].first->a == 1);
+   BOOST_TEST(d.modified[0].second->a == 200);
+   BOOST_TEST(d.modified[1].first->a == 3);
+   BOOST_TEST(d.modified[1].second->a == 300);
+
+   // first session, seen from head
+   d = db.diff<book>(start, start + 1);
+   BOOST_TEST(ids(d.created) == std::vector<int64_t>({ 10, 11 }), boost::test_tools::per_element());
+   BOOST_TEST(d.created[0]->a == 10);
+   BOOST_TEST(d.created[1]->a == 11);
+   BOOST_REQUIRE_EQUAL(d.modified.size(), 1u);
+   BOOST_TEST(d.modified[0].first->a == 1);
+   BOOST_TEST(d.modified[0].second->a == 100);
+
+   // second session
+   d = db.diff<book>(start + 1, start + 2);
+   BOOST_TEST(ids(d.created) == std::vector<int64_t>({ 12 }), boost::test_tools::per_element());
+   BOOST_TEST(ids(d.removed) == std::vector<int64_t>({ 11 }), boost::test_tools::per_element());
+   BOOST_REQUIRE_EQUAL(d.modified.size(), 3u);
+   BOOST_TEST(d.modified[0].first->a == 100);
+   BOOST_TEST(d.modified[2].first->a == 10);
+   BOOST_TEST(d.modified[2].second->a == 1000);
+
+   BOOST_TEST(db.diff<book>(start + 2, start + 2).modified.empty());
+   BOOST_CHECK_THROW(db.diff<book>(start - 1, start), std::out_of_range);
+   BOOST_CHECK_THROW(db.diff<book>(start + 1, start), std::logic_error);
+   BOOST_TEST(db.revision() == start + 2);
+}
+
+
+BOOST_AUTO_TEST_CASE( change_data_capture ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   chainbase::database db(temp / "db", database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   db.add_index< note_index >();
+   for (int i = 0; i < 5; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+
+   auto ring = std::make_shared<chainbase::change_ring>(1024*1024);
+   db.set_change_log(ring);
+   const int64_t start = db.revision();
+   {
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 10; } );
+      db.create<note>( [](note& n) { n.key = 7; n.text = "created"; } );
+      session.push();
+   }
+   {
+      auto session = db.start_undo_session(true);
+      db.remove( db.get(book::id_type(2)) );
+      db.modify( db.get(note::id_type(0)), [](note& n) { n.text = "modified"; } );
+      session.push();
+   }
+   {
+      auto session = db.start_undo_session(true);
+      db.remove( db.get(book::id_type(3)) );
+      session.push();
+   }
+   BOOST_TEST(ring->first_revision() == -1);
+
+   // the first two revisions become irreversible, the third one is undone
+   db.commit(start + 2);
+   db.undo();
+   db.commit(db.revision());
+
+   std::vector<std::string> records;
+   ring->read_after(-1, [&](int64_t revision, std::string_view record) {
+      BOOST_TEST(revision == start + 1 + (int64_t)records.size());
+      records.emplace_back(record);
+   });
+   BOOST_REQUIRE_EQUAL(records.size(), 2u);
+
+   chainbase::change_record_reader r1(records[0].data(), records[0].size());
+   BOOST_TEST(r1.revision() == start + 1);
+   BOOST_TEST(r1.num_changes() == 2u);
+   auto c = r1.next();
+   BOOST_REQUIRE(c);
+   BOOST_TEST(c->type_id == uint16_t(book::type_id));
+   BOOST_TEST((c->kind == chainbase::change_kind::modified));
+   BOOST_TEST(c->id == 1);
+   BOOST_TEST(c->row.read<int>() == 10);
+   c = r1.next();
+   BOOST_REQUIRE(c);
+   BOOST_TEST(c->type_id == uint16_t(note::type_id));
+   BOOST_TEST((c->kind == chainbase::change_kind::created));
+   BOOST_TEST(c->row.read<int64_t>() == 7);
+   BOOST_TEST(!r1.next());
+
+   chainbase::change_record_reader r2(records[1].data(), records[1].size());
+   BOOST_TEST(r2.num_changes() == 2u);
+   c = r2.next();
+   BOOST_TEST((c->kind == chainbase::change_kind::removed));
+   BOOST_TEST(c->id == 2);
+   BOOST_TEST(c->row.remaining() == 0u);
+   c = r2.next();
+   BOOST_TEST((c->kind == chainbase::change_kind::modified));
+   c->row.read<int64_t>();
+   c->row.read<double>();
+   BOOST_TEST(c->row.read_string() == "modified");
+
+   ring->read_after(start + 1, [&](int64_t revision, std::string_view) { BOOST_TEST(revision == start + 2); });
+
+   // the ring keeps the most recent records within its capacity
+   chainbase::change_ring small(records[1].size());
+   small.append(1, std::vector<char>(records[0].begin(), records[0].end()));
+   small.append(2, std::vector<char>(records[1].begin(), records[1].end()));
+   BOOST_TEST(small.first_revision() == 2);
+   BOOST_TEST(small.size() == records[1].size());
+
+   // records appended to a file, the last one torn
+   const auto path = temp / "changes";
+   {
+      chainbase::change_file file(path);
+      for (int i = 0; i < 2; ++i)
+         file.append(start + 1 + i, std::vector<char>(records[i].begin(), records[i].end()));
+   }
+   std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+   std::vector<std::string> read_back;
+   chainbase::change_file::read(path, [&](std::string_view record) { read_back.emplace_back(record); });
+   BOOST_REQUIRE_EQUAL(read_back.size(), 1u);
+   BOOST_TEST(read_back[0] == records[0]);
+
+   // a revision recorded when the next session started is recorded again once that session is undone
+   auto ring2 = std::make_shared<chainbase::change_ring>(1024*1024);
+   db.set_change_log(ring2);
+   {
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 20; } );
+      session.push();
+   }
+   {
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(4)), [](book& b) { b.a = 40; } );
+   }
+   db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 30; } );
+   db.commit(db.revision());
+   std::vector<std::string> records2;
+   ring2->read_after(-1, [&](int64_t, std::string_view record) { records2.emplace_back(record); });
+   BOOST_REQUIRE_EQUAL(records2.size(), 1u);
+   chainbase::change_record_reader r3(records2[0].data(), records2[0].size());
+   BOOST_TEST(r3.num_changes() == 1u);
+   c = r3.next();
+   BOOST_TEST(c->id == 1);
+   BOOST_TEST(c->row.read<int>() == 30);
+}
+
+
+BOOST_AUTO_TEST_CASE( published_reads ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped);
+   db.add_index< book_index >();
+   {
+      auto session = db.start_undo_session(true);
+      for (int i = 0; i < 10; ++i)
+         db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+      session.push();
+   }
+
+   chainbase::database reader(temp, database::read_only, 0, true);
+   reader.add_index< book_index >();
+   auto sum = [&]() {
+      int res = 0;
+      for (const book& b : reader.get_index<book_index>().indices())
+         res += b.a;
+      return res;
+   };
+   {
+      database::read_guard guard(reader);
+      BOOST_TEST(guard.revision() == db.revision());
+      BOOST_TEST(sum() == 45);
+      BOOST_TEST(guard.valid());
+
+      // the writer would wait forever for a reader of its own thread
+      BOOST_CHECK_THROW(db.start_undo_session(true), std::logic_error);
+      BOOST_TEST(guard.valid());
+   }
+
+   // an index kept across a publication still begins a write before it is modified
+   {
+      auto& idx = db.get_mutable_index<book_index>();
+      db.commit(db.revision());
+      database::read_guard guard(db);
+      BOOST_CHECK_THROW(idx.emplace( [](book& b) { b.a = 10; b.b = -10; } ), std::logic_error);
+      BOOST_TEST(idx.size() == 10u);
+      BOOST_TEST(guard.valid());
+
+      // the database throws before entering a noexcept modification
+      BOOST_CHECK_THROW(db.remove( db.get(book::id_type(9)) ), std::logic_error);
+      BOOST_TEST(idx.size() == 10u);
+      BOOST_TEST(guard.valid());
+
+      // which cannot throw through an index reference, and evicts the read instead
+      idx.remove( *idx.find(9) );
+      BOOST_TEST(idx.size() == 9u);
+      BOOST_TEST(!guard.valid());
+   }
+   db.create<book>( [](book& b) { b.a = 9; b.b = -9; } );
+   db.commit(db.revision());
+
+   // readers register in a file next to the database, and the writer waits for them before modifying it
+   BOOST_TEST(std::filesystem::exists(temp / "shared_memory.readers"));
+   {
+      std::atomic<bool> reading = false;
+      int  read_sum = 0;
+      bool read_valid = false;
+      std::thread t([&]() {
+         database::read_guard guard(reader);
+         reading = true;
+         std::this_thread::sleep_for(std::chrono::milliseconds(20));
+         read_sum = sum();
+         read_valid = guard.valid();
+      });
+      while (!reading)
+         std::this_thread::yield();
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 100; } );
+      t.join();
+      BOOST_TEST(read_sum == 45);
+      BOOST_TEST(read_valid);
+
+      // a reader waits for the next publication
+      std::atomic<bool> done = false;
+      std::thread t2([&]() {
+         read_sum = reader.read_consistent(sum);
+         done = true;
+      });
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      BOOST_TEST(!done);
+      session.push();
+      t2.join();
+      BOOST_TEST(read_sum == 145);
+      BOOST_TEST(database::read_guard(reader).revision() == db.revision());
+   }
+   db.undo();
+   BOOST_TEST(reader.read_consistent(sum) == 45);
+
+   // a stalled reader does not stop the writer, which evicts it after its timeout
+   db.set_reader_timeout(std::chrono::milliseconds(10));
+   {
+      std::atomic<bool> reading = false, written = false;
+      bool read_valid = true;
+      std::thread t([&]() {
+         database::read_guard guard(reader);
+         reading = true;
+         while (!written)
+            std::this_thread::yield();
+         read_valid = guard.valid();
+      });
+      while (!reading)
+         std::this_thread::yield();
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 200; } );
+      written = true;
+      t.join();
+      BOOST_TEST(!read_valid);
+   }
+   BOOST_TEST(reader.read_consistent(sum) == 45);
+
+#ifdef __linux__
+   // the slot of a reader whose process died is released at once
+   db.set_reader_timeout(std::chrono::minutes(1));
+   pid_t pid = fork();
+   if (pid == 0) {
+      chainbase::database child(temp, database::read_only, 0, true);
+      new database::read_guard(child);
+      _exit(0);
+   }
+   BOOST_REQUIRE(pid > 0);
+   int status = 0;
+   waitpid(pid, &status, 0);
+   BOOST_TEST((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+   const auto start = std::chrono::steady_clock::now();
+   {
+      auto session = db.start_undo_session(true);
+      db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 300; } );
+   }
+   BOOST_TEST((std::chrono::steady_clock::now() - start < std::chrono::seconds(10)));
+#endif
+
+   // no concurrent reader can see the writes in the other modes
+   temp_directory heap_dir;
+   chainbase::database heap_db(heap_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+   heap_db.add_index< book_index >();
+   database::read_guard guard(heap_db);
+   heap_db.create<book>( [](book& b) { b.a = 1; b.b = 1; } );
+   BOOST_TEST(guard.valid());
+}
+
+
+BOOST_AUTO_TEST_CASE( concurrent_reads ) {
+   temp_directory temp_dir;
+   chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+   db.add_index< book_index >();
+   for (int i = 0; i < 10; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   db.enable_concurrent_reads();
+
+   // the writer would wait forever for a reader of its own thread
+   {
+      database::read_guard guard(db);
+      BOOST_CHECK_THROW(db.start_undo_session(true), std::logic_error);
+      BOOST_TEST(guard.valid());
+   }
+
+   // readers always see 10 books with consecutive values, while the writer replaces them
+   std::atomic<bool> done = false;
+   std::atomic<int>  num_reads = 0;
+   bool              consistent = true;
+   auto read = [&]() {
+      return db.read_consistent([&]() {
+         const auto& by_a = db.get_index<book_index>().indices().get<1>();
+         int count = 0, first = 0, prev = 0;
+         bool ok = true;
+         for (const book& b : by_a) {
+            if (count == 0) first = b.a;
+            else ok = ok && b.a == prev + 1;
+            ok = ok && b.b == -b.a;
+            prev = b.a;
+            if (++count > 10) break;
+         }
+         return ok && count == 10 && prev == first + 9;
+      });
+   };
+   std::vector<std::thread> readers;
+   for (int i = 0; i < 2; ++i) {
+      readers.emplace_back([&]() {
+         while (!done) {
+            bool ok = read();
+            if (!ok) consistent = false;
+            ++num_reads;
+         }
+      });
+   }
+   for (int i = 0, next = 10; i < 1000; ++i) {
+      auto session = db.start_undo_session(true);
+      const auto& by_a = db.get_index<book_index>().indices().get<1>();
+      db.remove(*by_a.begin());
+      const book& middle = *std::next(by_a.begin(), 5);
+      db.modify(middle, [&](book& b) { b.b = -100000; });
+      db.create<book>( [&](book& b) { b.a = next; b.b = -next; } );
+      db.modify(middle, [&](book& b) { b.b = -b.a; });
+      if (i % 7 == 0) {
+         session.undo();
+         continue;
+      }
+      session.push();
+      ++next;
+      if (i % 5 == 0)
+         db.commit(db.revision());
+   }
+   while (num_reads < 10)
+      std::this_thread::yield();
+   done = true;
+   for (auto& t : readers)
+      t.join();
+   BOOST_TEST(consistent);
+   BOOST_TEST(read());
+}
+
+
+BOOST_AUTO_TEST_CASE( database_fork ) {
+   temp_directory temp_dir;
+   chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+   db.add_index< book_index >();
+   for (int i = 0; i < 10; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   auto session = db.start_undo_session(true);
+   db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 100; } );
+
+   // a fork starts from the same state, open sessions included, and is written independently
+   chainbase::database fork = db.fork();
+   BOOST_TEST(fork.revision() == db.revision());
+   BOOST_TEST(fork.get(book::id_type(0)).a == 100);
+   fork.undo();
+   BOOST_TEST(fork.get(book::id_type(0)).a == 0);
+   BOOST_TEST(db.get(book::id_type(0)).a == 100);
+   db.modify( db.get(book::id_type(1)), [](book& b) { b.a = 200; } );
+   BOOST_TEST(fork.get(book::id_type(1)).a == 1);
+   BOOST_CHECK_THROW(fork.checkpoint(), std::logic_error);
+
+   // forks are written in parallel, and discarded
+   std::vector<chainbase::database> forks;
+   for (int t = 0; t < 4; ++t)
+      forks.push_back(db.fork());
+   std::vector<std::thread> threads;
+   for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&, t]() {
+         auto s = forks[t].start_undo_session(true);
+         for (int i = 0; i < 1000; ++i)
+            forks[t].create<book>( [&](book& b) { b.a = (t + 1) * 1000 + i; b.b = -b.a; } );
+         forks[t].remove(forks[t].get(book::id_type(t)));
+         s.push();
+      });
+   }
+   for (auto& th : threads)
+      th.join();
+   for (int t = 0; t < 4; ++t) {
+      const auto& idx = forks[t].get_index<book_index>().indices();
+      BOOST_TEST(idx.size() == 1009u);
+      BOOST_TEST(!forks[t].find(book::id_type(t)));
+      const auto& by_a = idx.get<1>();
+      BOOST_TEST(by_a.lower_bound(1000)->a == (t + 1) * 1000);
+      BOOST_TEST(std::distance(by_a.lower_bound(1000), by_a.end()) == 1000);
+   }
+   forks.clear();
+   BOOST_TEST(db.get_index<book_index>().indices().size() == 10u);
+   session.undo();
+   BOOST_TEST(db.get(book::id_type(0)).a == 0);
+
+   // the payloads of shared members are found in the segment of the fork
+   temp_directory titled_dir;
+   chainbase::database titled(titled_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped);
+   titled.add_index< titled_book_index >();
+   titled.create<titled_book>( [](titled_book& b) { b.title = "Moby Dick"; b.authors = { "Herman Melville" }; } );
+   chainbase::database titled_fork = titled.fork();
+   titled_fork.modify( titled_fork.get(titled_book::id_type(0)), [](titled_book& b) { b.title = "Billy Budd"; } );
+   BOOST_TEST(titled_fork.get(titled_book::id_type(0)).title == "Billy Budd");
+   BOOST_TEST(titled_fork.get(titled_book::id_type(0)).authors[0] == "Herman Melville");
+   BOOST_TEST(titled.get(titled_book::id_type(0)).title == "Moby Dick");
+
+   // a fork shares the pages of the file which were not modified, yet never sees what is written to the file later
+   temp_directory saved_dir;
+   std::optional<chainbase::database> saved;
+   saved.emplace(saved_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+   saved->add_index< book_index >();
+   for (int i = 0; i < 1000; ++i)
+      saved->create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   saved->checkpoint();
+   saved->modify( saved->get(book::id_type(0)), [](book& b) { b.a = 10000; } );
+   chainbase::database saved_fork = saved->fork();
+   BOOST_TEST(saved_fork.get(book::id_type(0)).a == 10000);
+   saved->modify( saved->get(book::id_type(500)), [](book& b) { b.a = 20000; } );
+   saved->remove( saved->get(book::id_type(700)) );
+   saved->checkpoint();
+   BOOST_TEST(saved_fork.get(book::id_type(500)).a == 500);
+   BOOST_TEST(saved_fork.get_index<book_index>().indices().size() == 1000u);
+   saved.reset();
+   {
+      chainbase::database reopened(saved_dir.path(), database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+      reopened.add_index< book_index >();
+      reopened.modify( reopened.get(book::id_type(300)), [](book& b) { b.a = 30000; } );
+   }
+   BOOST_TEST(saved_fork.get(book::id_type(300)).a == 300);
+   BOOST_TEST(saved_fork.get(book::id_type(700)).a == 700);
+   saved_fork.modify( saved_fork.get(book::id_type(3)), [](book& b) { b.a = 40000; } );
+   BOOST_TEST(saved_fork.get(book::id_type(3)).a == 40000);
+}
+
+BOOST_AUTO_TEST_CASE( parallel_batch ) {
+   temp_directory temp_dir;
+   chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+   db.add_index< book_index >();
+   for (int i = 0; i < 10; ++i)
+      db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   auto session = db.start_undo_session(true);
+
+   // the second transaction writing a book conflicts with the first one, and is run again after it
+   auto results = chainbase::apply_parallel(db, 20, [](size_t i, chainbase::transaction_context& ctx) {
+      const book& b = ctx.get(book::id_type(i % 10));
+      ctx.modify(b, [](book& b, int delta) { b.a += delta; b.b -= delta; }, 100);
+   }, 4);
+   BOOST_TEST_REQUIRE(results.size() == 20u);
+   for (size_t i = 0; i < 20; ++i) {
+      BOOST_TEST(!results[i].error);
+      BOOST_TEST(results[i].reexecuted == (i >= 10));
+   }
+   for (int i = 0; i < 10; ++i) {
+      BOOST_TEST(db.get(book::id_type(i)).a == i + 200);
+      BOOST_TEST(db.get(book::id_type(i)).b == -i - 200);
+   }
+
+   // a lookup which finds nothing conflicts with a creation, a transaction which throws is undone
+   results = chainbase::apply_parallel(db, 3, [](size_t i, chainbase::transaction_context& ctx) {
+      if (i < 2) {
+         const auto& by_a = ctx.get_index<book_index>().indices().get<1>();
+         if (by_a.find(1000) == by_a.end())
+            ctx.create<book>( [](book& b, int i) { b.a = 1000; b.b = -1000 - i; }, (int)i );
+      } else {
+         ctx.modify(ctx.get(book::id_type(5)), [](book& b) { b.a = 5000; });
+         throw std::runtime_error("failed transaction");
+      }
+   }, 4);
+   BOOST_TEST(!results[0].reexecuted);
+   BOOST_TEST(results[1].reexecuted);
+   BOOST_TEST(!results[1].error);
+   BOOST_TEST(!!results[2].error);
+   BOOST_CHECK_THROW(std::rethrow_exception(results[2].error), std::runtime_error);
+   BOOST_TEST(db.get_index<book_index>().indices().size() == 11u);
+   BOOST_TEST(db.get(book::id_type(10)).b == -1000);
+   BOOST_TEST(db.get(book::id_type(5)).a == 205);
+
+   session.undo();
+   BOOST_TEST(db.get_index<book_index>().indices().size() == 10u);
+   BOOST_TEST(db.get(book::id_type(5)).a == 5);
+}
+
+
+BOOST_AUTO_TEST_CASE( interned_shared_payloads ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   const std::string author { "Herman Melville" };
+   const std::vector<int> numbers { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      BOOST_REQUIRE(db.get_intern_table() == nullptr);
+      db.enable_interning();
+      const auto& table = *db.get_intern_table();
+      db.add_index< titled_book_index >();
+
+      const auto& b0 = db.create<titled_book>( [&]( titled_book& b) {
+         b.title = "Moby Dick";
+         b.authors = { author };
+      } );
+      const auto& b1 = db.create<titled_book>( [&]( titled_book& b) {
+         b.title = "Typee: A Peep at Polynesian Life";
+         b.authors = { author };
+      } );
+      BOOST_REQUIRE(b0.authors[0].is_interned());
+      BOOST_REQUIRE_EQUAL(b0.authors[0].data(), b1.authors[0].data());
+      BOOST_REQUIRE(!b0.authors.is_interned());  // elements are not trivially copyable
+      BOOST_REQUIRE_EQUAL(table.stats().num_hits, 1u);
+      const size_t num_entries = table.stats().num_entries;
+
+      // modifying an interned string gives it its own payload, and undo restores the shared one
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( b1, [&]( titled_book& b ) {
+            shared_string s = b.authors[0];
+            s.append(std::string_view{" (1819-1891)"});
+            BOOST_REQUIRE(!s.is_interned());
+            b.authors = { s };
+         });
+         BOOST_REQUIRE_EQUAL(b1.authors[0], author + " (1819-1891)");
+         BOOST_REQUIRE_EQUAL(b0.authors[0], author);
+      }
+      BOOST_REQUIRE_EQUAL(b1.authors[0], author);
+      BOOST_REQUIRE_EQUAL(b0.authors[0].data(), b1.authors[0].data());
+
+      // the last reference to an interned payload removes it from the table
+      db.remove(b0);
+      db.remove(b1);
+      BOOST_REQUIRE_LT(table.stats().num_entries, num_entries);
+   }
+
+   {
+      // interning stays enabled when the database is reopened, and covers vectors of trivially copyable types
+      pinnable_mapped_file pmf(temp, true, 0, false, pinnable_mapped_file::map_mode::mapped);
+      BOOST_REQUIRE(pmf.get_intern_table() != nullptr);
+      const size_t num_entries = pmf.get_intern_table()->stats().num_entries;
+      auto* seg_mgr = pmf.get_segment_manager();
+
+      using int_vector = shared_cow_vector<int>;
+      using vector_vector = bip::vector<int_vector, chainbase::allocator<int_vector>>;
+      vector_vector* vectors = seg_mgr->construct<vector_vector>(bip::anonymous_instance)(chainbase::allocator<int_vector>(seg_mgr));
+      vectors->emplace_back(numbers);
+      vectors->emplace_back(numbers.data(), numbers.size());
+      BOOST_REQUIRE((*vectors)[0].is_interned());
+      BOOST_REQUIRE_EQUAL((*vectors)[0].data(), (*vectors)[1].data());
+      BOOST_REQUIRE_EQUAL(pmf.get_intern_table()->stats().num_entries, num_entries + 1);
+
+      (*vectors)[1].push_back(9);
+      BOOST_REQUIRE(!(*vectors)[1].is_interned());
+      BOOST_REQUIRE_EQUAL((*vectors)[0].size(), numbers.size());
+      BOOST_REQUIRE_EQUAL((*vectors)[1].size(), numbers.size() + 1);
+
+      // an empty vector keeping reserved capacity is not interned
+      vectors->emplace_back();
+      (*vectors)[2].reserve(16);
+      const int_vector empty;                        // not in the segment, so its contents are copied
+      (*vectors)[2] = empty;
+      BOOST_REQUIRE_EQUAL((*vectors)[2].size(), 0u);
+      BOOST_REQUIRE(!(*vectors)[2].is_interned());
+
+      seg_mgr->destroy_ptr(vectors);
+      BOOST_REQUIRE_EQUAL(pmf.get_intern_table()->stats().num_entries, num_entries);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( build_shared_fields_in_place ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+
+   chainbase::database db(temp, database::read_write, 1024*1024*8);
+   db.add_index< titled_book_index >();
+   const auto& ss_alloc = db.get_small_size_allocator();
+   auto num_allocs = [&]() {
+      uint64_t res = 0;
+      for (size_t i = 0; i < small_size_allocator_t::num_size_classes; ++i)
+         res += ss_alloc.stats(i).num_allocs;
+      return res;
+   };
+
+   // non-contiguous ranges are copied straight into the segment
+   const std::string title { "The Adventures of Huckleberry Finn" };
+   const std::list<char> title_chars(title.begin(), title.end());
+   const std::deque<std::string> authors { "Mark Twain", "Samuel Langhorne Clemens" };
+
+   const uint64_t allocs_before = num_allocs();
+   const auto& book = db.create<titled_book>( [&]( titled_book& b) {
+      b.title.assign(title_chars.begin(), title_chars.end());
+      b.authors.assign(authors.begin(), authors.end());
+   } );
+   BOOST_REQUIRE_EQUAL(book.title, title);
+   BOOST_REQUIRE_EQUAL(book.authors.size(), authors.size());
+   BOOST_REQUIRE_EQUAL(book.authors[0], authors[0]);
+   BOOST_REQUIRE_EQUAL(book.authors[1], authors[1]);
+   BOOST_REQUIRE_EQUAL(num_allocs() - allocs_before, 4u); // title, authors vector, and one per author
+
+   db.modify( book, [&]( titled_book& b ) {
+      b.authors.emplace_back(std::string_view{"Clemens"});
+      b.title.assign(title.begin(), title.begin() + 4);
+   });
+   BOOST_REQUIRE_EQUAL(book.title, std::string_view{"The "});
+   BOOST_REQUIRE(book.title.is_inline());
+   BOOST_REQUIRE_EQUAL(book.authors.size(), 3u);
+   BOOST_REQUIRE_EQUAL(book.authors[2], std::string_view{"Clemens"});
+
+   shared_string on_stack(title_chars.begin(), title_chars.end());
+   BOOST_REQUIRE_EQUAL(on_stack, title);
+}
+
+BOOST_AUTO_TEST_CASE( lz_codec_roundtrip ) {
+   std::mt19937 gen(42);
+   auto check = [](const std::string& input) {
+      std::vector<char> compressed(input.size() + input.size() / 255 + 16);
+      size_t csz = lz::compress(input.data(), input.size(), compressed.data(), compressed.size());
+      BOOST_REQUIRE_GT(csz, 0u);
+      std::string output(input.size(), '\0');
+      BOOST_REQUIRE(lz::decompress(compressed.data(), csz, output.data(), output.size()));
+      BOOST_REQUIRE(output == input);
+      if (input.size() > 1)
+         BOOST_REQUIRE(!lz::decompress(compressed.data(), csz / 2, output.data(), output.size()));
+      return csz;
+   };
+
+   std::string random_bytes(100000, '\0'), text, runs;
+   for (auto& c : random_bytes)
+      c = (char)gen();
+   for (size_t i = 0; text.size() < 100000; ++i)
+      text += "account" + std::to_string(i % 977) + " transfer " + std::to_string(i * 7919 % 100003) + "; ";
+   for (size_t i = 0; i < 100; ++i)
+      runs += std::string(i * 37, (char)i);
+
+   for (size_t sz : { 0, 1, 12, 13, 100, 4096 })
+      check(random_bytes.substr(0, sz));
+   check(random_bytes);
+   BOOST_REQUIRE_LT(check(text), text.size() / 2);
+   BOOST_REQUIRE_LT(check(runs), runs.size() / 20);
+
+   // incompressible data doesn't fit in a smaller buffer
+   std::vector<char> small(random_bytes.size() - random_bytes.size() / 8);
+   BOOST_REQUIRE_EQUAL(lz::compress(random_bytes.data(), random_bytes.size(), small.data(), small.size()), 0u);
+}
+
+BOOST_AUTO_TEST_CASE( compressed_shared_payloads ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+
+   std::string abi;
+   for (size_t i = 0; abi.size() < 20000; ++i)
+      abi += "{\"name\":\"field" + std::to_string(i % 50) + "\",\"type\":\"uint64\"},";
+   const std::string short_value(100, 'x');
+
+   {
+      pinnable_mapped_file pmf(temp, true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+      pmf.set_compression_threshold(1024);
+      auto* seg_mgr = pmf.get_segment_manager();
+
+      using string_vector = bip::vector<shared_string, chainbase::allocator<shared_string>>;
+      string_vector* strings = seg_mgr->construct<string_vector>("strings")(chainbase::allocator<shared_string>(seg_mgr));
+      strings->reserve(8);
+
+      const size_t free_before = seg_mgr->get_free_memory();
+      strings->emplace_back(abi);
+      BOOST_REQUIRE(strings->back().is_compressed());
+      BOOST_REQUIRE_LT(free_before - seg_mgr->get_free_memory(), abi.size() / 4);
+      strings->emplace_back(short_value);
+      BOOST_REQUIRE(!strings->back().is_compressed());       // hot small values stay uncompressed
+
+      // reads go through the decompression cache
+      const size_t cache_before = decompression_cache::memory_usage();
+      const shared_string& s0 = (*strings)[0];
+      BOOST_REQUIRE_EQUAL(s0.size(), abi.size());
+      BOOST_REQUIRE(s0 == abi);
+      BOOST_REQUIRE_EQUAL(s0.data()[s0.size()], '\0');
+      BOOST_REQUIRE_EQUAL(decompression_cache::memory_usage(), cache_before + abi.size() + 1);
+      BOOST_REQUIRE_EQUAL(s0.data(), s0.data());
+
+      // copies share the compressed payload, modifications get an uncompressed copy
+      strings->push_back(s0);
+      BOOST_REQUIRE((*strings)[2].is_compressed());
+      (*strings)[2].append(std::string_view{"!"});
+      BOOST_REQUIRE_EQUAL((*strings)[2], abi + "!");
+      BOOST_REQUIRE(s0 == abi);
+
+      // freeing the last reference drops the cached copy
+      strings->erase(strings->begin());
+      BOOST_REQUIRE_EQUAL(decompression_cache::memory_usage(), cache_before);
+
+      // an entry cached for an address which now holds another payload is never returned
+      std::vector<char> first(abi.size()), second(abi.size());
+      const std::string other = abi.substr(abi.size() / 2) + abi.substr(0, abi.size() / 2);
+      const size_t first_size = compressed_payload::compress(abi.data(), abi.size(), first.data(), first.size());
+      const size_t second_size = compressed_payload::compress(other.data(), other.size(), second.data(), second.size());
+      BOOST_REQUIRE(first_size && second_size);
+      const int address = 0;
+      BOOST_REQUIRE(decompression_cache::get(&address, first.data(), first_size, abi.size()) == abi);
+      BOOST_REQUIRE(decompression_cache::get(&address, second.data(), second_size, other.size()) == other);
+      decompression_cache::erase(&address);
+      BOOST_REQUIRE_EQUAL(decompression_cache::memory_usage(), cache_before);
+
+      // a decompressed copy lives as long as its payload, however many others are read meanwhile, and is
+      // shared by the threads
+      {
+         string_vector* others = seg_mgr->construct<string_vector>(bip::anonymous_instance)(chainbase::allocator<shared_string>(seg_mgr));
+         for (size_t i = 0; i < 40; ++i)
+            others->emplace_back(std::to_string(i) + abi);
+         BOOST_REQUIRE(others->front().is_compressed());
+         const std::string_view key((*others)[0].data(), (*others)[0].size());
+         const char* read_by_thread = nullptr;
+         std::thread t([&]() {
+            for (const shared_string& o : *others)
+               BOOST_REQUIRE(std::string_view(o.data(), o.size()).ends_with(abi));
+            read_by_thread = (*others)[1].data();
+         });
+         t.join();
+         for (const shared_string& o : *others)
+            BOOST_REQUIRE(std::string_view(o.data(), o.size()).ends_with(abi));
+         BOOST_REQUIRE(key.data() == (*others)[0].data());
+         BOOST_REQUIRE(key == "0" + abi);
+         BOOST_REQUIRE(read_by_thread == (*others)[1].data());
+         seg_mgr->destroy_ptr(others);
+         BOOST_REQUIRE_EQUAL(decompression_cache::memory_usage(), cache_before);
+      }
+
+      // vectors of trivially copyable types are compressed too
+      using int_vector = shared_cow_vector<uint32_t>;
+      std::vector<uint32_t> numbers(5000);
+      for (size_t i = 0; i < numbers.size(); ++i)
+         numbers[i] = i % 16;
+      int_vector* v = seg_mgr->construct<int_vector>("numbers")(numbers.data(), numbers.size());
+      BOOST_REQUIRE(v->is_compressed());
+      BOOST_REQUIRE(std::equal(v->begin(), v->end(), numbers.begin(), numbers.end()));
+      BOOST_REQUIRE_EQUAL((*v)[17], 1u);
+      v->push_back(7);
+      BOOST_REQUIRE(!v->is_compressed());
+      BOOST_REQUIRE_EQUAL(v->size(), numbers.size() + 1);
+      BOOST_REQUIRE_EQUAL((*v)[numbers.size()], 7u);
+      *v = int_vector(numbers.data(), numbers.size());
+   }
+
+   {
+      // the threshold and compressed payloads persist
+      pinnable_mapped_file pmf(temp, true, 0, false, pinnable_mapped_file::map_mode::mapped);
+      BOOST_REQUIRE_EQUAL(pmf.get_compression_threshold(), 1024u);
+      auto* seg_mgr = pmf.get_segment_manager();
+      using string_vector = bip::vector<shared_string, chainbase::allocator<shared_string>>;
+      auto* strings = seg_mgr->find<string_vector>("strings").first;
+      BOOST_REQUIRE_EQUAL(strings->size(), 2u);
+      BOOST_REQUIRE((*strings)[1] == abi + "!");
+      auto* v = seg_mgr->find<shared_cow_vector<uint32_t>>("numbers").first;
+      BOOST_REQUIRE_EQUAL(v->size(), 5000u);
+      BOOST_REQUIRE_EQUAL((*v)[4999], 4999u % 16);
+      seg_mgr->destroy_ptr(strings);
+      seg_mgr->destroy_ptr(v);
+   }
+}
+
+// -----------------------------------------------------------------------------
+//      Payloads written by a `CHAINB01` database are still read
+// -----------------------------------------------------------------------------
+BOOST_AUTO_TEST_CASE( chainb01_payloads ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   using string_vector = bip::vector<shared_string, chainbase::allocator<shared_string>>;
+   using int_vector    = shared_cow_vector<uint32_t>;
+   const std::string long_str(300, 'l');
+   const std::vector<uint32_t> numbers{ 1, 2, 3 };
+
+   // writes `bytes` the way `CHAINB01` did: a reference count and a size, followed by the payload
+   auto legacy_payload = [](segment_manager* seg_mgr, const void* bytes, uint32_t size, size_t num_bytes, size_t padding) {
+      char* p = (char*)seg_mgr->allocate(2 * sizeof(uint32_t) + num_bytes + padding);
+      const uint32_t header[2] = { 1, size };
+      std::memcpy(p, header, sizeof(header));
+      std::memcpy(p + sizeof(header), bytes, num_bytes);
+      std::memset(p + sizeof(header) + num_bytes, 0, padding);
+      return p;
+   };
+   // points `obj` (a `shared_cow_string` or a `shared_cow_vector`) to the payload `p`
+   auto point_to = [](void* obj, char* p) {
+      const int64_t offset = p - (char*)obj;
+      std::memcpy(obj, &offset, sizeof(offset));
+   };
+   auto header_id_on_disk = [&]() {
+      uint64_t id = 0;
+      std::ifstream f(temp / "shared_memory.bin", std::ios::binary);
+      f.read((char*)&id, sizeof(id));
+      return id;
+   };
+
+   {
+      pinnable_mapped_file pmf(temp, true, 1024 * 1024, false, pinnable_mapped_file::map_mode::mapped);
+      auto* seg_mgr = pmf.get_segment_manager();
+      string_vector* strings = seg_mgr->construct<string_vector>("strings")(chainbase::allocator<shared_string>(seg_mgr));
+      strings->resize(3);
+      point_to(&(*strings)[0], legacy_payload(seg_mgr, "abc", 3, 3, 1));   // short strings were not inline
+      point_to(&(*strings)[1], legacy_payload(seg_mgr, long_str.data(), long_str.size(), long_str.size(), 1));
+      point_to(&(*strings)[2], legacy_payload(seg_mgr, long_str.data(), long_str.size(), long_str.size(), 1));
+      int_vector* v = seg_mgr->construct<int_vector>("numbers")();
+      point_to(v, legacy_payload(seg_mgr, numbers.data(), numbers.size(), numbers.size() * sizeof(uint32_t), 0));
+   }
+   {
+      std::fstream f(temp / "shared_memory.bin", std::ios::binary | std::ios::in | std::ios::out);
+      f.write((const char*)&chainb01_header_id, sizeof(chainb01_header_id));
+   }
+
+   {
+      // opened for reading, the database is left as it is
+      pinnable_mapped_file pmf(temp, false, 0, false, pinnable_mapped_file::map_mode::mapped);
+      auto* strings = pmf.get_segment_manager()->find_no_lock<string_vector>("strings").first;
+      BOOST_REQUIRE((*strings)[0] == std::string_view{"abc"});
+      BOOST_REQUIRE_EQUAL((*strings)[0].data()[3], '\0');
+      BOOST_REQUIRE((*strings)[1] == long_str);
+      BOOST_REQUIRE(!(*strings)[1].is_inline() && !(*strings)[1].is_interned() && !(*strings)[1].is_compressed());
+      BOOST_REQUIRE_EQUAL((*strings)[1].capacity(), long_str.size());
+      auto* v = pmf.get_segment_manager()->find_no_lock<int_vector>("numbers").first;
+      BOOST_REQUIRE(std::equal(v->begin(), v->end(), numbers.begin(), numbers.end()));
+   }
+   BOOST_REQUIRE_EQUAL(header_id_on_disk(), chainb01_header_id);
+
+   {
+      // opened for writing, it is upgraded, and its payloads are replaced when modified
+      pinnable_mapped_file pmf(temp, true, 0, false, pinnable_mapped_file::map_mode::mapped);
+      BOOST_REQUIRE_EQUAL(header_id_on_disk(), header_id);
+      auto* seg_mgr = pmf.get_segment_manager();
+      const auto& ss_alloc = *pmf.get_small_size_allocator();
+      auto* strings = seg_mgr->find<string_vector>("strings").first;
+      auto* v = seg_mgr->find<int_vector>("numbers").first;
+
+      shared_string& s0 = (*strings)[0];
+      const char* legacy_chars = s0.data();
+      s0.append(std::string_view{"d"});
+      BOOST_REQUIRE(s0 == std::string_view{"abcd"});
+      BOOST_REQUIRE(s0.data() != legacy_chars);
+
+      (*strings)[2] = (*strings)[1];                     // shares the legacy payload, and frees the other one
+      BOOST_REQUIRE((*strings)[2].data() == (*strings)[1].data());
+      (*strings)[1].append(std::string_view{"!"});
+      BOOST_REQUIRE((*strings)[1] == long_str + "!");
+      BOOST_REQUIRE((*strings)[2] == long_str);
+
+      v->push_back(4);
+      BOOST_REQUIRE_EQUAL(v->size(), 4u);
+      BOOST_REQUIRE_EQUAL((*v)[0], 1u);
+      BOOST_REQUIRE_EQUAL((*v)[3], 4u);
+
+      // legacy payloads go back to the segment manager, not to the pools, which never served them
+      std::vector<size_t> num_free(small_size_allocator_t::num_size_classes);
+      for (size_t i = 0; i < num_free.size(); ++i)
+         num_free[i] = ss_alloc.stats(i).num_free;
+      const size_t free_memory = seg_mgr->get_free_memory();
+      (*strings)[2] = shared_string();
+      BOOST_REQUIRE_GT(seg_mgr->get_free_memory(), free_memory + long_str.size());
+      for (size_t i = 0; i < num_free.size(); ++i)
+         BOOST_REQUIRE_EQUAL(ss_alloc.stats(i).num_free, num_free[i]);
+      seg_mgr->destroy_ptr(strings);
+      seg_mgr->destroy_ptr(v);
+   }
+   BOOST_REQUIRE_EQUAL(header_id_on_disk(), header_id);
+}
+
+#ifndef _WIN32
+// runs `f` in a child process which then exits without saving its databases, as if it had crashed. `f` must
+// leak the databases it opens, so that their destructors don't run.
+template<typename F>
+static void run_and_crash(F&& f) {
+   std::cout.flush();
+   std::cerr.flush();
+   pid_t pid = fork();
+   BOOST_REQUIRE(pid >= 0);
+   if (pid == 0) {
+      try {
+         f();
+      } catch (...) {
+         _exit(1);
+      }
+      _exit(0);
+   }
+   int status = 0;
+   BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+   BOOST_REQUIRE(WIFEXITED(status));
+   BOOST_REQUIRE_EQUAL(WEXITSTATUS(status), 0);
+}
+
+BOOST_AUTO_TEST_CASE( checkpoint_survives_crash ) {
+   for (auto mode : { pinnable_mapped_file::map_mode::heap, pinnable_mapped_file::map_mode::mapped_private }) {
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+
+      run_and_crash([&]() {
+         auto& db = *new chainbase::database(temp, database::read_write, 1024*1024*8, false, mode);
+         db.add_index< book_index >();
+         const auto& b = db.create<book>( [](book& b) { b.a = 1; b.b = 2; } );
+         db.checkpoint();
+         db.modify( b, [](book& b) { b.a = 3; } );
+         db.create<book>( [](book& b) { b.a = 10; b.b = 20; } );
+         db.checkpoint();                                // only writes the pages modified since the first one
+         db.modify( b, [](book& b) { b.a = 5; } );       // lost in the crash
+         db.create<book>( [](book& b) { b.a = 10000; b.b = 200; } );
+      });
+
+      chainbase::database db(temp, database::read_write, 0, false, mode);
+      db.add_index< book_index >();
+      const auto& idx = db.get_index<book_index>().indices();
+      BOOST_REQUIRE_EQUAL(idx.size(), 2u);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 3);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(1)).a, 10);
+   }
+
+   {
+      // without a checkpoint, the file is left dirty
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+      run_and_crash([&]() {
+         auto& db = *new chainbase::database(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         db.set_checkpoint_interval(std::chrono::hours(1));
+         auto session = db.start_undo_session(true);
+         db.create<book>( [](book& b) { b.a = 1; b.b = 2; } );
+         session.push();
+      });
+      BOOST_REQUIRE_THROW(chainbase::database(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap),
+                          std::system_error);
+   }
+
+   {
+      // periodic checkpoints are taken at revision boundaries
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+      run_and_crash([&]() {
+         auto& db = *new chainbase::database(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         db.set_checkpoint_interval(std::chrono::milliseconds(1));
+         {
+            auto session = db.start_undo_session(true);
+            db.create<book>( [](book& b) { b.a = 1; b.b = 2; } );
+            session.push();
+         }
+         std::this_thread::sleep_for(std::chrono::milliseconds(5));
+         db.commit(db.revision());
+      });
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 1);
+   }
+}
+#endif
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE( write_protect_tracker_reports_written_pages ) {
+   const size_t pagesz = pagemap_accessor::page_size();
+   const size_t sz     = 64 * pagesz;
+   std::byte* mapping = (std::byte*)mmap(nullptr, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+   BOOST_REQUIRE(mapping != MAP_FAILED);
+   auto unmap = scope_exit([&]() { munmap(mapping, sz); });
+
+   auto tracker = write_protect_tracker::create({mapping, sz});
+   if (!tracker) {
+      BOOST_TEST_MESSAGE("userfaultfd write protection not supported, skipping");
+      return;
+   }
+
+   temp_directory temp_dir;
+   const auto file_path = temp_dir.path() / "file";
+   std::ofstream(file_path).close();
+   std::filesystem::resize_file(file_path, sz);
+   bip::file_mapping file(file_path.generic_string().c_str(), bip::read_write);
+
+   mapping[3 * pagesz]      = std::byte{1};
+   mapping[7 * pagesz + 10] = std::byte{2};
+   (void)*(volatile std::byte*)&mapping[9 * pagesz];             // reads don't count
+
+   size_t written_pages = 0;
+   BOOST_REQUIRE(tracker->update_file_from_region({mapping, sz}, file, 0, false, written_pages));
+   BOOST_REQUIRE_EQUAL(written_pages, 2u);
+   {
+      bip::mapped_region rgn(file, bip::read_only);
+      const std::byte* contents = (const std::byte*)rgn.get_address();
+      BOOST_REQUIRE(contents[3 * pagesz] == std::byte{1});
+      BOOST_REQUIRE(contents[7 * pagesz + 10] == std::byte{2});
+   }
+
+   // the written pages are protected again
+   written_pages = 0;
+   BOOST_REQUIRE(tracker->update_file_from_region({mapping, sz}, file, 0, false, written_pages));
+   BOOST_REQUIRE_EQUAL(written_pages, 0u);
+   mapping[3 * pagesz + 1] = std::byte{3};
+   BOOST_REQUIRE(tracker->update_file_from_region({mapping, sz}, file, 0, false, written_pages));
+   BOOST_REQUIRE_EQUAL(written_pages, 1u);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( heap_lazy_load ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   const int num_books = 100000;
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*64, false, pinnable_mapped_file::map_mode::mapped);
+      db.add_index< book_index >();
+      for (int i = 0; i < num_books; ++i)
+         db.create<book>( [&](book& b) { b.a = i; b.b = -i; } );
+   }
+   {
+      // the database is used right away, from several threads, while its pages are still being loaded
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap_lazy);
+      db.add_index< book_index >();
+      std::atomic<int> num_errors = 0;
+      std::vector<std::thread> readers;
+      for (int t = 0; t < 4; ++t) {
+         readers.emplace_back([&, t]() {
+            for (int i = num_books - 1 - t; i >= 0; i -= 4) {
+               if (db.get(book::id_type(i)).b != -i)
+                  ++num_errors;
+            }
+         });
+      }
+      for (auto& r : readers)
+         r.join();
+      BOOST_REQUIRE_EQUAL(num_errors, 0);
+      db.modify( db.get(book::id_type(num_books / 2)), [](book& b) { b.b = 1; } );
+      db.create<book>( [&](book& b) { b.a = num_books; b.b = 2; } );
+   }
+   {
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL(db.get_index<book_index>().indices().size(), (size_t)num_books + 1);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).b, 0);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(num_books / 2)).b, 1);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(num_books - 1)).b, -(num_books - 1));
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(num_books)).b, 2);
+   }
+
+   // the pages written while the file is loaded are saved once the loader is stopped, although the writes which follow
+   // are tracked from then on only
+   {
+      chainbase::database lazy(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap_lazy);
+      lazy.add_index< book_index >();
+      lazy.modify( lazy.get(book::id_type(1)), [](book& b) { b.b = 3; } );
+      try {
+         lazy.enable_journal();                 // waits for the loader
+      } catch (const std::runtime_error&) {
+      }
+      lazy.modify( lazy.get(book::id_type(num_books - 2)), [](book& b) { b.b = 4; } );
+   }
+   chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+   db.add_index< book_index >();
+   BOOST_REQUIRE_EQUAL(db.get(book::id_type(1)).b, 3);
+   BOOST_REQUIRE_EQUAL(db.get(book::id_type(num_books - 2)).b, 4);
+}
+
+BOOST_AUTO_TEST_CASE( zero_pages_are_saved_as_holes ) {
+   temp_directory temp_dir;
+   const auto& temp = temp_dir.path();
+   const size_t blob_size = 1024 * 1024;
+   {
+      pinnable_mapped_file pmf(temp, true, 1024 * 1024 * 16, false, pinnable_mapped_file::map_mode::heap);
+      char* blob = pmf.get_segment_manager()->construct<char>("blob")[blob_size]('x');
+      blob[blob_size - 1] = 'y';
+   }
+   {
+      // zeroing most of the blob leaves runs of zero pages which previously held data in the file
+      pinnable_mapped_file pmf(temp, true, 0, false, pinnable_mapped_file::map_mode::heap);
+      char* blob = pmf.get_segment_manager()->find<char>("blob").first;
+      BOOST_REQUIRE(blob != nullptr);
+      BOOST_REQUIRE_EQUAL(blob[0], 'x');
+      BOOST_REQUIRE_EQUAL(blob[blob_size - 1], 'y');
+      memset(blob + 4096, 0, blob_size - 8192);
+   }
+   for (auto mode : { pinnable_mapped_file::map_mode::heap, pinnable_mapped_file::map_mode::mapped }) {
+      pinnable_mapped_file pmf(temp, true, 0, false, mode);
+      const char* blob = pmf.get_segment_manager()->find<char>("blob").first;
+      BOOST_REQUIRE(blob != nullptr);
+      BOOST_REQUIRE(std::all_of(blob, blob + 4096, [](char c) { return c == 'x'; }));
+      BOOST_REQUIRE(std::all_of(blob + 4096, blob + blob_size - 4096, [](char c) { return c == 0; }));
+      BOOST_REQUIRE_EQUAL(blob[blob_size - 1], 'y');
+   }
+}
+
+BOOST_AUTO_TEST_CASE( incremental_flush ) {
+   const size_t db_size = 1024*1024*8;
+   for (auto mode : { pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap }) {
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+      {
+         chainbase::database db(temp, database::read_write, db_size, false, mode);
+         db.add_index< book_index >();
+         for (int i = 0; i < 1000; ++i) {
+            db.create<book>( [&](book& b) { b.a = i; b.b = i; } );
+            db.flush(db_size / 16);        // wraps around the file several times
+         }
+         db.checkpoint();
+      }
+      chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::mapped);
+      db.flush();                            // nothing to do
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(999)).a, 999);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( heap_reopen_saves_modified_pages ) {
+   for (auto mode : { pinnable_mapped_file::map_mode::heap, pinnable_mapped_file::map_mode::mapped_private }) {
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, mode);
+         db.add_index< book_index >();
+         for (int i = 0; i < 1000; ++i)
+            db.create<book>( [&](book& b) { b.a = i; b.b = i; } );
+      }
+      {
+         // pages untouched since the file was loaded must not be lost when only the modified ones are written
+         chainbase::database db(temp, database::read_write, 0, false, mode);
+         db.add_index< book_index >();
+         db.modify( db.get(book::id_type(500)), [](book& b) { b.a = -1; } );
+         db.remove( db.get(book::id_type(999)) );
+      }
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+      db.add_index< book_index >();
+      const auto& idx = db.get_index<book_index>().indices();
+      BOOST_REQUIRE_EQUAL(idx.size(), 999u);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 0);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(500)).a, -1);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(998)).b, 998);
+      BOOST_REQUIRE(db.find(book::id_type(999)) == nullptr);
+   }
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE( journal_survives_crash ) {
+   {
+      temp_directory temp_dir;
+      chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped);
+      BOOST_REQUIRE_THROW(db.enable_journal(), std::logic_error);
+   }
+   {
+      temp_directory temp_dir;
+      chainbase::database db(temp_dir.path(), database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+      try {
+         db.enable_journal();
+      } catch (const std::runtime_error&) {
+         BOOST_TEST_MESSAGE("userfaultfd write protection not supported, skipping");
+         return;
+      }
+   }
+
+   for (bool torn : { false, true }) {
+      for (auto mode : { pinnable_mapped_file::map_mode::heap, pinnable_mapped_file::map_mode::mapped_private }) {
+         temp_directory temp_dir;
+         const auto& temp = temp_dir.path();
+
+         run_and_crash([&]() {
+            auto& db = *new chainbase::database(temp, database::read_write, 1024*1024*8, false, mode);
+            db.add_index< book_index >();
+            db.enable_journal();
+            {
+               auto session = db.start_undo_session(true);
+               db.create<book>( [](book& b) { b.a = 1; b.b = 2; } );
+               session.push();
+            }
+            {
+               auto session = db.start_undo_session(true);           // journals revision 1
+               db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 2; } );
+               db.create<book>( [](book& b) { b.a = 10; b.b = 20; } );
+               session.push();
+            }
+            db.commit(db.revision());                                // journals revision 2
+            db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 3; } );   // lost in the crash
+         });
+
+         const auto journal = temp / "shared_memory.journal";
+         BOOST_REQUIRE(std::filesystem::exists(journal));
+         if (torn)
+            std::filesystem::resize_file(journal, std::filesystem::file_size(journal) - 1);
+
+         chainbase::database db(temp, database::read_write, 0, false, mode);
+         BOOST_REQUIRE(!std::filesystem::exists(journal));
+         db.add_index< book_index >();
+         if (torn) {
+            BOOST_REQUIRE_EQUAL(db.revision(), 1);
+            BOOST_REQUIRE_EQUAL(db.get_index<book_index>().indices().size(), 1u);
+            BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 1);
+         } else {
+            BOOST_REQUIRE_EQUAL(db.revision(), 2);
+            BOOST_REQUIRE_EQUAL(db.get_index<book_index>().indices().size(), 2u);
+            BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 2);
+            BOOST_REQUIRE_EQUAL(db.get(book::id_type(1)).a, 10);
+         }
+      }
+   }
+
+   // the journal of a database closed cleanly is older than its file, and must not be replayed
+   {
+      temp_directory temp_dir;
+      const auto& temp = temp_dir.path();
+      const auto journal = temp / "shared_memory.journal";
+      const auto stale_journal = temp / "stale.journal";
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         db.enable_journal();
+         {
+            auto session = db.start_undo_session(true);
+            db.create<book>( [](book& b) { b.a = 1; b.b = 2; } );
+            session.push();
+         }
+         db.commit(db.revision());
+         std::filesystem::copy_file(journal, stale_journal);
+         {
+            auto session = db.start_undo_session(true);
+            db.modify( db.get(book::id_type(0)), [](book& b) { b.a = 2; } );
+            session.push();
+         }
+         db.commit(db.revision());
+      }
+      std::filesystem::rename(stale_journal, journal);
+
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap);
+      BOOST_REQUIRE(!std::filesystem::exists(journal));
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL(db.revision(), 2);
+      BOOST_REQUIRE_EQUAL(db.get(book::id_type(0)).a, 2);
+   }
+}
+#endif
 
 // behavior of these tests are dependent on linux's overcommit behavior, they are also dependent on the system not having
 // enough memory+swap to balk at 6TB request
@@ -1,6 +1,9 @@
 #include <chainbase/undo_index.hpp>
 #include <chainbase/chainbase.hpp>
 #include <filesystem>
+#include <map>
+#include <random>
+#include <vector>
 
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -868,5 +871,192 @@ BOOST_AUTO_TEST_CASE(test_project) {
    fs::remove_all( temp );
 }
 
+BOOST_AUTO_TEST_CASE(test_revision_view) {
+   fs::path temp = fs::temp_directory_path() / "pinnable_mapped_file";
+   try {
+      chainbase::pinnable_mapped_file db(temp, true, 1024 * 1024, false, chainbase::pinnable_mapped_file::map_mode::mapped);
+      test_allocator<basic_element_t> alloc(db.get_segment_manager());
+      undo_index_in_segment<test_element_t, test_allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::secondary> > > i0(alloc);
+      using state = std::map<uint64_t, int>;
+      auto current_state = [&]() {
+         state res;
+         for (const auto& elem : *i0)
+            res.emplace(elem.id, elem.secondary);
+         return res;
+      };
+      auto check_revision = [&](uint64_t revision, const state& expected, uint64_t next_id) {
+         auto view = i0->get_view_at(revision);
+         BOOST_TEST(view.revision() == revision);
+         state actual;
+         for (const auto& elem : view)
+            BOOST_TEST(actual.emplace(elem.id, elem.secondary).second);
+         BOOST_TEST((actual == expected));
+         for (uint64_t id = 0; id < next_id; ++id) {
+            auto it = expected.find(id);
+            for (const test_element_t* elem : { view.find(id), i0->find_at(id, revision) }) {
+               BOOST_TEST((elem != nullptr) == (it != expected.end()));
+               if (elem && it != expected.end())
+                  BOOST_TEST(elem->secondary == it->second);
+            }
+         }
+      };
+      auto check_view = [&](const state& expected, uint64_t next_id) {
+         BOOST_TEST(i0->get_committed_view().revision() == i0->undo_stack_revision_range().first);
+         check_revision(i0->undo_stack_revision_range().first, expected, next_id);
+      };
+
+      int next_secondary = 0;
+      for (int i = 0; i < 20; ++i)
+         i0->emplace([&](test_element_t& elem) { elem.secondary = next_secondary++; });
+      check_view(current_state(), 20);
+
+      std::mt19937 rng(7);
+      std::vector<state> session_states;
+      std::vector<decltype(i0->start_undo_session(true))> sessions;
+      for (int s = 0; s < 4; ++s) {
+         session_states.push_back(current_state());
+         sessions.push_back(i0->start_undo_session(true));
+         for (int op = 0; op < 60; ++op) {
+            auto st = current_state();
+            if (st.empty() || rng() % 3 == 0) {
+               i0->emplace([&](test_element_t& elem) { elem.secondary = next_secondary++; });
+               continue;
+            }
+            auto it = st.begin();
+            std::advance(it, rng() % st.size());
+            const test_element_t& elem = *i0->find(it->first);
+            if (rng() % 2)
+               i0->modify(elem, [&](test_element_t& e) { e.secondary = next_secondary++; });
+            else
+               i0->remove(elem);
+         }
+         check_view(session_states.front(), next_secondary + 20);
+      }
+      for (auto& session : sessions)
+         session.push();
+
+      // every revision of the undo stack can be read
+      session_states.push_back(current_state());
+      const uint64_t first = i0->undo_stack_revision_range().first;
+      for (uint64_t r = first; r <= i0->revision(); ++r)
+         check_revision(r, session_states[r - first], next_secondary + 20);
+      BOOST_CHECK_THROW(i0->get_view_at(first - 1), std::out_of_range);
+      BOOST_CHECK_THROW(i0->find_at(0, i0->revision() + 1), std::out_of_range);
+      i0->squash();
+      session_states.erase(session_states.end() - 2);
+      for (uint64_t r = first; r <= i0->revision(); ++r)
+         check_revision(r, session_states[r - first], next_secondary + 20);
+
+      // the view follows the committed revision
+      i0->commit(i0->undo_stack_revision_range().first + 2);
+      check_view(session_states[2], next_secondary + 20);
+      i0->undo();
+      check_view(session_states[2], next_secondary + 20);
+      check_revision(i0->revision(), session_states[2], next_secondary + 20);
+      i0->commit(i0->revision());
+      check_view(current_state(), next_secondary + 20);
+   } catch ( ... ) {
+      fs::remove_all( temp );
+      throw;
+   }
+   fs::remove_all( temp );
+}
+
+#ifdef CHAINBASE_OBSERVERS
+BOOST_AUTO_TEST_CASE(test_observers) {
+   fs::path temp = fs::temp_directory_path() / "pinnable_mapped_file";
+   try {
+      chainbase::pinnable_mapped_file db(temp, true, 1024 * 1024, false, chainbase::pinnable_mapped_file::map_mode::mapped);
+      test_allocator<basic_element_t> alloc(db.get_segment_manager());
+      undo_index_in_segment<test_element_t, test_allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::secondary> > > i0(alloc);
+
+      // mirrors the index from the notifications
+      struct mirror : chainbase::undo_index_observer<test_element_t> {
+         std::map<uint64_t, int> values;
+         void on_create(const test_element_t& v) override { BOOST_TEST(values.emplace(v.id, v.secondary).second); }
+         void on_modify(const test_element_t& o, const test_element_t& n) override {
+            BOOST_TEST(values.at(o.id) == o.secondary);
+            values[n.id] = n.secondary;
+         }
+         void on_remove(const test_element_t& v) override {
+            BOOST_TEST(values.at(v.id) == v.secondary);
+            values.erase(v.id);
+         }
+      } m;
+      struct batches : chainbase::batched_undo_index_observer<test_element_t> {
+         std::vector<std::pair<uint64_t, size_t>> delivered;
+         void on_batch(uint64_t revision, const std::map<id_type, change>& changes) override {
+            delivered.emplace_back(revision, changes.size());
+         }
+         void on_batch_lost(uint64_t) override { BOOST_FAIL("no change should be lost"); }
+      } b;
+      i0->add_observer(m);
+      i0->add_observer(b);
+      auto check_mirror = [&]() {
+         std::map<uint64_t, int> expected;
+         for (const auto& elem : *i0)
+            expected.emplace(elem.id, elem.secondary);
+         BOOST_TEST((m.values == expected));
+      };
+
+      i0->emplace([](test_element_t& elem) { elem.secondary = 0; });
+      i0->emplace([](test_element_t& elem) { elem.secondary = 1; });
+      check_mirror();
+      {
+         auto session = i0->start_undo_session(true);                  // delivers the two creates
+         i0->modify(i0->get(0), [](test_element_t& elem) { elem.secondary = 10; });
+         i0->modify(i0->get(0), [](test_element_t& elem) { elem.secondary = 20; });
+         i0->remove(i0->get(1));
+         i0->emplace([](test_element_t& elem) { elem.secondary = 2; });
+         check_mirror();
+      }                                                                 // undone: nothing to deliver
+      check_mirror();
+      {
+         auto session = i0->start_undo_session(true);
+         i0->modify(i0->get(1), [](test_element_t& elem) { elem.secondary = 11; });
+         i0->emplace([](test_element_t& elem) { elem.secondary = 3; });
+         i0->remove(i0->get(2));                                        // created and removed: not delivered
+         session.push();
+      }
+      i0->commit(i0->revision());                                       // delivers the modify
+      check_mirror();
+      BOOST_TEST(b.delivered.size() == 2u);
+      BOOST_TEST(b.delivered[0].second == 2u);
+      BOOST_TEST(b.delivered[1].first == i0->revision());
+      BOOST_TEST(b.delivered[1].second == 1u);
+
+      // changes delivered before the session is undone are reverted by another batch
+      {
+         auto session = i0->start_undo_session(true);
+         i0->modify(i0->get(0), [](test_element_t& elem) { elem.secondary = 30; });
+         auto inner = i0->start_undo_session(true);                    // delivers the first modify
+         i0->modify(i0->get(1), [](test_element_t& elem) { elem.secondary = 31; });
+         inner.squash();                                                // delivers the second one
+      }
+      check_mirror();
+      BOOST_TEST(b.delivered.size() == 5u);
+      BOOST_TEST(b.delivered[4].second == 2u);
+
+      // an object whose modification conflicts, and which has no backup, is removed with its value before it
+      BOOST_CHECK_THROW(i0->modify(i0->get(0), [&](test_element_t& elem) { elem.secondary = i0->get(1).secondary; }), std::logic_error);
+      BOOST_TEST(i0->find(0) == nullptr);
+      check_mirror();
+
+      i0->remove_observer(m);
+      i0->remove_observer(b);
+      i0->emplace([](test_element_t& elem) { elem.secondary = 4; });
+      BOOST_TEST(m.values.size() == 1u);
+   } catch ( ... ) {
+      fs::remove_all( temp );
+      throw;
+   }
+   fs::remove_all( temp );
+}
+#endif
+
 
 BOOST_AUTO_TEST_SUITE_END()